@@ -1,5 +1,8 @@
 // bohuno-database.cpp
 
+#include <algorithm>
+#include <vector>
+
 #include "common.hpp"
 
 #include "bohuno-database.hpp"
@@ -8,10 +11,33 @@ namespace bohuno {
 
    static const int IMPORT_BATCH_SIZE = 25000;
 
+   namespace {
+
+      class hash_order
+      {
+         public:
+
+            hash_order(pyzor::hash const* hashes)
+               : hashes_(hashes)
+            {
+            }
+
+            bool operator()(size_t a, size_t b) const
+            {
+               return memcmp(hashes_[a].data_, hashes_[b].data_, sizeof(hashes_[a].data_)) < 0;
+            }
+
+         private:
+
+            pyzor::hash const* hashes_;
+      };
+
+   }
+
    ///
 
-   database::database(boost::filesystem::path const& home)
-      : home_(home)
+   database::database(boost::filesystem::path const& home, bool recover)
+      : home_(home), recover_(recover), filter_skips_(0), filter_false_positives_(0)
    {
       setup();
    }
@@ -49,7 +75,10 @@ namespace bohuno {
 
       // Open the environment
       
-      u_int32_t flags =  DB_CREATE | DB_INIT_TXN | DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_MPOOL | DB_RECOVER;
+      u_int32_t flags =  DB_CREATE | DB_INIT_TXN | DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_MPOOL;
+      if (recover_) {
+         flags |= DB_RECOVER;
+      }
       
       ret = env_->open(env_, home_.string().c_str(), flags, 0);
       if (ret != 0) {
@@ -154,6 +183,11 @@ namespace bohuno {
    bool database::lookup(pyzor::hash const& hash, pyzor::record& record)
    {
       memset(&record, 0, sizeof(pyzor::record));
+
+      if (filter_ && !filter_->may_contain(hash)) {
+         filter_skips_++;
+         return false;
+      }
       
       DBT key;
       memset(&key, 0, sizeof(DBT));
@@ -169,6 +203,9 @@ namespace bohuno {
       int ret = db_->get(db_, NULL, &key, &data, 0);
       if (ret != 0) {
          if (ret == DB_NOTFOUND) {
+            if (filter_) {
+               filter_false_positives_++;
+            }
             return false;
          } else {
             throw std::runtime_error("Database error");
@@ -179,6 +216,21 @@ namespace bohuno {
       }
    }
    
+   void database::lookup(pyzor::hash const* hashes, size_t n, pyzor::record* records, bool* found)
+   {
+      // Visit the keys in btree order so that neighbouring lookups share pages
+
+      std::vector<size_t> order(n);
+      for (size_t i = 0; i < n; i++) {
+         order[i] = i;
+      }
+      std::sort(order.begin(), order.end(), hash_order(hashes));
+
+      for (size_t i = 0; i < n; i++) {
+         found[order[i]] = this->lookup(hashes[order[i]], records[order[i]]);
+      }
+   }
+
    bool database::lookup_last(pyzor::hash& hash, pyzor::record& record)
    {
       DBC* cursor;
@@ -231,6 +283,10 @@ namespace bohuno {
       if (ret != 0) {
          throw std::runtime_error("Cannot insert record");
       }
+
+      if (filter_) {
+         filter_->add(hash);
+      }
    }
    
    int database::import(boost::iostreams::filtering_istream& in, database::import_progress_callback callback)
@@ -287,6 +343,10 @@ namespace bohuno {
          if (ret != 0) {
             throw std::runtime_error("Cannot insert record");
          }
+
+         if (filter_) {
+            filter_->add(hash);
+         }
          
          // If we imported enough then we commit the transaction
          
@@ -318,7 +378,11 @@ namespace bohuno {
          txn = NULL;
       }
       
-      //
+      // Imports can grow the database well past what the filter was sized for
+      
+      if (filter_ && filter_->keys() > filter_->capacity()) {
+         this->enable_filter();
+      }
             
       return n;
    }
@@ -330,4 +394,34 @@ namespace bohuno {
       }
    }
    
+   void database::enable_filter()
+   {
+      // All writes go through this class, so once built the filter stays complete
+
+      size_t capacity = 1024 * 1024;
+      for (;;) {
+         filter_.reset(new pyzor::bloom_filter(capacity));
+         size_t n = pyzor::add_signatures(db_, *filter_);
+         if (n <= capacity) {
+            break;
+         }
+         capacity = n * 2;
+      }
+   }
+
+   pyzor::bloom_filter const* database::filter() const
+   {
+      return filter_.get();
+   }
+
+   boost::uint64_t database::filter_skips() const
+   {
+      return filter_skips_;
+   }
+
+   boost::uint64_t database::filter_false_positives() const
+   {
+      return filter_false_positives_;
+   }
+
 }
@@ -8,7 +8,9 @@
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 
+#include "bloom_filter.hpp"
 #include "hash.hpp"
 #include "record.hpp"
 
@@ -24,7 +26,9 @@ namespace bohuno {
          
       public:
 
-         database(boost::filesystem::path const& home);
+         /// Without recovery the environment is joined as it is; a process that takes over from one
+         /// that still has the environment open must not run recovery on it.
+         database(boost::filesystem::path const& home, bool recover = true);
          ~database();
 
       public:
@@ -36,17 +40,29 @@ namespace bohuno {
 
          bool empty();
          bool lookup(pyzor::hash const& hash, pyzor::record& record);
+         void lookup(pyzor::hash const* hashes, size_t n, pyzor::record* records, bool* found);
          bool lookup_last(pyzor::hash& hash, pyzor::record& record);
          void insert(pyzor::hash const& hash, pyzor::record const& record);
          int import(boost::iostreams::filtering_istream& in, import_progress_callback callback = 0L);
          void checkpoint();
 
+      public:
+
+         void enable_filter();
+         pyzor::bloom_filter const* filter() const;
+         boost::uint64_t filter_skips() const;
+         boost::uint64_t filter_false_positives() const;
+
       private:
          
          boost::filesystem::path home_;
+         bool recover_;
          DB_ENV* env_;
          DB* db_;
          DB* index_;         
+         boost::shared_ptr<pyzor::bloom_filter> filter_;
+         boost::uint64_t filter_skips_;
+         boost::uint64_t filter_false_positives_;
    };
 
 } // namespace bohuno
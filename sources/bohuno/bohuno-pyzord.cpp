@@ -8,6 +8,7 @@
 #include <signal.h>
 
 #include <algorithm>
+#include <cstdlib>
 #include <string>
 
 #include <boost/bind.hpp>
@@ -16,20 +17,31 @@
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/shared_ptr.hpp>
 #include <asio.hpp>
 
 #include <db.h>
 
+#include "buffer_pool.hpp"
 #include "common.hpp"
 #include "daemon.hpp"
+#include "datagram.hpp"
+#include "handoff.hpp"
+#include "hot_digests.hpp"
 #include "hash.hpp"
 #include "license.hpp"
-#include "packet.hpp"
+#include "message.hpp"
 #include "record.hpp"
+#include "shm_server.hpp"
+#include "signature_table.hpp"
 #include "syslog.hpp"
 #include "statistics.hpp"
+#include "stream.hpp"
+#include "unix_socket.hpp"
+#include "uring.hpp"
 #include "wget.hpp"
 #include "md5_filter.hpp"
 
@@ -42,12 +54,14 @@ namespace bohuno {
       public:
 
          pyzord(pyzor::syslog& syslog, asio::io_service& io_service, boost::filesystem::path const& home,
-            std::string const& address, std::string const& port, bool verbose)
+            std::string const& address, std::string const& port, size_t batch_size, bool io_uring, bool filter,
+            boost::filesystem::path const& table, bool stream, std::string const& unix_path, std::string const& shm, std::string const& handoff, std::string const& hot_digests, bool verbose)
             : syslog_(syslog), io_service_(io_service),
-              home_(home), address_(address), port_(port), verbose_(verbose),
-              license_(home_ / "license"), database_(home_ / "db"),
-              statistics_timer_(io_service), checkpoint_timer_(io_service), updates_scan_timer_(io_service),
-              socket_(io_service), shutdown_(false),  download_in_progress_(false)
+              home_(home), address_(address), port_(port), verbose_(verbose), handoff_path_(handoff),
+              license_(home_ / "license"), database_(home_ / "db", !this->take_over()),
+              statistics_timer_(io_service), checkpoint_timer_(io_service), updates_scan_timer_(io_service), table_timer_(io_service),
+              drain_timer_(io_service), hot_timer_(io_service), handed_off_(false),
+              socket_(io_service), unix_socket_(io_service), batch_(batch_size), responses_(batch_.datagram_size()), shutdown_(false),  download_in_progress_(false)
          {
             // Check if our home is there - Is actually already checked by license and database
 
@@ -61,6 +75,30 @@ namespace bohuno {
                throw std::runtime_error("Database has not been initialized; please run setup.");
             }
 #endif
+            // Keep lookups for unknown digests away from the database
+
+            if (filter) {
+               database_.enable_filter();
+               syslog_.notice() << "Built the signature filter with " << (unsigned int) database_.filter()->keys() << " keys";
+            }
+
+            // A signature table replaces the database for lookups. It is rebuilt and swapped in from
+            // outside, so there are no updates to download.
+
+            if (!table.empty()) {
+               table_path_ = table;
+               table_.reset(new pyzor::signature_table(table));
+               syslog_.notice() << "Answering lookups from " << table.string() << " with "
+                                << (unsigned int) table_->size() << " signatures";
+            }
+
+            // Read the pages of the digests that were hot before the last stop, before the listener
+            // opens. The database handles are not free threaded, so this happens on this thread.
+
+            if (!hot_digests.empty()) {
+               this->warm_up(hot_digests);
+            }
+
             // Schedule the task that will upload statistics to the mothership
 
             this->schedule_statistics();
@@ -69,9 +107,14 @@ namespace bohuno {
             
             this->schedule_checkpoint();
 
-            // Schedule a periodic task that will collect a list of updates to download
+            // Schedule a periodic task that will collect a list of updates to download, or one that
+            // picks up a new signature table
 
-            this->schedule_updates_scan(5);
+            if (table_) {
+               this->schedule_table_reload();
+            } else {
+               this->schedule_updates_scan(5);
+            }
 
             // Resolve the address and start receiving Pyzor requests
             
@@ -86,31 +129,130 @@ namespace bohuno {
       
             asio::ip::udp::endpoint endpoint = *endpoint_iterator;
       
-            socket_.open(endpoint.protocol());
-            socket_.bind(endpoint);
+            int adopted = handoff_client_.adopt(pyzor::handoff_socket::udp);
+            if (adopted >= 0) {
+               socket_.assign(endpoint.protocol(), adopted);
+            } else {
+               socket_.open(endpoint.protocol());
+               socket_.bind(endpoint);
+            }
 
-            socket_.async_receive_from(
-               asio::buffer(data_, max_length),
-               sender_endpoint_,
-               boost::bind(&pyzord::handle_receive_from, this, asio::placeholders::error,
-                  asio::placeholders::bytes_transferred)
-            );
+            if (io_uring) {
+               try {
+                  uring_.reset(new pyzor::uring_listener(boost::bind(&pyzord::handle_request, this, _1, _2, _3, _4, _5, false)));
+                  uring_->start(socket_.native());
+               } catch (std::exception const& e) {
+                  syslog_.warning() << "Cannot use io_uring, falling back to asio: " << e.what();
+               }
+            }
+
+            if (!uring_) {
+               this->start_receive();
+            }
+
+            // Pipelined requests over TCP on the same address and port
+
+            if (stream) {
+               asio::ip::tcp::endpoint stream_endpoint(endpoint.address(), endpoint.port());
+               int acceptor = handoff_client_.adopt(pyzor::handoff_socket::tcp);
+               if (acceptor >= 0) {
+                  stream_.reset(new pyzor::stream_listener(syslog_, io_service_, stream_endpoint, acceptor));
+               } else {
+                  stream_.reset(new pyzor::stream_listener(syslog_, io_service_, stream_endpoint));
+               }
+               stream_->add_target(io_service_, boost::bind(&pyzord::handle_request, this, _1, _2, _3, _4, _5, false));
+               stream_->start();
+            }
+
+            // Local clients can skip the network stack
+
+            if (!unix_path.empty()) {
+               pyzor::bind_unix_socket(unix_socket_, unix_path, 0660);
+               unix_path_ = unix_path;
+               unix_request_.resize(batch_.datagram_size());
+               this->start_unix_receive();
+            }
+
+            // The database handles are not free threaded, so the ring is served from run()
+
+            if (!shm.empty()) {
+               shm_.reset(new pyzor::shm_server(shm, boost::bind(&pyzord::answer_shm_check, this, _1, _2, _3)));
+               syslog_.notice() << "Answering checks through shared memory segment " << shm;
+            }
+
+            // Everything is set up, so the previous server can go and the next one can take over
+
+            if (handoff_client_.connected()) {
+               handoff_client_.ready();
+               syslog_.notice() << "Took over the listening sockets; the previous server is draining";
+            }
+
+            if (!handoff_path_.empty()) {
+               handoff_.reset(new pyzor::handoff_server(handoff_path_, boost::bind(&pyzord::handoff_sockets, this),
+                  boost::bind(&pyzord::handed_off, this)));
+            }
          }
          
       public:
 
          void run()
          {
+            // The rings are waited on with a short timeout so that the timers and downloads on the
+            // io_service keep running on this same thread. When both are in use neither may sleep for
+            // long, and without io_uring the asio sockets are only served between waits on the shared
+            // memory ring.
+
+            while ((uring_ || shm_) && !shutdown_) {
+               if (uring_) {
+                  uring_->run_once(shm_ ? 0 : 100);
+
+                  if (uring_->failed()) {
+                     syslog_.warning() << "The kernel does not support multishot recvmsg; falling back to asio";
+                     uring_.reset();
+                     this->start_receive();
+                  }
+               }
+
+               if (shm_) {
+                  shm_->serve(1);
+               }
+
+               io_service_.poll();
+            }
+
             io_service_.run();
          }
 
          void handle_stop()
          {
+            // The handoff thread reads the sockets, so it goes first
+            if (handoff_) {
+               handoff_->stop();
+            }
             shutdown_ = true;
+            if (uring_) {
+               uring_->stop();
+            }
             socket_.close();
+            if (stream_) {
+               stream_->stop();
+            }
+            if (unix_socket_.is_open()) {
+               unix_socket_.close();
+               // After a handoff the file belongs to the new process
+               if (!handed_off_) {
+                  ::unlink(unix_path_.c_str());
+               }
+            }
             checkpoint_timer_.cancel();
             updates_scan_timer_.cancel();
             statistics_timer_.cancel();
+            table_timer_.cancel();
+            drain_timer_.cancel();
+            hot_timer_.cancel();
+            if (hot_) {
+               this->save_hot_digests();
+            }
          }
 
          void stop()
@@ -118,6 +260,70 @@ namespace bohuno {
             io_service_.post(boost::bind(&pyzord::handle_stop, this));
          }
 
+      private:
+
+         /// Runs before the database is opened, which must not be recovered while the old server uses it
+         bool take_over()
+         {
+            if (!handoff_path_.empty() && handoff_client_.take_over(handoff_path_)) {
+               syslog_.notice() << "Taking over from the server running on " << handoff_path_;
+               return true;
+            }
+            return false;
+         }
+
+         std::vector<pyzor::handoff_socket> handoff_sockets()
+         {
+            std::vector<pyzor::handoff_socket> sockets;
+            int native = socket_.is_open() ? ::dup(socket_.native()) : -1;
+            if (native >= 0) {
+               sockets.push_back(pyzor::handoff_socket(pyzor::handoff_socket::udp, native));
+            }
+            native = (stream_ && stream_->native() >= 0) ? ::dup(stream_->native()) : -1;
+            if (native >= 0) {
+               sockets.push_back(pyzor::handoff_socket(pyzor::handoff_socket::tcp, native));
+            }
+            return sockets;
+         }
+
+         void handed_off()
+         {
+            io_service_.post(boost::bind(&pyzord::handle_handed_off, this));
+         }
+
+         void handle_handed_off()
+         {
+            syslog_.notice() << "Handed the listening sockets to a new server; draining for " << (int) drain_interval << " seconds";
+
+            // The sockets and the open stream connections stay open for the replies that are
+            // still to be sent; only new stream connections are refused
+
+            handed_off_ = true;
+            if (uring_) {
+               uring_->stop();
+            }
+            asio::error_code error;
+            socket_.cancel(error);
+            unix_socket_.cancel(error);
+            if (stream_) {
+               stream_->stop_accepting();
+            }
+
+            drain_timer_.expires_from_now(boost::posix_time::seconds((long) drain_interval));
+            drain_timer_.async_wait(boost::bind(&pyzord::handle_drained, this, asio::placeholders::error));
+         }
+
+         void handle_drained(const asio::error_code& error)
+         {
+            // pyzord_main waits for a signal to shut down
+            if (!error) {
+               if (stream_) {
+                  stream_->stop();
+               }
+               ::kill(::getpid(), SIGTERM);
+            }
+         }
+
       private:
 
          void handle_statistics_failure(const asio::error_code& error)
@@ -345,98 +551,293 @@ namespace bohuno {
 
       private:
 
-         bool authorize_admin_request(pyzor::packet const& request, asio::ip::udp::endpoint const& sender_endpoint_)
+         void schedule_table_reload()
+         {
+            table_timer_.expires_from_now(boost::posix_time::seconds(30));
+            table_timer_.async_wait(boost::bind(&pyzord::table_reload, this, asio::placeholders::error));
+         }
+
+         void table_reload(const asio::error_code& error)
+         {
+            if (!error) {
+               if (table_->modified()) {
+                  try {
+                     table_.reset(new pyzor::signature_table(table_path_));
+                     syslog_.notice() << "Reloaded " << table_path_.string() << " with "
+                                      << (unsigned int) table_->size() << " signatures";
+                  } catch (std::exception const& e) {
+                     syslog_.error() << "Cannot reload the signature table: " << e.what();
+                  }
+               }
+               this->schedule_table_reload();
+            }
+         }
+
+         bool lookup(pyzor::hash const& hash, pyzor::record& record)
+         {
+            bool found = table_ ? table_->lookup(hash, record) : database_.lookup(hash, record);
+            if (found && hot_) {
+               hot_->record(hash);
+            }
+            return found;
+         }
+
+         void lookup(pyzor::hash const* hashes, size_t n, pyzor::record* records, bool* found)
+         {
+            if (table_) {
+               for (size_t i = 0; i < n; i++) {
+                  found[i] = table_->lookup(hashes[i], records[i]);
+               }
+            } else {
+               database_.lookup(hashes, n, records, found);
+            }
+
+            if (hot_) {
+               for (size_t i = 0; i < n; i++) {
+                  if (found[i]) {
+                     hot_->record(hashes[i]);
+                  }
+               }
+            }
+         }
+
+         void warm_up(boost::filesystem::path const& path)
+         {
+            hot_path_ = path;
+
+            std::vector<pyzor::hash> digests = pyzor::hot_digests::load(path);
+            if (!digests.empty()) {
+               boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+
+               std::vector<pyzor::record> records(digests.size());
+               boost::scoped_array<bool> found(new bool[digests.size()]);
+               this->lookup(&digests[0], digests.size(), &records[0], found.get());
+
+               syslog_.notice() << "Warmed up the database cache with " << (unsigned int) digests.size() << " digests in "
+                                << (unsigned int) (boost::posix_time::microsec_clock::universal_time() - started).total_milliseconds() << "ms";
+            }
+
+            // Only the lookups from now on are recorded
+
+            hot_.reset(new pyzor::hot_digests());
+            this->schedule_hot_save();
+         }
+
+         void schedule_hot_save()
+         {
+            hot_timer_.expires_from_now(boost::posix_time::seconds((long) hot_save_interval));
+            hot_timer_.async_wait(boost::bind(&pyzord::handle_hot_save, this, asio::placeholders::error));
+         }
+
+         void handle_hot_save(const asio::error_code& error)
+         {
+            if (!error) {
+               this->save_hot_digests();
+               this->schedule_hot_save();
+            }
+         }
+
+         void save_hot_digests()
+         {
+            try {
+               hot_->save(hot_path_);
+            } catch (std::exception const& e) {
+               syslog_.error() << "Cannot save the hot digests: " << e.what();
+            }
+         }
+
+         void answer_shm_check(pyzor::hash const& hash, boost::uint32_t& count, boost::uint32_t& wl_count)
+         {
+            request_statistics_.report();
+            check_statistics_.report();
+
+            pyzor::record r;
+            if (this->lookup(hash, r) == true) {
+               hit_statistics_.report();
+            }
+
+            count = r.report_count();
+            wl_count = r.whitelist_count();
+         }
+
+      private:
+
+         bool authorize_admin_request(pyzor::request const& req, asio::ip::udp::endpoint const& sender_endpoint_)
          {
             return (sender_endpoint_.address() == asio::ip::address::from_string("127.0.0.1"));
          }
 
-         void handle_receive_from(const asio::error_code& error, size_t bytes_recvd)
+         /// Trusted requests came in over the Unix socket, whose file mode decides who may send them
+         size_t handle_request(const char* data, size_t length, char* response, size_t response_size,
+            asio::ip::udp::endpoint const& sender_endpoint, bool trusted)
          {
-            if (!error && bytes_recvd > 0)
-            {
-               // Parse the request
-               
-               pyzor::packet res, req;
-         
-               if (!pyzor::packet::parse(req, data_, bytes_recvd)) {
-                  res.set("Thread", req.get("Thread"));
-                  res.set("PV", "2.0");
-                  res.set("Code", "400");
-                  res.set("Diag", "Bad Request");
-               } else {
-                  res.set("Thread", req.get("Thread"));
-                  res.set("PV", "2.0");
-                  res.set("Diag", "OK");
-                  res.set("Code", "200");
-                  if (req.get("PV") != "2.0") {
-                     res.set("Code", "505");
-                     res.set("Diag", "Version Not Supported");                  
-                  } else {
-                     request_statistics_.report();
-                     
-                     if (req.get("Op") == "shutdown" || req.get("Op") == "statistics") {
-                        if (!authorize_admin_request(req, sender_endpoint_)) {
-                           res.set("Code", "401");
-                           res.set("Diag", "Unauthorized");
-                        } else {
-                           if (req.get("Op") == "shutdown") {
-                              shutdown_ = true;
-                           } else if (req.get("Op") == "statistics") {
-                              res.set("Stats-Average-Requests", boost::lexical_cast<std::string>(request_statistics_.average()));
-                              res.set("Stats-Average-Checks", boost::lexical_cast<std::string>(check_statistics_.average()));
-                              res.set("Stats-Average-Hits", boost::lexical_cast<std::string>(hit_statistics_.average()));
-                              res.set("Stats-Total-Requests", boost::lexical_cast<std::string>(request_statistics_.total()));
-                              res.set("Stats-Total-Checks", boost::lexical_cast<std::string>(check_statistics_.total()));
-                              res.set("Stats-Total-Hits", boost::lexical_cast<std::string>(hit_statistics_.total()));
-                           }
-                        }
+            // Parse the request
+            
+            pyzor::request req;
+            pyzor::reply res;
+
+            bool valid = req.parse(data, length);
+            res.respond_to(req);
+      
+            if (!valid) {
+               res.status(400, "Bad Request");
+            } else if (req.pv != "2.0") {
+               res.status(505, "Version Not Supported");
+            } else {
+               request_statistics_.report();
+
+               switch (req.op_) {
+                  case pyzor::request::op_shutdown:
+                  case pyzor::request::op_statistics:
+                     if (!trusted && !authorize_admin_request(req, sender_endpoint)) {
+                        res.status(401, "Unauthorized");
+                     } else if (req.op_ == pyzor::request::op_shutdown) {
+                        shutdown_ = true;
                      } else {
-                        if (req.get("Op") == "check") {
-                           check_statistics_.report();
-                           if (verbose_) {
-                              syslog_.debug() << "Request to check digest " << req.get("Op-Digest");
-                           }                  
-                           pyzor::record r;
-                           if (database_.lookup(pyzor::hash(req.get("Op-Digest")), r) == true) {
-                              hit_statistics_.report();
-                           }
-                           res.set("Count", boost::lexical_cast<std::string>(r.report_count()));
-                           res.set("WL-Count", boost::lexical_cast<std::string>(r.whitelist_count()));
-                        } else if (req.get("Op") == "ping") {
-                           // Nothing to do for ping, just send back a plain response
-                        } else {
-                           res.set("Code", "501");
-                           res.set("Diag", "Not supported operation");
+                        res.statistic("Stats-Average-Checks", check_statistics_.average());
+                        res.statistic("Stats-Average-Hits", hit_statistics_.average());
+                        res.statistic("Stats-Average-Requests", request_statistics_.average());
+                        if (database_.filter() != NULL) {
+                           res.statistic("Stats-Filter-Bytes", database_.filter()->size_in_bytes());
+                           res.statistic("Stats-Filter-False-Positives", database_.filter_false_positives());
+                           res.statistic("Stats-Filter-Keys", database_.filter()->keys());
+                           res.statistic("Stats-Filter-Skipped", database_.filter_skips());
                         }
+                        if (shm_) {
+                           res.statistic("Stats-Shm-Checks", shm_->served());
+                        }
+                        if (table_) {
+                           res.statistic("Stats-Table-Signatures", table_->size());
+                        }
+                        res.statistic("Stats-Total-Checks", check_statistics_.total());
+                        res.statistic("Stats-Total-Hits", hit_statistics_.total());
+                        res.statistic("Stats-Total-Requests", request_statistics_.total());
                      }
+                     break;
+
+                  case pyzor::request::op_check: {
+                     check_statistics_.report();
+                     if (verbose_) {
+                        syslog_.debug() << "Request to check digest " << boost::lexical_cast<std::string>(req.digest);
+                     }
+                     pyzor::record r;
+                     if (this->lookup(req.digest, r) == true) {
+                        hit_statistics_.report();
+                     }
+                     res.counts(r.report_count(), r.whitelist_count());
+                     break;
                   }
+
+                  case pyzor::request::op_mcheck: {
+                     pyzor::record records[pyzor::request::max_digests];
+                     bool found[pyzor::request::max_digests];
+                     this->lookup(req.digests, req.digest_count, records, found);
+                     for (size_t i = 0; i < req.digest_count; i++) {
+                        check_statistics_.report();
+                        if (found[i]) {
+                           hit_statistics_.report();
+                        }
+                        res.counts(records[i].report_count(), records[i].whitelist_count());
+                     }
+                     break;
+                  }
+
+                  case pyzor::request::op_ping:
+                     // Nothing to do for ping, just send back a plain response
+                     break;
+
+                  default:
+                     res.status(501, "Not supported operation");
+                     break;
                }
+            }
+
+            return res.archive(response, response_size);
+         }
+
+         void handle_receive_from(const asio::error_code& error, size_t bytes_recvd)
+         {
+            if (!error && bytes_recvd > 0)
+            {
+               // Pick up whatever else is already waiting on the socket
+
+               batch_.set_request(0, bytes_recvd, sender_endpoint_);
+               size_t n = batch_.receive(socket_.native(), 1);
+
+               // Send back the replies. A single reply goes out asynchronously from a pooled buffer.
                
-               // Send back the reply
-               
-               size_t length = res.archive(data_, sizeof(data_));
-               
-               socket_.async_send_to(
-                  asio::buffer(data_, length),
-                  sender_endpoint_,
-                  boost::bind(&pyzord::handle_send_to, this, asio::placeholders::error, asio::placeholders::bytes_transferred)
-               );
+               if (batch_.enabled()) {
+                  for (size_t i = 0; i < n; i++) {
+                     batch_.set_response(i, handle_request(batch_.request(i), batch_.request_length(i),
+                        batch_.response(i), batch_.datagram_size(), batch_.endpoint(i), false));
+                  }
+                  batch_.send(socket_.native(), n);
+               } else {
+                  char* response = responses_.acquire();
+                  size_t length = handle_request(batch_.request(0), batch_.request_length(0),
+                     response, responses_.buffer_size(), sender_endpoint_, false);
+                  socket_.async_send_to(
+                     asio::buffer(response, length),
+                     sender_endpoint_,
+                     pyzor::make_arena_handler(handlers_, boost::bind(&pyzord::handle_send_to, this, response,
+                        asio::placeholders::error, asio::placeholders::bytes_transferred))
+                  );
+               }
             }
             
             // Receive the next incoming packet
             
             if (!shutdown_) {
-               socket_.async_receive_from(
-                  asio::buffer(data_, max_length),
-                  sender_endpoint_,
-                  boost::bind(&pyzord::handle_receive_from, this, asio::placeholders::error, asio::placeholders::bytes_transferred)
-               );
+               this->start_receive();
             }
          }
    
-         void handle_send_to(const asio::error_code& error, size_t bytes_sent)
+         void handle_send_to(char* response, const asio::error_code& error, size_t bytes_sent)
+         {
+            responses_.release(response);
+         }
+
+         void handle_unix_receive_from(const asio::error_code& error, size_t bytes_recvd)
+         {
+            if (error == asio::error::operation_aborted || error == asio::error::bad_descriptor) {
+               return;
+            }
+
+            if (!error && bytes_recvd > 0 && !unix_sender_.unnamed()) {
+               char* response = responses_.acquire();
+               size_t length = handle_request(&unix_request_[0], bytes_recvd, response, responses_.buffer_size(),
+                  asio::ip::udp::endpoint(), true);
+               unix_socket_.async_send_to(
+                  asio::buffer(response, length),
+                  unix_sender_,
+                  pyzor::make_arena_handler(handlers_, boost::bind(&pyzord::handle_send_to, this, response,
+                     asio::placeholders::error, asio::placeholders::bytes_transferred))
+               );
+            }
+
+            if (!shutdown_) {
+               this->start_unix_receive();
+            }
+         }
+
+         void start_unix_receive()
+         {
+            unix_socket_.async_receive_from(
+               asio::buffer(unix_request_),
+               unix_sender_,
+               pyzor::make_arena_handler(handlers_, boost::bind(&pyzord::handle_unix_receive_from, this,
+                  asio::placeholders::error, asio::placeholders::bytes_transferred))
+            );
+         }
+
+         void start_receive()
          {
-            // Nothing
+            socket_.async_receive_from(
+               asio::buffer(batch_.request(0), batch_.datagram_size()),
+               sender_endpoint_,
+               pyzor::make_arena_handler(handlers_, boost::bind(&pyzord::handle_receive_from, this,
+                  asio::placeholders::error, asio::placeholders::bytes_transferred))
+            );
          }
          
       private:
@@ -449,16 +850,38 @@ namespace bohuno {
          std::string port_;
          bool verbose_;
          
+         enum { drain_interval = 2 };
+         std::string handoff_path_;
+         pyzor::handoff_client handoff_client_;
+
          bohuno::license license_;
          bohuno::database database_;
 
          asio::deadline_timer statistics_timer_;         
          asio::deadline_timer checkpoint_timer_;
          asio::deadline_timer updates_scan_timer_;
+         asio::deadline_timer table_timer_;
+         asio::deadline_timer drain_timer_;
+         enum { hot_save_interval = 300 };
+         asio::deadline_timer hot_timer_;
+         boost::filesystem::path hot_path_;
+         boost::shared_ptr<pyzor::hot_digests> hot_;
+         boost::shared_ptr<pyzor::handoff_server> handoff_;
+         volatile bool handed_off_;
          asio::ip::udp::socket socket_;
          asio::ip::udp::endpoint sender_endpoint_;
-         enum { max_length = 8192 };
-         char data_[max_length];
+         pyzor::unix_datagram::socket unix_socket_;
+         pyzor::unix_endpoint unix_sender_;
+         std::string unix_path_;
+         std::vector<char> unix_request_;
+         pyzor::datagram_batch batch_;
+         pyzor::buffer_pool responses_;
+         pyzor::handler_arena handlers_;
+         boost::shared_ptr<pyzor::uring_listener> uring_;
+         boost::shared_ptr<pyzor::stream_listener> stream_;
+         boost::shared_ptr<pyzor::shm_server> shm_;
+         boost::filesystem::path table_path_;
+         pyzor::signature_table_ptr table_;
          bool shutdown_;
          std::list<std::string> updates_to_download_;
          bool download_in_progress_;
@@ -468,7 +891,7 @@ namespace bohuno {
          pyzor::statistics_ring hit_statistics_;
    };
 
-   // bohuno-pyzord [-v] [-x] [-d db-home] [-u user] [-a pyzor-addres] [-p pyzor-port]
+   // bohuno-pyzord [-v] [-x] [-d db-home] [-u user] [-a pyzor-addres] [-p pyzor-port] [-b batch-size] [-i] [-f] [-t signature-table] [-T] [-s unix-socket] [-S shm-name] [-H handoff-socket] [-W hot-digests]
 
    struct pyzord_options
    {
@@ -476,7 +899,7 @@ namespace bohuno {
       
          pyzord_options()
             : verbose(false), debug(false), local("127.0.0.1"), port("24442"), home("/var/lib/bohuno-pyzord"),
-              user("bohuno"), uid(0), gid(0)
+              user("bohuno"), batch(1), io_uring(false), filter(false), table(NULL), stream(false), unix_socket(NULL), shm(NULL), handoff(NULL), hot_digests(NULL), uid(0), gid(0)
          {
          }
       
@@ -484,14 +907,14 @@ namespace bohuno {
       
          void usage()
          {
-            std::cout << "usage: bohuno-pyzord [-v] [-x] [-d db-home] [-u user] [-a pyzor-addres] [-p pyzor-port]"
+            std::cout << "usage: bohuno-pyzord [-v] [-x] [-d db-home] [-u user] [-a pyzor-addres] [-p pyzor-port] [-b batch-size] [-i] [-f] [-t signature-table] [-T] [-s unix-socket] [-S shm-name] [-H handoff-socket] [-W hot-digests]"
                       << std::endl;
          }
       
          bool parse(int argc, char** argv)
          {
             char c;
-            while ((c = getopt(argc, argv, "hxvd:p:u:m:a:")) != EOF) {
+            while ((c = getopt(argc, argv, "hxvifTd:p:u:m:a:b:t:s:S:H:W:")) != EOF) {
                switch (c) {
                   case 'x':
                      debug = true;
@@ -508,6 +931,37 @@ namespace bohuno {
                   case 'p':
                      port = optarg;
                      break;
+                  case 'b':
+                     batch = atoi(optarg);
+                     if (batch < 1) {
+                        usage();
+                        return false;
+                     }
+                     break;
+                  case 'i':
+                     io_uring = true;
+                     break;
+                  case 'f':
+                     filter = true;
+                     break;
+                  case 't':
+                     table = optarg;
+                     break;
+                  case 'T':
+                     stream = true;
+                     break;
+                  case 's':
+                     unix_socket = optarg;
+                     break;
+                  case 'S':
+                     shm = optarg;
+                     break;
+                  case 'W':
+                     hot_digests = optarg;
+                     break;
+                  case 'H':
+                     handoff = optarg;
+                     break;
                   case 'u': {
                      user = optarg;
                      break;
@@ -540,6 +994,15 @@ namespace bohuno {
          char* port;
          char* home;
          std::string user;
+         int batch;
+         bool io_uring;
+         bool filter;
+         char* table;
+         bool stream;
+         char* unix_socket;
+         char* shm;
+         char* handoff;
+         char* hot_digests;
          uid_t uid;
          gid_t gid;
    };
@@ -553,7 +1016,11 @@ namespace bohuno {
 
       try {
          asio::io_service io_service;
-         bohuno::pyzord pyzord(syslog, io_service, options.home, options.local, options.port, options.verbose);
+         bohuno::pyzord pyzord(syslog, io_service, options.home, options.local, options.port, options.batch,
+            options.io_uring, options.filter, (options.table != NULL) ? options.table : "", options.stream,
+            (options.unix_socket != NULL) ? options.unix_socket : "", (options.shm != NULL) ? options.shm : "",
+            (options.handoff != NULL) ? options.handoff : "", (options.hot_digests != NULL) ? options.hot_digests : "",
+            options.verbose);
          
          // Block all signals for background thread.
          sigset_t new_mask;
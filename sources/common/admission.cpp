@@ -0,0 +1,140 @@
+// admission.cpp
+
+#include <time.h>
+
+#include "admission.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      boost::uint32_t hash_address(asio::ip::address const& address)
+      {
+         // FNV-1a over the address bytes; never 0, which marks an empty bucket
+
+         boost::uint32_t h = 2166136261u;
+
+         if (address.is_v4()) {
+            asio::ip::address_v4::bytes_type bytes = address.to_v4().to_bytes();
+            for (size_t i = 0; i < bytes.size(); i++) {
+               h = (h ^ bytes[i]) * 16777619u;
+            }
+         } else {
+            asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+            for (size_t i = 0; i < bytes.size(); i++) {
+               h = (h ^ bytes[i]) * 16777619u;
+            }
+         }
+
+         return (h == 0) ? 1 : h;
+      }
+
+   }
+
+   admission_control::admission_control(unsigned int max_queue_age, unsigned int source_rate, size_t sources)
+      : max_queue_age_(max_queue_age), source_rate_((float) source_rate), source_burst_((float) source_rate * 2),
+        shed_checks_(0), shed_updates_(0), shed_sources_(0)
+   {
+      if (source_rate != 0) {
+         bucket empty = { 0, 0, 0 };
+         buckets_.resize(sources, empty);
+      }
+
+      for (size_t i = 0; i < lock_stripes; i++) {
+         pthread_mutex_init(&locks_[i], NULL);
+      }
+   }
+
+   admission_control::~admission_control()
+   {
+      for (size_t i = 0; i < lock_stripes; i++) {
+         pthread_mutex_destroy(&locks_[i]);
+      }
+   }
+
+   admission_control::verdict admission_control::check(request::op op, asio::ip::udp::endpoint const& source, bool trusted,
+      size_t pending_updates, unsigned int queue_age)
+   {
+      switch (op) {
+         case request::op_report:
+         case request::op_whitelist:
+            if (max_queue_age_ != 0 && (queue_age > max_queue_age_ || pending_updates >= max_pending_updates)) {
+               __atomic_fetch_add(&shed_updates_, 1, __ATOMIC_RELAXED);
+               return shed_overload;
+            }
+            break;
+         case request::op_check:
+         case request::op_mcheck:
+            if (max_queue_age_ != 0 && queue_age > (2 * max_queue_age_)) {
+               __atomic_fetch_add(&shed_checks_, 1, __ATOMIC_RELAXED);
+               return shed_overload;
+            }
+            break;
+         default:
+            return admit;
+      }
+
+      if (!trusted && !buckets_.empty() && !this->take_token(source)) {
+         __atomic_fetch_add(&shed_sources_, 1, __ATOMIC_RELAXED);
+         return shed_source;
+      }
+
+      return admit;
+   }
+
+   boost::uint64_t admission_control::shed_checks() const
+   {
+      return __atomic_load_n(&shed_checks_, __ATOMIC_RELAXED);
+   }
+
+   boost::uint64_t admission_control::shed_updates() const
+   {
+      return __atomic_load_n(&shed_updates_, __ATOMIC_RELAXED);
+   }
+
+   boost::uint64_t admission_control::shed_sources() const
+   {
+      return __atomic_load_n(&shed_sources_, __ATOMIC_RELAXED);
+   }
+
+   boost::uint32_t admission_control::now()
+   {
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+      return (boost::uint32_t) ((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+   }
+
+   bool admission_control::take_token(asio::ip::udp::endpoint const& source)
+   {
+      boost::uint32_t h = hash_address(source.address());
+      size_t index = h % buckets_.size();
+      boost::uint32_t time = now();
+
+      pthread_mutex_lock(&locks_[index % lock_stripes]);
+
+      // Sources that land on the same bucket share it; only an empty one starts out full
+
+      bucket& b = buckets_[index];
+      if (b.source == 0) {
+         b.source = h;
+         b.refilled = time;
+         b.tokens = source_burst_;
+      } else {
+         b.tokens += ((float) (time - b.refilled) * source_rate_) / 1000;
+         if (b.tokens > source_burst_) {
+            b.tokens = source_burst_;
+         }
+         b.refilled = time;
+      }
+
+      bool admitted = (b.tokens >= 1);
+      if (admitted) {
+         b.tokens -= 1;
+      }
+
+      pthread_mutex_unlock(&locks_[index % lock_stripes]);
+
+      return admitted;
+   }
+
+}
@@ -0,0 +1,86 @@
+// admission.hpp
+
+#ifndef PYZOR_ADMISSION_HPP
+#define PYZOR_ADMISSION_HPP
+
+#include <pthread.h>
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <asio.hpp>
+
+#include "message.hpp"
+
+namespace pyzor {
+
+   /// Decides which requests are worth the work when the server cannot keep up. Reports and
+   /// whitelists are shed first, when updates pile up for the master or when requests have been
+   /// waiting in the socket for longer than max_queue_age. Checks are only shed once they have been
+   /// waiting for twice that long, so that the ones that are answered still come back in time.
+   /// Pings and admin ops are always let through.
+   ///
+   /// On top of that every source address gets a token bucket. The buckets live in a fixed table
+   /// indexed by a hash of the address; sources that land on the same slot share its bucket, so a
+   /// pair that goes over the rate together is throttled together.
+
+   class admission_control : boost::noncopyable
+   {
+      public:
+
+         enum verdict { admit, shed_overload, shed_source };
+
+         enum { default_sources = 4096, lock_stripes = 64, max_pending_updates = 10000 };
+
+      public:
+
+         /// A max_queue_age of 0 turns off the overload check and a source_rate of 0 turns off the
+         /// buckets. The rate is in requests per second; a source may burst twice that.
+         admission_control(unsigned int max_queue_age, unsigned int source_rate, size_t sources = default_sources);
+         ~admission_control();
+
+      public:
+
+         /// The queue age is in milliseconds; trusted requests are not charged to their source.
+         verdict check(request::op op, asio::ip::udp::endpoint const& source, bool trusted,
+            size_t pending_updates, unsigned int queue_age);
+
+         boost::uint64_t shed_checks() const;
+         boost::uint64_t shed_updates() const;
+         boost::uint64_t shed_sources() const;
+
+         /// Milliseconds on a monotonic clock, for measuring queue ages
+         static boost::uint32_t now();
+
+      private:
+
+         struct bucket
+         {
+            public:
+
+               boost::uint32_t source;
+               boost::uint32_t refilled;
+               float tokens;
+         };
+
+      private:
+
+         bool take_token(asio::ip::udp::endpoint const& source);
+
+      private:
+
+         unsigned int max_queue_age_;
+         float source_rate_;
+         float source_burst_;
+         std::vector<bucket> buckets_;
+         pthread_mutex_t locks_[lock_stripes];
+
+         boost::uint64_t shed_checks_;
+         boost::uint64_t shed_updates_;
+         boost::uint64_t shed_sources_;
+   };
+
+}
+
+#endif // PYZOR_ADMISSION_HPP
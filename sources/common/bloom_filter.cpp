@@ -0,0 +1,84 @@
+// bloom_filter.cpp
+
+#include <cstring>
+
+#include "bloom_filter.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      /// The bit to probe inside a 512 bit block, taken from the digest bytes after the block index.
+
+      inline unsigned int probe_bit(hash const& key, unsigned int probe)
+      {
+         unsigned int offset = 64 + (probe * 9);
+         unsigned int byte = offset / 8;
+         unsigned int value = (key.data_[byte] << 8) | key.data_[byte + 1];
+         return (value >> (7 - (offset % 8))) & 0x1ff;
+      }
+
+   }
+
+   bloom_filter::bloom_filter(size_t capacity)
+      : capacity_(capacity == 0 ? 1 : capacity), keys_(0)
+   {
+      blocks_ = ((capacity_ * bits_per_key) + 511) / 512;
+      words_.resize(blocks_ * words_per_block);
+   }
+
+   void bloom_filter::add(hash const& key)
+   {
+      boost::uint64_t* block = block_for(key);
+      bool added = false;
+      for (unsigned int i = 0; i < probes; i++) {
+         unsigned int bit = probe_bit(key, i);
+         boost::uint64_t mask = (boost::uint64_t) 1 << (bit % 64);
+         if ((__atomic_fetch_or(&block[bit / 64], mask, __ATOMIC_RELAXED) & mask) == 0) {
+            added = true;
+         }
+      }
+
+      // A key that sets no new bit was added before, or looks like it was, and does not make the
+      // filter any fuller
+
+      if (added) {
+         __atomic_fetch_add(&keys_, 1, __ATOMIC_RELAXED);
+      }
+   }
+
+   bool bloom_filter::may_contain(hash const& key) const
+   {
+      boost::uint64_t* block = block_for(key);
+      for (unsigned int i = 0; i < probes; i++) {
+         unsigned int bit = probe_bit(key, i);
+         if ((__atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED) & ((boost::uint64_t) 1 << (bit % 64))) == 0) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   size_t bloom_filter::capacity() const
+   {
+      return capacity_;
+   }
+
+   size_t bloom_filter::keys() const
+   {
+      return __atomic_load_n(&keys_, __ATOMIC_RELAXED);
+   }
+
+   size_t bloom_filter::size_in_bytes() const
+   {
+      return words_.size() * sizeof(boost::uint64_t);
+   }
+
+   boost::uint64_t* bloom_filter::block_for(hash const& key) const
+   {
+      boost::uint64_t h;
+      memcpy(&h, key.data_, sizeof(h));
+      return const_cast<boost::uint64_t*>(&words_[(h % blocks_) * words_per_block]);
+   }
+
+}
@@ -0,0 +1,57 @@
+// bloom_filter.hpp
+
+#ifndef PYZOR_BLOOM_FILTER_HPP
+#define PYZOR_BLOOM_FILTER_HPP
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "hash.hpp"
+
+namespace pyzor {
+
+   /// A blocked Bloom filter over signature digests. Every digest sets its bits inside one 64 byte
+   /// block, so a test costs a single cache miss. The digests are SHA1 values and are used as the
+   /// hash directly. Keys can be added while other threads test; bits are only ever set.
+
+   class bloom_filter : boost::noncopyable
+   {
+      public:
+
+         enum { bits_per_key = 10, probes = 7 };
+
+      public:
+
+         bloom_filter(size_t capacity);
+
+      public:
+
+         void add(hash const& key);
+         bool may_contain(hash const& key) const;
+
+      public:
+
+         size_t capacity() const;
+         /// The keys that set at least one bit; adding a key again does not count
+         size_t keys() const;
+         size_t size_in_bytes() const;
+
+      private:
+
+         enum { words_per_block = 8 };
+
+         boost::uint64_t* block_for(hash const& key) const;
+
+      private:
+
+         size_t capacity_;
+         size_t keys_;
+         size_t blocks_;
+         std::vector<boost::uint64_t> words_;
+   };
+
+}
+
+#endif // PYZOR_BLOOM_FILTER_HPP
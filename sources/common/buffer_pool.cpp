@@ -0,0 +1,93 @@
+// buffer_pool.cpp
+
+#include <new>
+
+#include "buffer_pool.hpp"
+
+namespace pyzor {
+
+   /// Buffer pool
+
+   buffer_pool::buffer_pool(size_t buffer_size, size_t buffers_per_slab)
+      : buffer_size_(buffer_size), buffers_per_slab_(buffers_per_slab == 0 ? 1 : buffers_per_slab)
+   {
+      this->grow();
+   }
+
+   buffer_pool::~buffer_pool()
+   {
+      for (size_t i = 0; i < slabs_.size(); i++) {
+         delete [] slabs_[i];
+      }
+   }
+
+   size_t buffer_pool::buffer_size() const
+   {
+      return buffer_size_;
+   }
+
+   char* buffer_pool::acquire()
+   {
+      if (free_.empty()) {
+         this->grow();
+      }
+
+      char* buffer = free_.back();
+      free_.pop_back();
+      return buffer;
+   }
+
+   void buffer_pool::release(char* buffer)
+   {
+      free_.push_back(buffer);
+   }
+
+   void buffer_pool::grow()
+   {
+      char* slab = new char[buffer_size_ * buffers_per_slab_];
+      slabs_.push_back(slab);
+
+      free_.reserve(slabs_.size() * buffers_per_slab_);
+      for (size_t i = 0; i < buffers_per_slab_; i++) {
+         free_.push_back(slab + (i * buffer_size_));
+      }
+   }
+
+   /// Handler arena
+
+   handler_arena::handler_arena()
+   {
+   }
+
+   handler_arena::~handler_arena()
+   {
+      for (size_t i = 0; i < free_.size(); i++) {
+         ::operator delete(free_[i]);
+      }
+   }
+
+   void* handler_arena::allocate(size_t size)
+   {
+      if (size > block_size) {
+         return ::operator new(size);
+      }
+
+      if (free_.empty()) {
+         return ::operator new(block_size);
+      }
+
+      void* block = free_.back();
+      free_.pop_back();
+      return block;
+   }
+
+   void handler_arena::deallocate(void* pointer, size_t size)
+   {
+      if (size > block_size) {
+         ::operator delete(pointer);
+      } else {
+         free_.push_back(pointer);
+      }
+   }
+
+}
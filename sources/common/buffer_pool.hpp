@@ -0,0 +1,119 @@
+// buffer_pool.hpp
+
+#ifndef PYZOR_BUFFER_POOL_HPP
+#define PYZOR_BUFFER_POOL_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+namespace pyzor {
+
+   /// Fixed size buffers carved out of slabs and handed out from a free list. A buffer stays out of
+   /// the pool until it is released, so a response can be in flight while the next request is already
+   /// being handled. The pool grows one slab at a time and never shrinks. It is not thread safe; every
+   /// listener thread owns its own pool.
+
+   class buffer_pool : boost::noncopyable
+   {
+      public:
+
+         buffer_pool(size_t buffer_size, size_t buffers_per_slab = 64);
+         ~buffer_pool();
+
+      public:
+
+         size_t buffer_size() const;
+
+         char* acquire();
+         void release(char* buffer);
+
+      private:
+
+         void grow();
+
+      private:
+
+         size_t buffer_size_;
+         size_t buffers_per_slab_;
+         std::vector<char*> slabs_;
+         std::vector<char*> free_;
+   };
+
+   /// Recycles the memory of asio completion handlers. Blocks up to block_size bytes are kept on a
+   /// free list after their handler ran; larger handlers go to the heap. Like buffer_pool it must only
+   /// be used from the thread that runs the io_service the handlers are queued on.
+
+   class handler_arena : boost::noncopyable
+   {
+      public:
+
+         enum { block_size = 256 };
+
+      public:
+
+         handler_arena();
+         ~handler_arena();
+
+      public:
+
+         void* allocate(size_t size);
+         void deallocate(void* pointer, size_t size);
+
+      private:
+
+         std::vector<void*> free_;
+   };
+
+   /// Wraps a handler so that asio allocates its operation from a handler_arena.
+
+   template <typename Handler>
+   class arena_handler
+   {
+      public:
+
+         arena_handler(handler_arena& arena, Handler handler)
+            : arena_(arena), handler_(handler)
+         {
+         }
+
+      public:
+
+         template <typename Arg1>
+         void operator()(Arg1 arg1)
+         {
+            handler_(arg1);
+         }
+
+         template <typename Arg1, typename Arg2>
+         void operator()(Arg1 arg1, Arg2 arg2)
+         {
+            handler_(arg1, arg2);
+         }
+
+         friend void* asio_handler_allocate(std::size_t size, arena_handler<Handler>* handler)
+         {
+            return handler->arena_.allocate(size);
+         }
+
+         friend void asio_handler_deallocate(void* pointer, std::size_t size, arena_handler<Handler>* handler)
+         {
+            handler->arena_.deallocate(pointer, size);
+         }
+
+      private:
+
+         handler_arena& arena_;
+         Handler handler_;
+   };
+
+   template <typename Handler>
+   inline arena_handler<Handler> make_arena_handler(handler_arena& arena, Handler handler)
+   {
+      return arena_handler<Handler>(arena, handler);
+   }
+
+}
+
+#endif // PYZOR_BUFFER_POOL_HPP
@@ -6,7 +6,9 @@
 #include <string>
 #include <asio.hpp>
 
+#include "bloom_filter.hpp"
 #include "common.hpp"
+#include "hash.hpp"
 #include "record.hpp"
 
 namespace pyzor {
@@ -76,6 +78,69 @@ namespace pyzor {
       }
    }
 
+   size_t add_signatures(DB* db, bloom_filter& filter)
+   {
+      DBC* cursor;
+      if (db->cursor(db, NULL, &cursor, 0) != 0) {
+         throw std::runtime_error("Cannot open cursor");
+      }
+
+      DBT key, data;
+      memset(&key, 0, sizeof(DBT));
+      memset(&data, 0, sizeof(DBT));
+
+      size_t n = 0;
+
+      while (cursor->get(cursor, &key, &data, DB_NEXT) == 0) {
+         if (key.size == sizeof(hash)) {
+            filter.add(*static_cast<hash*>(key.data));
+            n++;
+         }
+      }
+
+      cursor->close(cursor);
+
+      return n;
+   }
+
+   size_t add_signatures_updated_since(DB* index, boost::uint32_t since, bloom_filter& filter, boost::uint32_t& latest)
+   {
+      DBC* cursor;
+      if (index->cursor(index, NULL, &cursor, 0) != 0) {
+         throw std::runtime_error("Cannot open cursor");
+      }
+
+      DBT key, pkey, pdata;
+      memset(&key, 0, sizeof(DBT));
+      memset(&pkey, 0, sizeof(DBT));
+      memset(&pdata, 0, sizeof(DBT));
+
+      // The index is ordered by the updated time in network byte order, so this finds the first
+      // record that was updated at or after since
+
+      boost::uint32_t timestamp = htonl(since);
+      key.data = &timestamp;
+      key.size = sizeof(timestamp);
+
+      size_t n = 0;
+
+      int ret = cursor->pget(cursor, &key, &pkey, &pdata, DB_SET_RANGE);
+      while (ret == 0) {
+         if (pkey.size == sizeof(hash)) {
+            filter.add(*static_cast<hash*>(pkey.data));
+            n++;
+         }
+         if (key.size == sizeof(boost::uint32_t) && ntohl(*static_cast<boost::uint32_t*>(key.data)) > latest) {
+            latest = ntohl(*static_cast<boost::uint32_t*>(key.data));
+         }
+         ret = cursor->pget(cursor, &key, &pkey, &pdata, DB_NEXT);
+      }
+
+      cursor->close(cursor);
+
+      return n;
+   }
+
    void run_in_thread(const boost::function0<void>& run, const boost::function0<void>& stop)
    {
       // Block all signals for background thread.
@@ -11,6 +11,8 @@
 
 namespace pyzor {
 
+   class bloom_filter;
+
    //typedef boost::uint8_t hash_t[20];
 
    u_int32_t pyzor_hash_function(DB* dbp, const void* key, u_int32_t len);
@@ -19,6 +21,10 @@ namespace pyzor {
    int create_time_key(DB* db, const DBT* pkey, const DBT* pdata, DBT* skey);
    int compare_time_key(DB *dbp, const DBT *a, const DBT *b);
 
+   size_t add_signatures(DB* db, bloom_filter& filter);
+   /// Also raises latest to the newest updated time that was seen
+   size_t add_signatures_updated_since(DB* index, boost::uint32_t since, bloom_filter& filter, boost::uint32_t& latest);
+
    void run_in_thread(const boost::function0<void>& start, const boost::function0<void>& stop);
 }
 
@@ -41,9 +41,16 @@ namespace pyzor {
             int status;
             pid_t pid = waitpid(-1, &status, 0);
 
-            // Remove the pid file
-            std::cout << "Deleting pid file " << pid_file << std::endl;
-            unlink(pid_file);
+            // Remove the pid file, unless a daemon that took over from this one has written its own
+            fp = fopen(pid_file, "r");
+            if (fp != NULL) {
+               int written = 0;
+               if (fscanf(fp, "%d", &written) == 1 && written == p) {
+                  std::cout << "Deleting pid file " << pid_file << std::endl;
+                  unlink(pid_file);
+               }
+               fclose(fp);
+            }
             
             if (pid == -1) {
                return EXIT_FAILURE;
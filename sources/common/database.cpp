@@ -2,6 +2,7 @@
 
 #include <sys/errno.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
@@ -19,64 +20,322 @@
 
 namespace pyzor {
 
+   namespace {
+
+      class scoped_rwlock
+      {
+         public:
+
+            scoped_rwlock(pthread_rwlock_t& lock, bool exclusive)
+               : lock_(lock)
+            {
+               if (exclusive) {
+                  pthread_rwlock_wrlock(&lock_);
+               } else {
+                  pthread_rwlock_rdlock(&lock_);
+               }
+            }
+
+            ~scoped_rwlock()
+            {
+               pthread_rwlock_unlock(&lock_);
+            }
+
+         private:
+
+            pthread_rwlock_t& lock_;
+      };
+
+      class signature_order
+      {
+         public:
+
+            signature_order(hash const* signatures)
+               : signatures_(signatures)
+            {
+            }
+
+            bool operator()(size_t a, size_t b) const
+            {
+               return memcmp(signatures_[a].data_, signatures_[b].data_, sizeof(signatures_[a].data_)) < 0;
+            }
+
+         private:
+
+            hash const* signatures_;
+      };
+
+      /// The newest updated time in the index
+      boost::uint32_t last_updated(DB* index)
+      {
+         DBC* cursor;
+         if (index->cursor(index, NULL, &cursor, 0) != 0) {
+            throw std::runtime_error("Cannot open cursor");
+         }
+
+         DBT key, data;
+         memset(&key, 0, sizeof(DBT));
+         memset(&data, 0, sizeof(DBT));
+
+         boost::uint32_t updated = 0;
+         if (cursor->get(cursor, &key, &data, DB_LAST) == 0 && key.size == sizeof(boost::uint32_t)) {
+            updated = ntohl(*static_cast<boost::uint32_t*>(key.data));
+         }
+
+         cursor->close(cursor);
+
+         return updated;
+      }
+
+      /// Like add_signatures, but tells whether the scan reached the end
+      int add_partition_signatures(DB* db, bloom_filter& filter, size_t& n)
+      {
+         DBC* cursor;
+         int ret = db->cursor(db, NULL, &cursor, 0);
+         if (ret != 0) {
+            return ret;
+         }
+
+         DBT key, data;
+         memset(&key, 0, sizeof(DBT));
+         memset(&data, 0, sizeof(DBT));
+
+         while ((ret = cursor->get(cursor, &key, &data, DB_NEXT)) == 0) {
+            if (key.size == sizeof(hash)) {
+               filter.add(*static_cast<hash*>(key.data));
+               n++;
+            }
+         }
+
+         cursor->close(cursor);
+
+         return ret == DB_NOTFOUND ? 0 : ret;
+      }
+
+   }
+
    // Client Database
 
    database::database(syslog& syslog, asio::io_service& io_service, boost::filesystem::path const& home, bool verbose)
       : syslog_(syslog), io_service_(io_service), home_(home), verbose_(verbose),
-        env_(NULL), db_(NULL), index_(NULL), socket_(io_service), connect_timer_(io_service_), connected_(false)
+        env_(NULL), db_(NULL), index_(NULL), shared_env_(NULL), shared_db_(NULL), filter_enabled_(false), filter_refreshed_(0), filter_scanned_(0),
+        filter_skips_(0), filter_false_positives_(0), filter_timer_(io_service_), partition_timer_(io_service_), table_timer_(io_service_),
+        hot_timer_(io_service_), warmup_stopped_(false), warmed_(0), warmup_total_(0), socket_(io_service), spool_timer_(io_service_), connect_timer_(io_service_), connected_(false),
+        pending_updates_(0)
    {
+      pthread_rwlock_init(&handles_lock_, NULL);
       this->connect();
    }
+
+   database::database(syslog& syslog, asio::io_service& io_service, boost::filesystem::path const& home, DB_ENV* env, DB* db,
+      update_function forward, pending_function pending, bool verbose)
+      : syslog_(syslog), io_service_(io_service), home_(home), verbose_(verbose),
+        env_(NULL), db_(NULL), index_(NULL), shared_env_(env), shared_db_(db), forward_(forward), pending_(pending), filter_enabled_(false),
+        filter_refreshed_(0), filter_scanned_(0), filter_skips_(0), filter_false_positives_(0), filter_timer_(io_service_), partition_timer_(io_service_),
+        table_timer_(io_service_), hot_timer_(io_service_), warmup_stopped_(false), warmed_(0), warmup_total_(0), socket_(io_service), spool_timer_(io_service_), connect_timer_(io_service_),
+        connected_(false), pending_updates_(0)
+   {
+      pthread_rwlock_init(&handles_lock_, NULL);
+      io_service_.post(boost::bind(&database::handle_attach, this));
+   }
    
    database::~database()
    {
+      this->stop_warmup();
+      if (hot_) {
+         try {
+            hot_->save(hot_path_);
+         } catch (std::exception const& e) {
+            syslog_.error() << "Cannot save the hot digests: " << e.what();
+         }
+      }
       this->teardown();
+      pthread_rwlock_destroy(&handles_lock_);
    }
 
    //
 
    bool database::get(std::string const& hexsignature, record& r)
    {
-      memset(&r, 0, sizeof(record));
+      if (hexsignature.length() != 40) {
+         memset(&r, 0, sizeof(record));
+         return false;
+      }
 
-      unsigned char signature[20];
-      if (pyzor::decode_signature(hexsignature, signature))
-      {
-         DBT key;
-         memset(&key, 0, sizeof(DBT));
-         key.data = signature;
-         key.size = sizeof(signature);
-         
-         DBT data;
-         memset(&data, 0, sizeof(DBT));
-         data.data = &r;
-         data.ulen = sizeof(record);
-         data.flags = DB_DBT_USERMEM;
-         
-         int ret = db_->get(db_, NULL, &key, &data, 0);
-         if (ret != 0) {
-            if (ret == DB_NOTFOUND) {
-               return false;
-            } else {
-               throw std::runtime_error(std::string("Database failure"));
-            }
-         } else {
-            // We only say the record was found if it was not reset
-	    if (r.report_count() == 0 && r.whitelist_count() == 0) {
-              return false;
-	    } else {
-              return true;
-	    }
+      return this->get(hash(hexsignature), r);
+   }
+
+   bool database::get(hash const& signature, record& r)
+   {
+      scoped_rwlock lock(handles_lock_, false);
+      bool found = this->get_locked(signature, r);
+      if (found && hot_) {
+         hot_->record(signature);
+      }
+      return found;
+   }
+
+   void database::get(hash const* signatures, size_t n, record* records, bool* found)
+   {
+      // Visit the keys in the order the btree stores them so that neighbouring lookups share pages
+
+      std::vector<size_t> order(n);
+      for (size_t i = 0; i < n; i++) {
+         order[i] = i;
+      }
+      std::sort(order.begin(), order.end(), signature_order(signatures));
+
+      scoped_rwlock lock(handles_lock_, false);
+      for (size_t i = 0; i < n; i++) {
+         found[order[i]] = this->get_locked(signatures[order[i]], records[order[i]]);
+         if (found[order[i]] && hot_) {
+            hot_->record(signatures[order[i]]);
          }
       }
+   }
+
+   bool database::get_locked(hash const& signature, record& r)
+   {
+      memset(&r, 0, sizeof(record));
+
+      if (table_) {
+         return table_->lookup(signature, r);
+      }
+
+      if (db_ == NULL) {
+         return false;
+      }
+
+      // Most checks are for digests that were never reported
+
+      if (filter_ && !filter_->may_contain(signature)) {
+         __atomic_fetch_add(&filter_skips_, 1, __ATOMIC_RELAXED);
+         return false;
+      }
+
+      bool found = false;
+      if (cache_ && cache_->get(signature, r, found)) {
+         return found;
+      }
+
+      DBT key;
+      memset(&key, 0, sizeof(DBT));
+      key.data = (void*) signature.data_;
+      key.size = sizeof(signature.data_);
       
-      return false;
+      DBT data;
+      memset(&data, 0, sizeof(DBT));
+      data.data = &r;
+      data.ulen = sizeof(record);
+      data.flags = DB_DBT_USERMEM;
+      
+      int ret;
+      if (partitions_) {
+         size_t index;
+         ret = partitions_->get(NULL, signature, r, index);
+      } else {
+         ret = db_->get(db_, NULL, &key, &data, 0);
+      }
+      if (ret != 0 && ret != DB_NOTFOUND) {
+         throw std::runtime_error(std::string("Database failure"));
+      }
+
+      if (ret == DB_NOTFOUND && filter_) {
+         __atomic_fetch_add(&filter_false_positives_, 1, __ATOMIC_RELAXED);
+      }
+
+      // We only say the record was found if it was not reset
+      found = (ret == 0) && !(r.report_count() == 0 && r.whitelist_count() == 0);
+
+      if (cache_) {
+         cache_->put(signature, r, found);
+      }
+
+      return found;
+   }
+
+   void database::enable_cache(size_t memory_budget, unsigned int ttl)
+   {
+      cache_.reset(new record_cache(memory_budget, ttl));
+      syslog_.notice() << "Caching up to " << (unsigned int) cache_->capacity() << " lookups for " << ttl << " seconds";
+   }
+
+   record_cache const* database::cache() const
+   {
+      return cache_.get();
+   }
+
+   void database::enable_filter()
+   {
+      filter_enabled_ = true;
+   }
+
+   bool database::filter_statistics(boost::uint64_t& bytes, boost::uint64_t& keys, boost::uint64_t& skips, boost::uint64_t& false_positives)
+   {
+      scoped_rwlock lock(handles_lock_, false);
+      if (partitions_) {
+         return partitions_->filter_statistics(bytes, keys, skips, false_positives);
+      }
+      if (!filter_) {
+         return false;
+      }
+
+      bytes = filter_->size_in_bytes();
+      keys = filter_->keys();
+      skips = __atomic_load_n(&filter_skips_, __ATOMIC_RELAXED);
+      false_positives = __atomic_load_n(&filter_false_positives_, __ATOMIC_RELAXED);
+
+      return true;
+   }
+
+   void database::use_table(boost::filesystem::path const& path)
+   {
+      signature_table_ptr table(new signature_table(path));
+
+      {
+         scoped_rwlock lock(handles_lock_, true);
+         table_path_ = path;
+         table_ = table;
+      }
+
+      syslog_.notice() << "Answering lookups from " << path.string() << " with " << (unsigned int) table->size() << " signatures";
+
+      this->schedule_table_reload();
+   }
+
+   size_t database::table_size()
+   {
+      scoped_rwlock lock(handles_lock_, false);
+      return table_ ? table_->size() : 0;
+   }
+
+   void database::enable_warmup(boost::filesystem::path const& path)
+   {
+      hot_path_ = path;
+      hot_.reset(new hot_digests());
+      this->schedule_hot_save();
+   }
+
+   bool database::warmup_progress(boost::uint64_t& done, boost::uint64_t& total)
+   {
+      if (!hot_) {
+         return false;
+      }
+
+      done = __atomic_load_n(&warmed_, __ATOMIC_RELAXED);
+      total = __atomic_load_n(&warmup_total_, __ATOMIC_RELAXED);
+
+      return true;
    }
 
    void database::get_updated_since(boost::uint32_t since, std::vector<record>& records)
    {
       std::cout << "GET-UPDATED-SINCE: Getting records updated since " << since << std::endl;
 
+      if (index_ == NULL) {
+         throw std::runtime_error("There is no time index for partitioned records");
+      }
+
       DBC *cursor;
 
       index_->cursor(index_, NULL, &cursor, 0);
@@ -109,18 +368,54 @@ namespace pyzor {
    void database::erase(std::string const& hash)
    {
       update u(hash, update::erase);
-      io_service_.post(boost::bind(&database::write_update, this, u));
+      this->queue_update(u);
    }
 
    void database::report(std::string const& hash)
    {
       update u(hash, update::report);
-      io_service_.post(boost::bind(&database::write_update, this, u));
+      this->queue_update(u);
    }
 
    void database::whitelist(std::string const& hash)
    {
       update u(hash, update::whitelist);
+      this->queue_update(u);
+   }
+
+   void database::report(hash const& signature)
+   {
+      update u(signature, update::report);
+      this->queue_update(u);
+   }
+
+   void database::whitelist(hash const& signature)
+   {
+      update u(signature, update::whitelist);
+      this->queue_update(u);
+   }
+
+   size_t database::pending_updates() const
+   {
+      // Forwarded updates wait in the queue of the slave
+      size_t pending = __atomic_load_n(&pending_updates_, __ATOMIC_RELAXED);
+      if (pending_) {
+         pending += pending_();
+      }
+      return pending;
+   }
+
+   void database::enable_spool(boost::filesystem::path const& path, size_t memory_limit)
+   {
+      spool_.reset(new update_spool(path, memory_limit, updates_));
+      __atomic_fetch_add(&pending_updates_, spool_->size(), __ATOMIC_RELAXED);
+      syslog_.notice() << "Spooling updates in " << path.string() << "; " << (unsigned int) spool_->size() << " left from the last run";
+      this->schedule_spool_sync();
+   }
+
+   void database::queue_update(update const& u)
+   {
+      __atomic_fetch_add(&pending_updates_, 1, __ATOMIC_RELAXED);
       io_service_.post(boost::bind(&database::write_update, this, u));
    }
 
@@ -135,8 +430,23 @@ namespace pyzor {
       boost::uint32_t header = htonl(2);
       out.write(reinterpret_cast<char*>(&header), sizeof(header));      
       
-      // Find all matching records
+      // Find all matching records; the oldest partitions go first so that a record that is in two
+      // of them while it is being moved ends up with its newest version
+
+      if (partitions_) {
+         scoped_rwlock lock(handles_lock_, false);
+         size_t n = 0;
+         for (size_t i = partitions_->size(); i > 0; i--) {
+            n += this->dump_records(partitions_->handle(i - 1), out, min, max);
+         }
+         return n;
+      }
+
+      return this->dump_records(db_, out, min, max);
+   }
 
+   size_t database::dump_records(DB* db, std::ostream& out, boost::uint32_t min, boost::uint32_t max)
+   {
       DBC *cursor;
 
       DBT key;
@@ -145,7 +455,7 @@ namespace pyzor {
       DBT data;
       memset(&data, 0, sizeof(DBT));
 
-      db_->cursor(db_, NULL, &cursor, 0);
+      db->cursor(db, NULL, &cursor, 0);
 
       size_t n = 0;
       
@@ -175,6 +485,20 @@ namespace pyzor {
       boost::uint32_t header = htonl(2);
       out.write(reinterpret_cast<char*>(&header), sizeof(header));      
       
+      // Without the time index only scan the partitions that can have such records. A record was
+      // last written before the next partition was started, give or take the clocks of the servers.
+
+      if (partitions_) {
+         scoped_rwlock lock(handles_lock_, false);
+         size_t n = 0;
+         for (size_t i = partitions_->size(); i > 0; i--) {
+            if (i == 1 || partitions_->first_day(i - 2) * 86400 + 3600 >= min) {
+               n += this->dump_records(partitions_->handle(i - 1), out, min, max);
+            }
+         }
+         return n;
+      }
+
       // Find all matching records
 
       DBC *cursor;
@@ -237,6 +561,71 @@ namespace pyzor {
    }
 
    void database::setup()
+   {
+      scoped_rwlock lock(handles_lock_, true);
+
+      if (shared_env_ != NULL) {
+         env_ = shared_env_;
+         db_ = shared_db_;
+      } else {
+         this->open_database();
+      }
+
+      // Partitioned records have no time index
+
+      if (partition_set::exists(home_ / "db")) {
+         partitions_.reset(new partition_set(syslog_, env_, home_ / "db", false));
+         partitions_->refresh();
+         syslog_.notice() << "Looking up the records in " << (unsigned int) partitions_->size() << " partitions";
+         return;
+      }
+
+      // Create the index
+
+      int ret = db_create(&index_, env_, 0);
+      if (ret != 0) { 
+         syslog_.error() << "Cannot create the index: " << db_strerror(ret);
+         throw std::runtime_error("Cannot setup the index");        
+      }
+
+      ret = index_->set_flags(index_, DB_DUP | DB_DUPSORT);
+      if (ret != 0) {
+         syslog_.error() << "Cannot set the index flags: " << db_strerror(ret);
+         throw std::runtime_error("Cannot setup the index");
+      }
+
+      ret = index_->open(
+         index_,
+         NULL,
+         "index.db",
+         NULL,
+         DB_UNKNOWN,
+         DB_RDONLY | DB_THREAD,
+         0
+      );
+
+      if (ret != 0) {
+         syslog_.error() << "Cannot open the index: " << db_strerror(ret);
+         throw std::runtime_error("Cannot setup the index");
+      }
+
+      // Associate the index to the primary database
+      
+      ret = db_->associate(
+         db_,
+         NULL,
+         index_,
+         pyzor::create_time_key,
+         0
+      );
+
+      if (ret != 0) {
+         syslog_.error() << "Cannot associate the databasewith the index: " << db_strerror(ret);
+         throw std::runtime_error("Cannot setup the index");
+      }
+   }
+
+   void database::open_database()
    {
       // Create the database directory
 
@@ -267,8 +656,6 @@ namespace pyzor {
          throw std::runtime_error("Cannot setup the databse environment");
       }
       
-      // Setup the databases
-
       // Create the database
 
       ret = db_create(&db_, env_, 0);
@@ -291,54 +678,22 @@ namespace pyzor {
          syslog_.error() << "Cannot open the database: " << db_strerror(ret);
          throw std::runtime_error("Cannot setup the database");
       }
+   }
 
-      // Create the index
-
-      ret = db_create(&index_, env_, 0);
-      if (ret != 0) { 
-         syslog_.error() << "Cannot create the index: " << db_strerror(ret);
-         throw std::runtime_error("Cannot setup the index");        
-      }
-
-      ret = index_->set_flags(index_, DB_DUP | DB_DUPSORT);
-      if (ret != 0) {
-         syslog_.error() << "Cannot set the index flags: " << db_strerror(ret);
-         throw std::runtime_error("Cannot setup the index");
-      }
-
-      ret = index_->open(
-         index_,
-         NULL,
-         "index.db",
-         NULL,
-         DB_UNKNOWN,
-         DB_RDONLY | DB_THREAD,
-         0
-      );
+   void database::teardown()
+   {
+      scoped_rwlock lock(handles_lock_, true);
 
-      if (ret != 0) {
-         syslog_.error() << "Cannot open the index: " << db_strerror(ret);
-         throw std::runtime_error("Cannot setup the index");
+      if (cache_) {
+         cache_->clear();
       }
 
-      // Associate the index to the primary database
-      
-      ret = db_->associate(
-         db_,
-         NULL,
-         index_,
-         pyzor::create_time_key,
-         0
-      );
+      filter_timer_.cancel();
+      filter_.reset();
 
-      if (ret != 0) {
-         syslog_.error() << "Cannot associate the databasewith the index: " << db_strerror(ret);
-         throw std::runtime_error("Cannot setup the index");
-      }
-   }
+      partition_timer_.cancel();
+      partitions_.reset();
 
-   void database::teardown()
-   {
       if (index_ != NULL) {
          int ret = index_->close(index_, 0);
          if (ret != 0) {
@@ -347,6 +702,13 @@ namespace pyzor {
          index_ = NULL;
       }
 
+      // The slave closes the handles it shared with us
+
+      if (shared_env_ != NULL) {
+         db_ = NULL;
+         env_ = NULL;
+      }
+
       if (db_ != NULL) {
          int ret = db_->close(db_, 0);
          if (ret != 0) {
@@ -389,16 +751,11 @@ namespace pyzor {
          connected_ = true;
          syslog_.notice() << "Connected to the local database.";
          
-         this->setup();
-         start_signal_();
+         this->start();
          
-         if (!updates_.empty()) {
+         if (!updates_.empty() && frame_.size() == 0) {
             syslog_.notice() << "There are " << (unsigned int) updates_.size() << " updates queued. Sending them.";
-            asio::async_write(
-               socket_,
-               asio::buffer((void*) &(updates_.front()), sizeof(update)),
-               boost::bind(&database::handle_write_update, this, asio::placeholders::error)
-            );
+            this->send_updates();
          }
          // Read a ping
          asio::async_read(
@@ -414,6 +771,34 @@ namespace pyzor {
       }
    }
 
+   void database::handle_attach()
+   {
+      connected_ = true;
+      syslog_.notice() << "Using the database of the slave in this process.";
+
+      this->start();
+   }
+
+   void database::start()
+   {
+      // With a signature table the local database is not needed for lookups
+
+      if (!table_) {
+         this->setup();
+         if (partitions_) {
+            this->refresh_partitions();
+            this->schedule_partition_refresh();
+         } else if (filter_enabled_) {
+            this->build_filter();
+            this->schedule_filter_refresh();
+         }
+      }
+      if (hot_) {
+         this->start_warmup();
+      }
+      start_signal_();
+   }
+
    void database::handle_read_ping(const asio::error_code& error)
    {
       static boost::uint32_t ping;
@@ -438,30 +823,64 @@ namespace pyzor {
       
    void database::write_update(update u)
    {
-      bool write_in_progress = !updates_.empty();      
-      updates_.push_back(u);      
-      if (connected_ && !write_in_progress) {
-         asio::async_write(
-            socket_,
-            asio::buffer((void*) &(updates_.front()), sizeof(update)),
-            boost::bind(&database::handle_write_update, this, asio::placeholders::error)
-         );
+      // Let checks see our own reports right away; other changes arrive with the next refresh
+      if (filter_ && u.type() != update::erase) {
+         filter_->add(u.ghash());
+      }
+
+      // The slave in this process queues it for the master itself
+
+      if (forward_) {
+         forward_(u);
+         __atomic_fetch_sub(&pending_updates_, 1, __ATOMIC_RELAXED);
+         return;
+      }
+
+      // Updates that come in while a frame is being written go out together in the next one
+
+      if (spool_) {
+         try {
+            spool_->push(u, updates_);
+         } catch (std::exception const& e) {
+            syslog_.error() << "Cannot spool an update: " << e.what();
+            __atomic_fetch_sub(&pending_updates_, 1, __ATOMIC_RELAXED);
+            return;
+         }
+      } else {
+         updates_.push_back(u);
+      }
+
+      if (connected_ && frame_.size() == 0 && !updates_.empty()) {
+         this->send_updates();
       }
    }
+
+   void database::send_updates()
+   {
+      frame_.pack(updates_);
+      asio::async_write(
+         socket_,
+         frame_.buffer(),
+         boost::bind(&database::handle_write_update, this, asio::placeholders::error)
+      );
+   }
       
    void database::handle_write_update(const asio::error_code& error)
    {
       if (!error) {
-         updates_.pop_front();
+         if (spool_) {
+            spool_->delivered(frame_.size(), updates_);
+         } else {
+            updates_.erase(updates_.begin(), updates_.begin() + frame_.size());
+         }
+         __atomic_fetch_sub(&pending_updates_, frame_.size(), __ATOMIC_RELAXED);
+         frame_.clear();
          if (connected_ && !updates_.empty()) {
-            asio::async_write(
-               socket_,
-               asio::buffer((void*) &(updates_.front()), sizeof(update)),
-               boost::bind(&database::handle_write_update, this, asio::placeholders::error)
-            );
+            this->send_updates();
          }
       } else {
          syslog_.notice() << "Could not send update to the master server; reconnecting after 5 seconds.";
+         frame_.clear();
          socket_.close();
          connected_ = false;
 
@@ -473,4 +892,272 @@ namespace pyzor {
       }
    }
    
+   void database::schedule_spool_sync()
+   {
+      spool_timer_.expires_from_now(boost::posix_time::seconds((long) spool_sync_interval));
+      spool_timer_.async_wait(boost::bind(&database::handle_spool_sync, this, asio::placeholders::error));
+   }
+
+   void database::handle_spool_sync(const asio::error_code& error)
+   {
+      if (error) {
+         return;
+      }
+
+      spool_->sync();
+
+      this->schedule_spool_sync();
+   }
+   
+   //
+
+   void database::build_filter()
+   {
+      // Size the filter for twice the digests we know of; scan again if the guess was too small
+
+      size_t capacity = std::max(filter_scanned_, filter_ ? filter_->keys() : 0) * 2;
+      if (capacity < minimum_filter_capacity) {
+         capacity = minimum_filter_capacity;
+      }
+
+      boost::shared_ptr<bloom_filter> filter;
+      boost::uint32_t started;
+      size_t n;
+
+      {
+         scoped_rwlock lock(handles_lock_, false);
+         if (db_ == NULL) {
+            return;
+         }
+
+         // The refreshes pick up from what was in the index before the scan
+
+         started = last_updated(index_);
+
+         for (;;) {
+            filter.reset(new bloom_filter(capacity));
+            n = add_signatures(db_, *filter);
+            if (n <= capacity) {
+               break;
+            }
+            capacity = n * 2;
+         }
+      }
+
+      {
+         scoped_rwlock lock(handles_lock_, true);
+         filter_ = filter;
+         filter_refreshed_ = started;
+         filter_scanned_ = n;
+      }
+
+      syslog_.notice() << "Built the signature filter with " << (unsigned int) filter->keys() << " keys in "
+                       << (unsigned int) (filter->size_in_bytes() / 1024) << " KB";
+   }
+
+   void database::schedule_filter_refresh()
+   {
+      filter_timer_.expires_from_now(boost::posix_time::seconds((long) filter_refresh_interval));
+      filter_timer_.async_wait(boost::bind(&database::handle_filter_refresh, this, asio::placeholders::error));
+   }
+
+   void database::handle_filter_refresh(const asio::error_code& error)
+   {
+      if (error || !filter_) {
+         return;
+      }
+
+      // Pick up the records that the master wrote since the newest one the filter has seen. The
+      // master stamps a record with the time it wrote it, and the replica applies the writes in
+      // the order they were committed, so only the writes that took a while to commit can show
+      // up with an older time. The overlap covers those; a report that reached the master late
+      // has the time it was written and is not missed.
+
+      boost::uint32_t latest = filter_refreshed_;
+
+      {
+         scoped_rwlock lock(handles_lock_, false);
+         if (db_ != NULL) {
+            boost::uint32_t since = filter_refreshed_ > (boost::uint32_t) filter_refresh_overlap ? filter_refreshed_ - filter_refresh_overlap : 0;
+            add_signatures_updated_since(index_, since, *filter_, latest);
+         }
+      }
+
+      filter_refreshed_ = latest;
+
+      if (filter_->keys() > filter_->capacity()) {
+         this->build_filter();
+      }
+
+      this->schedule_filter_refresh();
+   }
+
+   //
+
+   void database::refresh_partitions()
+   {
+      {
+         scoped_rwlock lock(handles_lock_, true);
+         partitions_->refresh();
+      }
+
+      if (!filter_enabled_) {
+         return;
+      }
+
+      // Only the newest partition gets new records, so the filter of an older one stays good. This
+      // thread is the only one that changes the partitions and can read them without the lock.
+
+      for (size_t i = 1; i < partitions_->size(); i++) {
+         if (partitions_->filtered(i)) {
+            continue;
+         }
+
+         boost::shared_ptr<bloom_filter> filter;
+         int ret = 0;
+
+         for (size_t capacity = minimum_filter_capacity; ; ) {
+            filter.reset(new bloom_filter(capacity));
+            size_t n = 0;
+            ret = add_partition_signatures(partitions_->handle(i), *filter, n);
+            if (ret != 0 || n <= capacity) {
+               break;
+            }
+            capacity = n * 2;
+         }
+
+         // A filter that misses keys would hide records; try again on the next refresh
+
+         if (ret != 0) {
+            syslog_.notice() << "Cannot build the filter of partition " << partitions_->first_day(i) << ": " << db_strerror(ret);
+            continue;
+         }
+
+         {
+            scoped_rwlock lock(handles_lock_, true);
+            partitions_->set_filter(i, filter);
+         }
+
+         syslog_.notice() << "Built the filter of partition " << partitions_->first_day(i) << " with " << (unsigned int) filter->keys()
+                          << " keys in " << (unsigned int) (filter->size_in_bytes() / 1024) << " KB";
+      }
+   }
+
+   void database::schedule_partition_refresh()
+   {
+      partition_timer_.expires_from_now(boost::posix_time::seconds((long) partition_refresh_interval));
+      partition_timer_.async_wait(boost::bind(&database::handle_partition_refresh, this, asio::placeholders::error));
+   }
+
+   void database::handle_partition_refresh(const asio::error_code& error)
+   {
+      if (error || !partitions_) {
+         return;
+      }
+
+      try {
+         this->refresh_partitions();
+      } catch (std::exception const& e) {
+         syslog_.error() << "Cannot refresh the partitions: " << e.what();
+      }
+
+      this->schedule_partition_refresh();
+   }
+
+   //
+
+   void database::schedule_table_reload()
+   {
+      table_timer_.expires_from_now(boost::posix_time::seconds((long) table_reload_interval));
+      table_timer_.async_wait(boost::bind(&database::handle_table_reload, this, asio::placeholders::error));
+   }
+
+   void database::handle_table_reload(const asio::error_code& error)
+   {
+      if (error) {
+         return;
+      }
+
+      // Map the new file before dropping the old one; lookups in flight keep their mapping until
+      // they release the read lock
+
+      if (table_->modified()) {
+         try {
+            signature_table_ptr table(new signature_table(table_path_));
+            {
+               scoped_rwlock lock(handles_lock_, true);
+               table_ = table;
+            }
+            syslog_.notice() << "Reloaded " << table_path_.string() << " with " << (unsigned int) table->size() << " signatures";
+         } catch (std::exception const& e) {
+            syslog_.error() << "Cannot reload the signature table: " << e.what();
+         }
+      }
+
+      this->schedule_table_reload();
+   }
+
+   void database::start_warmup()
+   {
+      this->stop_warmup();
+
+      warmup_digests_ = hot_digests::load(hot_path_);
+      __atomic_store_n(&warmup_total_, warmup_digests_.size(), __ATOMIC_RELAXED);
+      if (warmup_digests_.empty()) {
+         return;
+      }
+
+      syslog_.notice() << "Warming up the database cache with " << (unsigned int) warmup_digests_.size() << " digests";
+
+      warmup_stopped_ = false;
+      for (size_t i = 0; i < warmup_threads; i++) {
+         warmup_.push_back(boost::shared_ptr<asio::thread>(new asio::thread(boost::bind(&database::warm, this, &warmup_digests_, i))));
+      }
+   }
+
+   void database::stop_warmup()
+   {
+      warmup_stopped_ = true;
+      for (size_t i = 0; i < warmup_.size(); i++) {
+         warmup_[i]->join();
+      }
+      warmup_.clear();
+      __atomic_store_n(&warmed_, 0, __ATOMIC_RELAXED);
+   }
+
+   void database::warm(std::vector<hash> const* digests, size_t first)
+   {
+      // Several threads keep several reads in flight; the lookups are not recorded as hot again
+
+      record r;
+      for (size_t i = first; i < digests->size() && !warmup_stopped_; i += warmup_threads) {
+         {
+            scoped_rwlock lock(handles_lock_, false);
+            this->get_locked((*digests)[i], r);
+         }
+         __atomic_fetch_add(&warmed_, 1, __ATOMIC_RELAXED);
+      }
+   }
+
+   void database::schedule_hot_save()
+   {
+      hot_timer_.expires_from_now(boost::posix_time::seconds((long) hot_save_interval));
+      hot_timer_.async_wait(boost::bind(&database::handle_hot_save, this, asio::placeholders::error));
+   }
+
+   void database::handle_hot_save(const asio::error_code& error)
+   {
+      if (error) {
+         return;
+      }
+
+      try {
+         hot_->save(hot_path_);
+      } catch (std::exception const& e) {
+         syslog_.error() << "Cannot save the hot digests: " << e.what();
+      }
+
+      this->schedule_hot_save();
+   }
+
 }
@@ -3,10 +3,13 @@
 #ifndef DATABASE_HPP
 #define DATABASE_HPP
 
+#include <pthread.h>
+
 #include <string>
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/signals.hpp>
@@ -14,8 +17,15 @@
 
 #include <db.h>
 
+#include "bloom_filter.hpp"
+#include "hot_digests.hpp"
+#include "partition_set.hpp"
 #include "update.hpp"
+#include "update_frame.hpp"
+#include "update_spool.hpp"
 #include "record.hpp"
+#include "record_cache.hpp"
+#include "signature_table.hpp"
 #include "syslog.hpp"
 
 namespace pyzor {
@@ -24,20 +34,60 @@ namespace pyzor {
 
    class database : boost::noncopyable
    {
+      public:
+
+         typedef boost::function<void (update const&)> update_function;
+         typedef boost::function<size_t ()> pending_function;
+
       public:
          
          database(syslog& syslog, asio::io_service& io_service_, boost::filesystem::path const& home, bool verbose = false);
+
+         /// Use the environment and database of a slave in the same process instead of connecting to
+         /// pyzord-slave. Updates are handed to forward on the io_service thread; pending tells how
+         /// many the slave has not written to the master yet.
+         database(syslog& syslog, asio::io_service& io_service_, boost::filesystem::path const& home, DB_ENV* env, DB* db,
+            update_function forward, pending_function pending, bool verbose = false);
          ~database();
          
       public:
          
          bool get(std::string const& hexsignature, record& r);
+         bool get(hash const& signature, record& r);
+
+         /// Look up several signatures at once, in key order and under a single lock.
+         void get(hash const* signatures, size_t n, record* records, bool* found);
          void get_updated_since(boost::uint32_t since, std::vector<record>& records);
          
          void erase(std::string const& hexsignature);
          void report(std::string const& hexsignature);
          void whitelist(std::string const& hexsignature);
+         void report(hash const& signature);
+         void whitelist(hash const& signature);
+
+         /// Updates that were queued for the master but not written yet
+         size_t pending_updates() const;
+
+         /// Journal the updates for the master in a directory, keeping at most memory_limit of them
+         /// in memory. Updates that were left there by the previous run are sent first.
+         void enable_spool(boost::filesystem::path const& path, size_t memory_limit);
          
+         void enable_cache(size_t memory_budget, unsigned int ttl);
+         record_cache const* cache() const;
+
+         void enable_filter();
+         bool filter_statistics(boost::uint64_t& bytes, boost::uint64_t& keys, boost::uint64_t& skips, boost::uint64_t& false_positives);
+
+         /// Answer lookups from a signature table instead of the local database. Reports are still
+         /// sent to the master; they show up once the table is rebuilt and replaced.
+         void use_table(boost::filesystem::path const& path);
+         size_t table_size();
+
+         /// Keep a sample of the digests that are found in a file, and look them up again in the
+         /// background whenever the local database comes online so that their pages are cached.
+         void enable_warmup(boost::filesystem::path const& path);
+         bool warmup_progress(boost::uint64_t& done, boost::uint64_t& total);
+
          size_t dump_modified_records(boost::filesystem::path const& path, boost::uint32_t min = 0, boost::uint32_t max = 0xffffffff);
          size_t dump_modified_records2(boost::filesystem::path const& path, boost::uint32_t min = 0, boost::uint32_t max = 0xffffffff);
 
@@ -47,8 +97,12 @@ namespace pyzor {
          static void log_error(const DB_ENV *dbenv, const char *errfx, const char *msg);
          
          void setup();
+         void open_database();
          void teardown();
 
+         bool get_locked(hash const& signature, record& r);
+         size_t dump_records(DB* db, std::ostream& out, boost::uint32_t min, boost::uint32_t max);
+
       public:
 
          bool up();
@@ -57,11 +111,34 @@ namespace pyzor {
 
          void connect();
          void handle_connect(const asio::error_code& error);
+         void handle_attach();
+         void start();
+         void queue_update(update const& u);
          void write_update(update u);
+         void send_updates();
          void handle_write_update(const asio::error_code& error);
+         void schedule_spool_sync();
+         void handle_spool_sync(const asio::error_code& error);
 
          void handle_read_ping(const asio::error_code& error);
 
+         void build_filter();
+         void schedule_filter_refresh();
+         void handle_filter_refresh(const asio::error_code& error);
+
+         void refresh_partitions();
+         void schedule_partition_refresh();
+         void handle_partition_refresh(const asio::error_code& error);
+
+         void schedule_table_reload();
+         void handle_table_reload(const asio::error_code& error);
+
+         void start_warmup();
+         void stop_warmup();
+         void warm(std::vector<hash> const* digests, size_t first);
+         void schedule_hot_save();
+         void handle_hot_save(const asio::error_code& error);
+
       private:
          
          syslog& syslog_;
@@ -73,10 +150,61 @@ namespace pyzor {
          DB* db_;
          DB* index_;
 
+         // Owned by the slave when it runs in this process
+         DB_ENV* shared_env_;
+         DB* shared_db_;
+         update_function forward_;
+         pending_function pending_;
+
+         // Guards the handles above; lookups run on the listener threads while setup and
+         // teardown happen on the io_service thread when the local database comes and goes.
+         pthread_rwlock_t handles_lock_;
+
+         boost::shared_ptr<record_cache> cache_;
+
+         // Only replaced on the io_service thread, with the handles lock held for writing
+         enum { minimum_filter_capacity = 1024 * 1024, filter_refresh_interval = 5, filter_refresh_overlap = 60 };
+         bool filter_enabled_;
+         boost::shared_ptr<bloom_filter> filter_;
+         // The newest updated time in the index that the filter has seen, in the clock of the master
+         boost::uint32_t filter_refreshed_;
+         size_t filter_scanned_;
+         boost::uint64_t filter_skips_;
+         boost::uint64_t filter_false_positives_;
+         asio::deadline_timer filter_timer_;
+
+         // Used instead of db_ and index_ when the master keeps the records in partitions. Only
+         // changed on the io_service thread, with the handles lock held for writing.
+         enum { partition_refresh_interval = 5 };
+         boost::shared_ptr<partition_set> partitions_;
+         asio::deadline_timer partition_timer_;
+
+         // Swapped on the io_service thread when the file on disk is replaced
+         enum { table_reload_interval = 30 };
+         boost::filesystem::path table_path_;
+         signature_table_ptr table_;
+         asio::deadline_timer table_timer_;
+
+         // The warm-up threads only look up; they stop before the next warm-up starts
+         enum { warmup_threads = 4, hot_save_interval = 300 };
+         boost::filesystem::path hot_path_;
+         boost::shared_ptr<hot_digests> hot_;
+         asio::deadline_timer hot_timer_;
+         std::vector<hash> warmup_digests_;
+         std::vector< boost::shared_ptr<asio::thread> > warmup_;
+         volatile bool warmup_stopped_;
+         boost::uint64_t warmed_;
+         boost::uint64_t warmup_total_;
+
          asio::ip::tcp::socket socket_;
          update_queue updates_;
+         update_frame frame_;
+         enum { spool_sync_interval = 1 };
+         boost::shared_ptr<update_spool> spool_;
+         asio::deadline_timer spool_timer_;
          asio::deadline_timer connect_timer_;
          bool connected_;
+         size_t pending_updates_;
 
       public:
 
@@ -0,0 +1,184 @@
+// datagram.cpp
+
+#include <errno.h>
+#include <string.h>
+
+#include "datagram.hpp"
+
+namespace pyzor {
+
+   datagram_batch::datagram_batch(size_t capacity, size_t datagram_size)
+      : capacity_(capacity == 0 ? 1 : capacity), datagram_size_(datagram_size), enabled_(false),
+        requests_(capacity_ * datagram_size_), responses_(capacity_ * datagram_size_),
+        request_lengths_(capacity_), response_lengths_(capacity_),
+        addresses_(capacity_), address_lengths_(capacity_), ready_(capacity_)
+   {
+#if defined(PYZOR_HAVE_MMSG)
+      enabled_ = (capacity_ > 1);
+
+      receive_vectors_.resize(capacity_);
+      receive_headers_.resize(capacity_);
+      send_vectors_.resize(capacity_);
+      send_headers_.resize(capacity_);
+#endif
+   }
+
+   bool datagram_batch::enabled() const
+   {
+      return enabled_;
+   }
+
+   size_t datagram_batch::capacity() const
+   {
+      return capacity_;
+   }
+
+   size_t datagram_batch::datagram_size() const
+   {
+      return datagram_size_;
+   }
+
+   char* datagram_batch::request(size_t i)
+   {
+      return &requests_[i * datagram_size_];
+   }
+
+   size_t datagram_batch::request_length(size_t i) const
+   {
+      return request_lengths_[i];
+   }
+
+   asio::ip::udp::endpoint datagram_batch::endpoint(size_t i) const
+   {
+      asio::ip::udp::endpoint endpoint;
+      memcpy(endpoint.data(), &addresses_[i], address_lengths_[i]);
+      endpoint.resize(address_lengths_[i]);
+      return endpoint;
+   }
+
+   void datagram_batch::set_request(size_t i, size_t length, asio::ip::udp::endpoint const& endpoint)
+   {
+      request_lengths_[i] = length;
+      memcpy(&addresses_[i], endpoint.data(), endpoint.size());
+      address_lengths_[i] = endpoint.size();
+   }
+
+   char* datagram_batch::response(size_t i)
+   {
+      return &responses_[i * datagram_size_];
+   }
+
+   size_t datagram_batch::response_length(size_t i) const
+   {
+      return response_lengths_[i];
+   }
+
+   void datagram_batch::set_response(size_t i, size_t length)
+   {
+      response_lengths_[i] = (length > datagram_size_) ? datagram_size_ : length;
+   }
+
+   size_t datagram_batch::receive(int socket, size_t first)
+   {
+#if defined(PYZOR_HAVE_MMSG)
+      if (!enabled_ || first >= capacity_) {
+         return first;
+      }
+
+      size_t n = capacity_ - first;
+
+      for (size_t i = 0; i < n; i++) {
+         receive_vectors_[i].iov_base = request(first + i);
+         receive_vectors_[i].iov_len = datagram_size_;
+         memset(&receive_headers_[i], 0, sizeof(mmsghdr));
+         receive_headers_[i].msg_hdr.msg_name = &addresses_[first + i];
+         receive_headers_[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+         receive_headers_[i].msg_hdr.msg_iov = &receive_vectors_[i];
+         receive_headers_[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      int received = ::recvmmsg(socket, &receive_headers_[0], n, MSG_DONTWAIT, NULL);
+      if (received < 0) {
+         if (errno == ENOSYS) {
+            // The kernel does not know recvmmsg; go back to one datagram per wakeup
+            enabled_ = false;
+         }
+         return first;
+      }
+
+      for (int i = 0; i < received; i++) {
+         request_lengths_[first + i] = receive_headers_[i].msg_len;
+         address_lengths_[first + i] = receive_headers_[i].msg_hdr.msg_namelen;
+      }
+
+      return first + received;
+#else
+      return first;
+#endif
+   }
+
+   size_t datagram_batch::send(int socket, size_t count)
+   {
+      // Slots without a response are answered elsewhere
+
+      size_t ready = 0;
+      for (size_t i = 0; i < count; i++) {
+         if (response_lengths_[i] != 0) {
+            ready_[ready++] = i;
+         }
+      }
+
+      size_t sent = 0;
+
+#if defined(PYZOR_HAVE_MMSG)
+      if (enabled_) {
+         for (size_t j = 0; j < ready; j++) {
+            size_t i = ready_[j];
+            send_vectors_[j].iov_base = response(i);
+            send_vectors_[j].iov_len = response_lengths_[i];
+            memset(&send_headers_[j], 0, sizeof(mmsghdr));
+            send_headers_[j].msg_hdr.msg_name = &addresses_[i];
+            send_headers_[j].msg_hdr.msg_namelen = address_lengths_[i];
+            send_headers_[j].msg_hdr.msg_iov = &send_vectors_[j];
+            send_headers_[j].msg_hdr.msg_iovlen = 1;
+         }
+
+         while (sent < ready) {
+            int n = ::sendmmsg(socket, &send_headers_[sent], ready - sent, MSG_DONTWAIT);
+            if (n < 0) {
+               if (errno == EINTR) {
+                  continue;
+               }
+               if (errno == ENOSYS) {
+                  enabled_ = false;
+                  break;
+               }
+               // The socket buffer is full; like any other UDP loss the clients will retry
+               return sent;
+            }
+            sent += n;
+         }
+
+         if (sent == ready) {
+            return sent;
+         }
+      }
+#endif
+
+      while (sent < ready) {
+         size_t i = ready_[sent];
+         ssize_t n = ::sendto(socket, response(i), response_lengths_[i], MSG_DONTWAIT,
+            (sockaddr*) &addresses_[i], address_lengths_[i]);
+         if (n < 0) {
+            if (errno == EINTR) {
+               continue;
+            }
+            break;
+         }
+         sent++;
+      }
+
+      return sent;
+   }
+
+}
@@ -0,0 +1,82 @@
+// datagram.hpp
+
+#ifndef PYZOR_DATAGRAM_HPP
+#define PYZOR_DATAGRAM_HPP
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <asio.hpp>
+
+// recvmmsg and sendmmsg are Linux specific; glibc defines MSG_WAITFORONE together with them.
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define PYZOR_HAVE_MMSG 1
+#endif
+
+namespace pyzor {
+
+   /// A fixed set of request and response slots for a UDP listener. The first request of a batch
+   /// is received through asio as usual; after that the socket is drained without blocking with a
+   /// single recvmmsg and all responses go back with a single sendmmsg. With a capacity of one, or
+   /// when the calls are not available, the listener keeps using plain async_send_to.
+
+   class datagram_batch : boost::noncopyable
+   {
+      public:
+
+         datagram_batch(size_t capacity, size_t datagram_size = 8192);
+
+      public:
+
+         bool enabled() const;
+         size_t capacity() const;
+         size_t datagram_size() const;
+
+         char* request(size_t i);
+         size_t request_length(size_t i) const;
+         asio::ip::udp::endpoint endpoint(size_t i) const;
+         void set_request(size_t i, size_t length, asio::ip::udp::endpoint const& endpoint);
+
+         char* response(size_t i);
+         size_t response_length(size_t i) const;
+         void set_response(size_t i, size_t length);
+
+      public:
+
+         /// Receive more requests into the slots following the first ones. Returns the total number of
+         /// requests in the batch, which is first if nothing else was waiting.
+         size_t receive(int socket, size_t first);
+
+         /// Send the responses of the first count slots, skipping slots with an empty response.
+         /// Returns the number of responses sent.
+         size_t send(int socket, size_t count);
+
+      private:
+
+         size_t capacity_;
+         size_t datagram_size_;
+         bool enabled_;
+
+         std::vector<char> requests_;
+         std::vector<char> responses_;
+         std::vector<size_t> request_lengths_;
+         std::vector<size_t> response_lengths_;
+         std::vector<sockaddr_storage> addresses_;
+         std::vector<socklen_t> address_lengths_;
+         std::vector<size_t> ready_;
+
+#if defined(PYZOR_HAVE_MMSG)
+         std::vector<iovec> receive_vectors_;
+         std::vector<mmsghdr> receive_headers_;
+         std::vector<iovec> send_vectors_;
+         std::vector<mmsghdr> send_headers_;
+#endif
+   };
+
+}
+
+#endif // PYZOR_DATAGRAM_HPP
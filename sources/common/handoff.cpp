@@ -0,0 +1,274 @@
+// handoff.cpp
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+#include "handoff.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      sockaddr_un handoff_address(std::string const& path)
+      {
+         sockaddr_un address;
+         if (path.length() >= sizeof(address.sun_path)) {
+            throw std::runtime_error(std::string("Handoff socket path is too long: ") + path);
+         }
+
+         memset(&address, 0, sizeof(address));
+         address.sun_family = AF_UNIX;
+         memcpy(address.sun_path, path.c_str(), path.length());
+
+         return address;
+      }
+
+      /// Wait up to a fifth of a second for the descriptor to become readable
+      bool readable(int fd)
+      {
+         pollfd p;
+         p.fd = fd;
+         p.events = POLLIN;
+         p.revents = 0;
+         return ::poll(&p, 1, 200) > 0;
+      }
+
+   }
+
+   /// Server
+
+   handoff_server::handoff_server(std::string const& path, socket_function sockets, completion done)
+      : path_(path), sockets_(sockets), done_(done), listener_(-1), stopped_(false), handed_off_(false)
+   {
+      sockaddr_un address = handoff_address(path_);
+
+      listener_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      if (listener_ < 0) {
+         throw std::runtime_error("Cannot create handoff socket");
+      }
+
+      ::unlink(path_.c_str());
+      if (::bind(listener_, (sockaddr*) &address, sizeof(address)) != 0 || ::chmod(path_.c_str(), 0600) != 0
+          || ::listen(listener_, 1) != 0)
+      {
+         ::close(listener_);
+         throw std::runtime_error(std::string("Cannot listen on handoff socket ") + path_);
+      }
+
+      thread_.reset(new asio::thread(boost::bind(&handoff_server::run, this)));
+   }
+
+   handoff_server::~handoff_server()
+   {
+      this->stop();
+   }
+
+   void handoff_server::stop()
+   {
+      if (thread_) {
+         stopped_ = true;
+         thread_->join();
+         thread_.reset();
+
+         // After a handoff the path belongs to the new process
+         ::close(listener_);
+         if (!handed_off_) {
+            ::unlink(path_.c_str());
+         }
+      }
+   }
+
+   void handoff_server::run()
+   {
+      while (!stopped_ && !handed_off_) {
+         if (!readable(listener_)) {
+            continue;
+         }
+
+         int connection = ::accept(listener_, NULL, NULL);
+         if (connection < 0) {
+            continue;
+         }
+
+         handed_off_ = this->serve(connection);
+         ::close(connection);
+
+         if (handed_off_) {
+            done_();
+         }
+      }
+   }
+
+   bool handoff_server::serve(int connection)
+   {
+      std::vector<handoff_socket> sockets = sockets_();
+      for (size_t i = handoff_client::max_sockets; i < sockets.size(); i++) {
+         ::close(sockets[i].native);
+      }
+      if (sockets.size() > handoff_client::max_sockets) {
+         sockets.erase(sockets.begin() + handoff_client::max_sockets, sockets.end());
+      }
+
+      // The kinds go in the data, one byte per socket; an empty list still needs one byte
+
+      char kinds[handoff_client::max_sockets + 1];
+      kinds[0] = (char) sockets.size();
+      for (size_t i = 0; i < sockets.size(); i++) {
+         kinds[i + 1] = (char) sockets[i].kind_;
+      }
+
+      iovec vector;
+      vector.iov_base = kinds;
+      vector.iov_len = sockets.size() + 1;
+
+      char control[CMSG_SPACE(sizeof(int) * handoff_client::max_sockets)];
+      msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = &vector;
+      message.msg_iovlen = 1;
+
+      if (!sockets.empty()) {
+         message.msg_control = control;
+         message.msg_controllen = CMSG_SPACE(sizeof(int) * sockets.size());
+
+         cmsghdr* header = CMSG_FIRSTHDR(&message);
+         header->cmsg_level = SOL_SOCKET;
+         header->cmsg_type = SCM_RIGHTS;
+         header->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+
+         int* fds = (int*) CMSG_DATA(header);
+         for (size_t i = 0; i < sockets.size(); i++) {
+            fds[i] = sockets[i].native;
+         }
+      }
+
+      int sent = ::sendmsg(connection, &message, 0);
+
+      for (size_t i = 0; i < sockets.size(); i++) {
+         ::close(sockets[i].native);
+      }
+
+      if (sent < 0) {
+         return false;
+      }
+
+      // Keep serving until the new process says it is ready. If it goes away instead, it failed to
+      // start and this process carries on.
+
+      while (!stopped_) {
+         if (readable(connection)) {
+            char ready;
+            return ::read(connection, &ready, 1) == 1;
+         }
+      }
+
+      return false;
+   }
+
+   /// Client
+
+   handoff_client::handoff_client()
+      : connection_(-1)
+   {
+   }
+
+   handoff_client::~handoff_client()
+   {
+      for (size_t i = 0; i < sockets_.size(); i++) {
+         ::close(sockets_[i].native);
+      }
+      if (connection_ >= 0) {
+         ::close(connection_);
+      }
+   }
+
+   bool handoff_client::take_over(std::string const& path)
+   {
+      sockaddr_un address = handoff_address(path);
+
+      int connection = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      if (connection < 0) {
+         return false;
+      }
+
+      if (::connect(connection, (sockaddr*) &address, sizeof(address)) != 0) {
+         ::close(connection);
+         return false;
+      }
+
+      char kinds[max_sockets + 1];
+      iovec vector;
+      vector.iov_base = kinds;
+      vector.iov_len = sizeof(kinds);
+
+      char control[CMSG_SPACE(sizeof(int) * max_sockets)];
+      msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = &vector;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+
+      ssize_t length = ::recvmsg(connection, &message, 0);
+      if (length < 1) {
+         ::close(connection);
+         return false;
+      }
+
+      for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+         if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            size_t n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int* fds = (int*) CMSG_DATA(header);
+            for (size_t i = 0; i < n; i++) {
+               handoff_socket::kind k = ((ssize_t) (i + 1) < length) ? (handoff_socket::kind) kinds[i + 1] : handoff_socket::udp;
+               sockets_.push_back(handoff_socket(k, fds[i]));
+            }
+         }
+      }
+
+      connection_ = connection;
+
+      return true;
+   }
+
+   bool handoff_client::connected() const
+   {
+      return connection_ >= 0;
+   }
+
+   int handoff_client::adopt(handoff_socket::kind k)
+   {
+      for (std::vector<handoff_socket>::iterator i = sockets_.begin(); i != sockets_.end(); ++i) {
+         if (i->kind_ == k) {
+            int native = i->native;
+            sockets_.erase(i);
+            return native;
+         }
+      }
+      return -1;
+   }
+
+   void handoff_client::ready()
+   {
+      for (size_t i = 0; i < sockets_.size(); i++) {
+         ::close(sockets_[i].native);
+      }
+      sockets_.clear();
+
+      if (connection_ >= 0) {
+         char ready = 1;
+         (void) ::write(connection_, &ready, 1);
+         ::close(connection_);
+         connection_ = -1;
+      }
+   }
+
+}
@@ -0,0 +1,112 @@
+// handoff.hpp
+
+#ifndef PYZOR_HANDOFF_HPP
+#define PYZOR_HANDOFF_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <asio.hpp>
+
+namespace pyzor {
+
+   /// A listening socket that is passed on to the next process, with what it is for.
+
+   struct handoff_socket
+   {
+      public:
+
+         enum kind { udp = 'u', tcp = 't' };
+
+      public:
+
+         handoff_socket(kind k, int native)
+            : kind_(k), native(native)
+         {
+         }
+
+      public:
+
+         kind kind_;
+         int native;
+   };
+
+   /// Hands the listening sockets of a running server to the process that replaces it, so that a
+   /// restart does not drop requests. The running server waits on a Unix stream socket. The new
+   /// process connects and receives duplicates of the listening sockets with SCM_RIGHTS; from then
+   /// on both processes receive from the same sockets. Once the new process is set up it tells the
+   /// old one, which then stops receiving, finishes what it has and exits.
+   ///
+   /// The server side runs on a thread of its own. The socket function and the completion are
+   /// called on that thread. The socket function returns duplicates of the listening sockets,
+   /// which the server closes once they are sent.
+
+   class handoff_server : boost::noncopyable
+   {
+      public:
+
+         typedef boost::function<std::vector<handoff_socket> ()> socket_function;
+         typedef boost::function<void ()> completion;
+
+      public:
+
+         handoff_server(std::string const& path, socket_function sockets, completion done);
+         ~handoff_server();
+
+      public:
+
+         void stop();
+
+      private:
+
+         void run();
+         bool serve(int connection);
+
+      private:
+
+         std::string path_;
+         socket_function sockets_;
+         completion done_;
+         int listener_;
+         volatile bool stopped_;
+         bool handed_off_;
+         boost::shared_ptr<asio::thread> thread_;
+   };
+
+   /// The side of the new process. If take_over() finds a running server, the new process should
+   /// use the sockets it got instead of binding its own and call ready() when it can answer requests.
+
+   class handoff_client : boost::noncopyable
+   {
+      public:
+
+         enum { max_sockets = 64 };
+
+      public:
+
+         handoff_client();
+         ~handoff_client();
+
+      public:
+
+         bool take_over(std::string const& path);
+         bool connected() const;
+
+         /// Removes the first socket of the given kind from the list; returns -1 if there is none left.
+         int adopt(handoff_socket::kind k);
+
+         /// Tell the old server to finish. Sockets that were not adopted are closed.
+         void ready();
+
+      private:
+
+         int connection_;
+         std::vector<handoff_socket> sockets_;
+   };
+
+}
+
+#endif // PYZOR_HANDOFF_HPP
@@ -2,7 +2,10 @@
 
 #include "hash.hpp"
 
+#include <ctype.h>
+
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 
@@ -20,14 +23,53 @@ namespace pyzor {
    
    hash::hash(std::string const& hex)
    {
-      if (hex.length() == 40)
+      std::memset(data_, 0, sizeof(data_));
+      this->decode(hex.data(), hex.length());
+   }
+
+   hash::hash(const char* hex, size_t length)
+   {
+      std::memset(data_, 0, sizeof(data_));
+      this->decode(hex, length);
+   }
+
+   bool hash::valid(const char* hex, size_t length)
+   {
+      if (length != 40) {
+         return false;
+      }
+
+      for (size_t i = 0; i < length; i++) {
+         if (isxdigit((unsigned char) hex[i]) == 0) {
+            return false;
+         }
+      }
+
+      return true;
+   }
+
+   namespace {
+
+      inline boost::uint8_t nibble(char c)
+      {
+         if (c >= '0' && c <= '9') {
+            return c - '0';
+         } else if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+         } else if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+         }
+         return 0;
+      }
+
+   }
+
+   void hash::decode(const char* hex, size_t length)
+   {
+      if (length == 40)
       {
          for (int i = 0; i < 20; i++) {
-            char s[3];
-            s[0] = hex[(i*2)];
-            s[1] = hex[(i*2)+1];
-            s[2] = 0x00;
-            data_[i] = std::strtol(s, NULL, 16);
+            data_[i] = (nibble(hex[(i*2)]) << 4) | nibble(hex[(i*2)+1]);
          }
       }
    }
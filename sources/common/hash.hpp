@@ -4,6 +4,7 @@
 #define PYZOR_HASH_HPP
 
 #include <iostream>
+#include <string>
 #include <boost/cstdint.hpp>
 
 namespace pyzor {
@@ -13,6 +14,11 @@ namespace pyzor {
          hash();
          hash(boost::uint8_t data[20]);
          hash(std::string const& hex);
+         hash(const char* hex, size_t length);
+      public:
+         static bool valid(const char* hex, size_t length);
+      private:
+         void decode(const char* hex, size_t length);
       public:
          boost::uint8_t data_[20];
    };
@@ -0,0 +1,107 @@
+// hot_digests.cpp
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "hot_digests.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      const char hot_magic[8] = { 'P', 'Y', 'Z', 'O', 'R', 'H', 'O', 'T' };
+
+      inline bool digest_less(hash const& a, hash const& b)
+      {
+         return memcmp(a.data_, b.data_, sizeof(a.data_)) < 0;
+      }
+
+      inline bool digest_equal(hash const& a, hash const& b)
+      {
+         return memcmp(a.data_, b.data_, sizeof(a.data_)) == 0;
+      }
+
+      inline bool digest_empty(hash const& h)
+      {
+         static const hash empty;
+         return digest_equal(h, empty);
+      }
+
+   }
+
+   hot_digests::hot_digests(size_t capacity)
+      : digests_(capacity), recorded_(0)
+   {
+   }
+
+   void hot_digests::record(hash const& digest)
+   {
+      boost::uint64_t n = __atomic_fetch_add(&recorded_, 1, __ATOMIC_RELAXED);
+      if ((n % sample_rate) == 0) {
+         digests_[(n / sample_rate) % digests_.size()] = digest;
+      }
+   }
+
+   size_t hot_digests::save(boost::filesystem::path const& path) const
+   {
+      std::vector<hash> digests(digests_);
+      std::sort(digests.begin(), digests.end(), digest_less);
+      digests.erase(std::unique(digests.begin(), digests.end(), digest_equal), digests.end());
+      if (!digests.empty() && digest_empty(digests.front())) {
+         digests.erase(digests.begin());
+      }
+
+      boost::filesystem::path tmp = path.string() + ".tmp";
+
+      std::ofstream out(tmp.string().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+      if (!out) {
+         throw std::runtime_error(std::string("Cannot create ") + tmp.string());
+      }
+
+      boost::uint32_t count = htonl((boost::uint32_t) digests.size());
+      out.write(hot_magic, sizeof(hot_magic));
+      out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+      for (size_t i = 0; i < digests.size(); i++) {
+         out.write(reinterpret_cast<const char*>(digests[i].data_), sizeof(digests[i].data_));
+      }
+
+      out.close();
+      if (!out) {
+         throw std::runtime_error(std::string("Cannot write ") + tmp.string());
+      }
+
+      if (::rename(tmp.string().c_str(), path.string().c_str()) != 0) {
+         throw std::runtime_error(std::string("Cannot rename ") + tmp.string());
+      }
+
+      return digests.size();
+   }
+
+   std::vector<hash> hot_digests::load(boost::filesystem::path const& path)
+   {
+      std::vector<hash> digests;
+
+      std::ifstream in(path.string().c_str(), std::ios::in | std::ios::binary);
+
+      char magic[sizeof(hot_magic)];
+      boost::uint32_t count = 0;
+      if (!in.read(magic, sizeof(magic)) || memcmp(magic, hot_magic, sizeof(magic)) != 0
+          || !in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+      {
+         return digests;
+      }
+
+      hash digest;
+      for (boost::uint32_t i = 0; i < ntohl(count) && in.read(reinterpret_cast<char*>(digest.data_), sizeof(digest.data_)); i++) {
+         digests.push_back(digest);
+      }
+
+      return digests;
+   }
+
+}
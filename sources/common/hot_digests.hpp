@@ -0,0 +1,52 @@
+// hot_digests.hpp
+
+#ifndef PYZOR_HOT_DIGESTS_HPP
+#define PYZOR_HOT_DIGESTS_HPP
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "hash.hpp"
+
+namespace pyzor {
+
+   /// Remembers a sample of the digests that were recently found, so that the next start of the
+   /// server can read their pages into the database cache before the checks come in. Every
+   /// sample_rate-th digest goes into a fixed ring; digests that are checked often show up in it
+   /// more than once and are the most likely to be in it.
+   ///
+   /// Recording takes no lock. Two threads can now and then overwrite the same entry, which at
+   /// worst warms up a digest that nobody asked for.
+
+   class hot_digests : boost::noncopyable
+   {
+      public:
+
+         enum { default_capacity = 65536, sample_rate = 8 };
+
+      public:
+
+         hot_digests(size_t capacity = default_capacity);
+
+      public:
+
+         void record(hash const& digest);
+
+         /// Write the distinct digests, sorted, to a file that replaces the previous one
+         size_t save(boost::filesystem::path const& path) const;
+
+         /// Returns nothing if the file is missing or not a hot digest file
+         static std::vector<hash> load(boost::filesystem::path const& path);
+
+      private:
+
+         std::vector<hash> digests_;
+         boost::uint64_t recorded_;
+   };
+
+}
+
+#endif // PYZOR_HOT_DIGESTS_HPP
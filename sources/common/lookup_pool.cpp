@@ -0,0 +1,190 @@
+// lookup_pool.cpp
+
+#include <time.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+#include "lookup_pool.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      class scoped_mutex : boost::noncopyable
+      {
+         public:
+
+            scoped_mutex(pthread_mutex_t& mutex)
+               : mutex_(mutex)
+            {
+               pthread_mutex_lock(&mutex_);
+            }
+
+            ~scoped_mutex()
+            {
+               pthread_mutex_unlock(&mutex_);
+            }
+
+         private:
+
+            pthread_mutex_t& mutex_;
+      };
+
+      boost::uint64_t now_usec()
+      {
+         timespec ts;
+         clock_gettime(CLOCK_MONOTONIC, &ts);
+         return ((boost::uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+      }
+
+   }
+
+   bool lookup_pool::hash_less::operator()(hash const& a, hash const& b) const
+   {
+      return memcmp(a.data_, b.data_, sizeof(a.data_)) < 0;
+   }
+
+   lookup_pool::lookup_pool(lookup_function lookup, size_t threads, size_t queue_limit)
+      : lookup_(lookup), queue_limit_(queue_limit), stopped_(false), coalesced_(0), overflows_(0)
+   {
+      pthread_mutex_init(&lock_, NULL);
+      pthread_cond_init(&ready_, NULL);
+
+      for (size_t i = 0; i < threads; i++) {
+         threads_.push_back(boost::shared_ptr<asio::thread>(new asio::thread(boost::bind(&lookup_pool::run, this))));
+      }
+   }
+
+   lookup_pool::~lookup_pool()
+   {
+      this->stop();
+      pthread_cond_destroy(&ready_);
+      pthread_mutex_destroy(&lock_);
+   }
+
+   bool lookup_pool::submit(hash const& digest, completion const& done)
+   {
+      scoped_mutex lock(lock_);
+
+      if (stopped_) {
+         return false;
+      }
+
+      pending_map::iterator i = pending_.find(digest);
+      if (i != pending_.end()) {
+         i->second.waiters.push_back(done);
+         coalesced_++;
+         return true;
+      }
+
+      if (queue_.size() >= queue_limit_) {
+         overflows_++;
+         return false;
+      }
+
+      pending& p = pending_[digest];
+      p.queued = now_usec();
+      p.waiters.push_back(done);
+      queue_.push_back(digest);
+
+      pthread_cond_signal(&ready_);
+
+      return true;
+   }
+
+   void lookup_pool::stop()
+   {
+      {
+         scoped_mutex lock(lock_);
+         stopped_ = true;
+         pthread_cond_broadcast(&ready_);
+      }
+
+      for (size_t i = 0; i < threads_.size(); i++) {
+         threads_[i]->join();
+      }
+      threads_.clear();
+   }
+
+   void lookup_pool::run()
+   {
+      for (;;) {
+         hash digest;
+
+         {
+            scoped_mutex lock(lock_);
+            while (queue_.empty() && !stopped_) {
+               pthread_cond_wait(&ready_, &lock_);
+            }
+            if (stopped_) {
+               return;
+            }
+            digest = queue_.front();
+            queue_.pop_front();
+            queue_latency_.report(now_usec() - pending_[digest].queued);
+         }
+
+         // The digest stays in the pending map while it is looked up so that new requests for it
+         // wait for this lookup instead of queueing another one
+
+         boost::uint64_t started = now_usec();
+
+         record r;
+         bool found = false;
+         try {
+            found = lookup_(digest, r);
+         } catch (std::exception const& e) {
+            memset(&r, 0, sizeof(record));
+         }
+
+         service_latency_.report(now_usec() - started);
+
+         std::vector<completion> waiters;
+         {
+            scoped_mutex lock(lock_);
+            pending_map::iterator i = pending_.find(digest);
+            waiters.swap(i->second.waiters);
+            pending_.erase(i);
+         }
+
+         for (size_t i = 0; i < waiters.size(); i++) {
+            waiters[i](found, r);
+         }
+      }
+   }
+
+   size_t lookup_pool::threads() const
+   {
+      return threads_.size();
+   }
+
+   size_t lookup_pool::depth()
+   {
+      scoped_mutex lock(lock_);
+      return queue_.size();
+   }
+
+   boost::uint64_t lookup_pool::coalesced() const
+   {
+      return __atomic_load_n(&coalesced_, __ATOMIC_RELAXED);
+   }
+
+   boost::uint64_t lookup_pool::overflows() const
+   {
+      return __atomic_load_n(&overflows_, __ATOMIC_RELAXED);
+   }
+
+   latency_histogram const& lookup_pool::queue_latency() const
+   {
+      return queue_latency_;
+   }
+
+   latency_histogram const& lookup_pool::service_latency() const
+   {
+      return service_latency_;
+   }
+
+}
@@ -0,0 +1,107 @@
+// lookup_pool.hpp
+
+#ifndef PYZOR_LOOKUP_POOL_HPP
+#define PYZOR_LOOKUP_POOL_HPP
+
+#include <pthread.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <asio.hpp>
+
+#include "hash.hpp"
+#include "record.hpp"
+#include "statistics.hpp"
+
+namespace pyzor {
+
+   /// Runs database lookups on a few threads of its own so that a lookup that has to wait for the
+   /// disk does not hold up the listener that received it. Lookups of a digest that is already
+   /// queued or running are not repeated; they complete together with the first one.
+   ///
+   /// Completions are called on a pool thread. They should hand the result back to the thread that
+   /// owns the request instead of doing any real work themselves.
+
+   class lookup_pool : boost::noncopyable
+   {
+      public:
+
+         typedef boost::function<bool (hash const& digest, record& r)> lookup_function;
+         typedef boost::function<void (bool found, record r)> completion;
+
+      public:
+
+         lookup_pool(lookup_function lookup, size_t threads, size_t queue_limit);
+         ~lookup_pool();
+
+      public:
+
+         /// Queue a lookup. Returns false without queueing anything when queue_limit digests are
+         /// already waiting; the caller should then do the lookup itself.
+         bool submit(hash const& digest, completion const& done);
+
+         void stop();
+
+      public:
+
+         size_t threads() const;
+         size_t depth();
+         boost::uint64_t coalesced() const;
+         boost::uint64_t overflows() const;
+
+         latency_histogram const& queue_latency() const;
+         latency_histogram const& service_latency() const;
+
+      private:
+
+         struct hash_less
+         {
+            bool operator()(hash const& a, hash const& b) const;
+         };
+
+         struct pending
+         {
+            public:
+
+               pending() : queued(0) {}
+
+            public:
+
+               boost::uint64_t queued;
+               std::vector<completion> waiters;
+         };
+
+         typedef std::map<hash, pending, hash_less> pending_map;
+
+      private:
+
+         void run();
+
+      private:
+
+         lookup_function lookup_;
+         size_t queue_limit_;
+
+         pthread_mutex_t lock_;
+         pthread_cond_t ready_;
+         std::deque<hash> queue_;
+         pending_map pending_;
+         bool stopped_;
+
+         std::vector< boost::shared_ptr<asio::thread> > threads_;
+
+         boost::uint64_t coalesced_;
+         boost::uint64_t overflows_;
+         latency_histogram queue_latency_;
+         latency_histogram service_latency_;
+   };
+
+}
+
+#endif // PYZOR_LOOKUP_POOL_HPP
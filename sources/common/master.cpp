@@ -3,11 +3,16 @@
 #include "common.hpp"
 #include "master.hpp"
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <utility>
 
 #include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/timer.hpp>
 
@@ -18,9 +23,38 @@
 #define EXPIRE_INTERVAL (60)
 #define MAX_RECORD_AGE (3 * 28 * 86400)
 #define MAX_RECORDS_TO_EXPIRE (3600)
+#define MAX_RECORDS_TO_KEEP (900)
 
 namespace pyzor {
 
+   namespace {
+
+      class scoped_rwlock
+      {
+         public:
+
+            scoped_rwlock(pthread_rwlock_t& lock, bool exclusive)
+               : lock_(lock)
+            {
+               if (exclusive) {
+                  pthread_rwlock_wrlock(&lock_);
+               } else {
+                  pthread_rwlock_rdlock(&lock_);
+               }
+            }
+
+            ~scoped_rwlock()
+            {
+               pthread_rwlock_unlock(&lock_);
+            }
+
+         private:
+
+            pthread_rwlock_t& lock_;
+      };
+
+   }
+
    ///
 
    master::session::session(asio::io_service& io_service, pyzor::syslog& syslog, master& master)
@@ -42,33 +76,38 @@ namespace pyzor {
    {
       syslog_.notice() << "Starting session";
 
-      asio::async_read(
-         socket_,
-         asio::buffer(&update_, sizeof(update)),
-         boost::bind(&master::session::handle_read, shared_from_this(), asio::placeholders::error)
+      socket_.async_read_some(
+         reader_.buffer(),
+         boost::bind(&master::session::handle_read, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred)
       );
 
       ping_timer_.expires_from_now(boost::posix_time::seconds(3));
       ping_timer_.async_wait(boost::bind(&master::session::write_ping, shared_from_this()));
    }
    
-   void master::session::handle_read(const asio::error_code& error)
+   void master::session::handle_read(const asio::error_code& error, size_t bytes_transferred)
    {
-      if (!error)
+      if (!error && reader_.consume(bytes_transferred, updates_))
       {
-         // Process the update
+         // Process the updates
 
-         master_.process_update(update_);
+         for (size_t i = 0; i < updates_.size(); i++) {
+            master_.process_update(updates_[i]);
+         }
+         updates_.clear();
          
-         // Read the next update
+         // Read the next updates
 
-         asio::async_read(
-            socket_,
-            asio::buffer(&update_, sizeof(update)),
-            boost::bind(&master::session::handle_read, shared_from_this(), asio::placeholders::error)
+         socket_.async_read_some(
+            reader_.buffer(),
+            boost::bind(&master::session::handle_read, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred)
          );
       } else {
-         syslog_.notice() << "Could not read packet from session. Closing socket. Reason: " << error.message();
+         if (error) {
+            syslog_.notice() << "Could not read packet from session. Closing socket. Reason: " << error.message();
+         } else {
+            syslog_.error() << "Received a damaged update frame. Closing socket.";
+         }
          socket_.close();
          ping_timer_.cancel();
          connected_ = false;
@@ -101,6 +140,207 @@ namespace pyzor {
       }
    }
    
+   /// Master Shard
+
+   bool master::hash_less::operator()(hash const& a, hash const& b) const
+   {
+      return memcmp(a.data_, b.data_, sizeof(a.data_)) < 0;
+   }
+
+   master::shard::shard(master& master, size_t index, size_t batch_size, unsigned int batch_delay)
+      : master_(master), index_(index), work_(new asio::io_service::work(io_service_)), batch_size_(batch_size),
+        batch_delay_(batch_delay), batch_timer_(io_service_), batch_timer_armed_(false), queued_(0), statistics_timer_(io_service_),
+        committed_updates_(0), written_records_(0), commits_(0), largest_batch_(0), commit_time_(0), slowest_commit_(0),
+        deadlocks_(0), retries_(0)
+   {
+   }
+
+   void master::shard::start()
+   {
+      this->schedule_statistics();
+      thread_.reset(new asio::thread(boost::bind(&master::shard::run, this)));
+   }
+
+   void master::shard::stop()
+   {
+      io_service_.post(boost::bind(&master::shard::handle_stop, this));
+      work_.reset();
+      thread_->join();
+   }
+
+   void master::shard::handle_stop()
+   {
+      this->commit_batch();
+      statistics_timer_.cancel();
+   }
+
+   void master::shard::post(update const& u)
+   {
+      __atomic_fetch_add(&queued_, 1, __ATOMIC_RELAXED);
+      io_service_.post(boost::bind(&master::shard::process_update, this, u));
+   }
+
+   void master::shard::run()
+   {
+      io_service_.run();
+   }
+
+   void master::shard::process_update(update u)
+   {
+      __atomic_fetch_sub(&queued_, 1, __ATOMIC_RELAXED);
+
+      batch_[u.ghash()].add(u);
+
+      if (batch_.size() >= batch_size_) {
+         this->commit_batch();
+      } else if (!batch_timer_armed_) {
+         batch_timer_armed_ = true;
+         batch_timer_.expires_from_now(boost::posix_time::milliseconds(batch_delay_));
+         batch_timer_.async_wait(boost::bind(&master::shard::handle_batch_timeout, this, asio::placeholders::error));
+      }
+   }
+
+   void master::shard::handle_batch_timeout(const asio::error_code& error)
+   {
+      if (!error) {
+         batch_timer_armed_ = false;
+         this->commit_batch();
+      }
+   }
+
+   void master::shard::commit_batch()
+   {
+      if (batch_timer_armed_) {
+         batch_timer_.cancel();
+         batch_timer_armed_ = false;
+      }
+
+      if (batch_.empty()) {
+         return;
+      }
+
+      boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+
+      // If the batch fails as a whole then write its records one by one, so that a single bad
+      // record does not take the others with it
+
+      try {
+         if (this->commit(batch_.begin(), batch_.end()) != 0 && batch_.size() > 1) {
+            for (delta_map::const_iterator i = batch_.begin(); i != batch_.end(); ++i) {
+               delta_map::const_iterator next = i;
+               this->commit(i, ++next);
+            }
+         }
+      } catch (std::exception const& e) {
+         master_.syslog_.error() << "Dropping " << (unsigned int) batch_.size() << " changed records: " << e.what();
+      }
+
+      boost::uint64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds();
+
+      for (delta_map::const_iterator i = batch_.begin(); i != batch_.end(); ++i) {
+         committed_updates_ += i->second.updates();
+      }
+      written_records_ += batch_.size();
+      commits_++;
+      commit_time_ += elapsed;
+      if (batch_.size() > largest_batch_) {
+         largest_batch_ = batch_.size();
+      }
+      if (elapsed > slowest_commit_) {
+         slowest_commit_ = elapsed;
+      }
+
+      batch_.clear();
+   }
+
+   int master::shard::commit(delta_map::const_iterator first, delta_map::const_iterator last)
+   {
+      if (master_.partitions_) {
+         master_.open_current_partition();
+      }
+
+      // Shards that write to the same pages can deadlock; the loser backs off and tries again. The
+      // partitions are only locked per attempt so that the expiry does not wait out the backoff.
+
+      for (unsigned int attempt = 0; ; attempt++) {
+         int ret;
+
+         {
+            scoped_rwlock lock(master_.partitions_lock_, false);
+
+            DB_TXN* txn;
+
+            ret = master_.env_->txn_begin(master_.env_, NULL, &txn, 0);
+            if (ret != 0) {
+               master_.syslog_.error() << "Cannot start a transaction: " << db_strerror(ret);
+               throw std::runtime_error("Cannot create a transaction");
+            }
+
+            for (delta_map::const_iterator i = first; i != last && ret == 0; ++i) {
+               ret = master_.apply_delta(txn, i->first, i->second);
+            }
+
+            if (ret == 0) {
+               ret = txn->commit(txn, 0);
+               if (ret != 0) {
+                  master_.syslog_.error() << "Cannot commit transaction: " << db_strerror(ret);
+               }
+               return ret;
+            }
+
+            txn->abort(txn);
+         }
+
+         if (ret != DB_LOCK_DEADLOCK) {
+            return ret;
+         }
+
+         deadlocks_++;
+         if (attempt == max_retries) {
+            master_.syslog_.error() << "Giving up on a transaction after " << (unsigned int) max_retries << " deadlocks";
+            return ret;
+         }
+
+         retries_++;
+         usleep((1000 << attempt) + (index_ * 100));
+      }
+   }
+
+   void master::shard::schedule_statistics()
+   {
+      statistics_timer_.expires_from_now(boost::posix_time::seconds((long) statistics_interval));
+      statistics_timer_.async_wait(boost::bind(&master::shard::handle_statistics, this, asio::placeholders::error));
+   }
+
+   void master::shard::handle_statistics(const asio::error_code& error)
+   {
+      if (error) {
+         return;
+      }
+
+      if (commits_ != 0) {
+         master_.syslog_.notice() << "Shard " << (unsigned int) index_ << " committed " << (unsigned int) committed_updates_
+                                  << " updates as " << (unsigned int) written_records_ << " record writes in " << (unsigned int) commits_
+                                  << " transactions; " << (unsigned int) (committed_updates_ / statistics_interval) << " updates/s, "
+                                  << (unsigned int) (written_records_ / commits_) << " records per commit on average and "
+                                  << (unsigned int) largest_batch_ << " at most, " << (unsigned int) (commit_time_ / commits_)
+                                  << " us per commit on average and " << (unsigned int) slowest_commit_ << " us at most, "
+                                  << (unsigned int) deadlocks_ << " lock conflicts, " << (unsigned int) retries_ << " retries, "
+                                  << (unsigned int) __atomic_load_n(&queued_, __ATOMIC_RELAXED) << " updates queued";
+      }
+
+      committed_updates_ = 0;
+      written_records_ = 0;
+      commits_ = 0;
+      largest_batch_ = 0;
+      commit_time_ = 0;
+      slowest_commit_ = 0;
+      deadlocks_ = 0;
+      retries_ = 0;
+
+      this->schedule_statistics();
+   }
+   
    /// Master Database
    
    master::master(pyzor::syslog& syslog, asio::io_service& io_service, boost::filesystem::path const& home, std::string const& local, std::vector<std::string> const& replicas, bool verbose)
@@ -108,8 +348,18 @@ namespace pyzor {
         db_(NULL), index_(NULL),
         global_acceptor_(io_service_, asio::ip::tcp::endpoint(asio::ip::address_v4::from_string(local.c_str()), 5555), true),
         local_acceptor_(io_service_, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 5555), true),
-        checkpoint_timer_(io_service), expire_timer_(io_service)
+        checkpoint_timer_(io_service), expire_timer_(io_service), partition_days_(0), batch_size_(1), batch_delay_(0), apply_threads_(1)
    {
+      // Dropping a partition should not have to wait for a pause between the commits of the shards
+
+      pthread_rwlockattr_t attributes;
+      pthread_rwlockattr_init(&attributes);
+#if defined(__linux__)
+      pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+      pthread_rwlock_init(&partitions_lock_, &attributes);
+      pthread_rwlockattr_destroy(&attributes);
+
       // Setup the database
 
       this->setup_environment();
@@ -139,13 +389,26 @@ namespace pyzor {
    {
       this->shutdown_database();
       this->shutdown_environment();
+      pthread_rwlock_destroy(&partitions_lock_);
    }
 
    //
 
    void master::run()
    {
+      // Sessions read on this thread and hand the updates to the shards
+
+      for (size_t i = 0; i < apply_threads_; i++) {
+         shards_.push_back(shard_ptr(new shard(*this, i, batch_size_, batch_delay_)));
+         shards_.back()->start();
+      }
+
       io_service_.run();
+
+      for (size_t i = 0; i < shards_.size(); i++) {
+         shards_[i]->stop();
+      }
+      shards_.clear();
    }
 
    void master::stop()
@@ -153,6 +416,53 @@ namespace pyzor {
       io_service_.stop();
    }
 
+   void master::enable_group_commit(size_t batch_size, unsigned int delay)
+   {
+      batch_size_ = batch_size;
+      batch_delay_ = delay;
+      syslog_.notice() << "Committing up to " << (unsigned int) batch_size_ << " updates at once, after at most " << batch_delay_ << " ms";
+   }
+
+   void master::enable_apply_threads(size_t threads)
+   {
+      apply_threads_ = threads;
+      syslog_.notice() << "Applying updates on " << (unsigned int) apply_threads_ << " threads";
+   }
+
+   void master::enable_partitions(unsigned int days)
+   {
+      // The records that are in signatures.db would not be found anymore
+
+      DBC* cursor;
+      int ret = db_->cursor(db_, NULL, &cursor, 0);
+      if (ret != 0) {
+         syslog_.error() << "Cannot create a cursor: " << db_strerror(ret);
+         throw std::runtime_error("Cannot setup the partitions");
+      }
+
+      DBT key, data;
+      memset(&key, 0, sizeof(DBT));
+      memset(&data, 0, sizeof(DBT));
+
+      ret = cursor->get(cursor, &key, &data, DB_FIRST);
+      cursor->close(cursor);
+
+      if (ret != DB_NOTFOUND) {
+         syslog_.error() << "Cannot partition the records: signatures.db is not empty";
+         throw std::runtime_error("Cannot setup the partitions");
+      }
+
+      // The empty signatures.db stays around since the slaves wait for it to come online
+
+      partition_days_ = days;
+      partitions_.reset(new partition_set(syslog_, env_, db_home_, true));
+      partitions_->refresh();
+      this->open_current_partition();
+
+      syslog_.notice() << "Keeping the records in partitions of " << partition_days_ << " days; found "
+                       << (unsigned int) partitions_->size() << " partitions";
+   }
+
    //
 
    void master::log_message(const DB_ENV *dbenv, const char *msg)
@@ -302,7 +612,7 @@ namespace pyzor {
          "signatures.db",
          NULL,
          DB_HASH,
-         DB_CREATE | DB_AUTO_COMMIT,
+         DB_CREATE | DB_AUTO_COMMIT | DB_THREAD,
          0
       );
       
@@ -331,7 +641,7 @@ namespace pyzor {
          "index.db",
          NULL,
          DB_BTREE,
-         DB_CREATE | DB_AUTO_COMMIT,
+         DB_CREATE | DB_AUTO_COMMIT | DB_THREAD,
          0
       );
 
@@ -371,6 +681,8 @@ namespace pyzor {
             syslog_.error() << "Failed to close the database: " << db_strerror(ret);
          }
       }
+
+      partitions_.reset();
    }
    
    void master::schedule_checkpoint(int interval)
@@ -443,9 +755,13 @@ namespace pyzor {
                }
                
                if (r->report_count() <= 1) {
+                  boost::uint32_t t = r->updated();
+                  ret = updated_cursor->del(updated_cursor, 0);
+                  if (ret != 0) {
+                     break;
+                  }
                   deleted++;
-                  updated = r->updated();
-                  updated_cursor->del(updated_cursor, 0);  
+                  updated = t;
                   if (deleted == MAX_RECORDS_TO_EXPIRE) {
                      break;
                   }
@@ -457,6 +773,14 @@ namespace pyzor {
          }
 
          updated_cursor->close(updated_cursor);
+
+         // The apply threads write to the same pages; leave it for the next run
+
+         if (ret == DB_LOCK_DEADLOCK) {
+            syslog_.notice() << "Record expiration ran into a deadlock; trying again later";
+            txn->abort(txn);
+            return 0;
+         }
       }
       
       // Commit the transaction
@@ -477,8 +801,9 @@ namespace pyzor {
    
    void master::handle_expire(const asio::error_code& error)
    {
-      if (!error)
-      {
+      if (!error && partitions_) {
+         this->expire_partitions();
+      } else if (!error) {
          syslog_.debug() << "\n\nRunning record expiration";
 
          // Figure out from when we need to check
@@ -540,111 +865,216 @@ namespace pyzor {
       }
    }
 
-   void master::process_update(update const& update)
+   void master::open_current_partition()
+   {
+      boost::uint32_t today = time(NULL) / 86400;
+      boost::uint32_t first_day = today - (today % partition_days_);
+
+      {
+         scoped_rwlock lock(partitions_lock_, false);
+         if (partitions_->size() != 0 && partitions_->first_day(0) >= first_day) {
+            return;
+         }
+      }
+
+      scoped_rwlock lock(partitions_lock_, true);
+      partitions_->create(first_day);
+   }
+
+   void master::expire_partitions()
    {
-      switch (update.type())
+      // A partition can go once the last day of its period is older than the records are kept.
+      // The newest partition always stays.
+
+      boost::uint32_t now = time(NULL);
+      boost::uint32_t first_day = 0;
+      bool expired = false;
+
       {
-         case update::report:
-            process_report_update(update, true);
-            break;
-         case update::whitelist:
-            process_report_update(update, false);
-            break;
-         case update::erase:
-            process_erase_update(update);
-            break;
+         scoped_rwlock lock(partitions_lock_, false);
+         size_t oldest = partitions_->size() - 1;
+         if (partitions_->size() > 1 && (partitions_->first_day(oldest) + partition_days_) * 86400 + MAX_RECORD_AGE <= now) {
+            first_day = partitions_->first_day(oldest);
+            expired = true;
+         }
       }
+
+      bool dropped = false;
+
+      if (expired) {
+         try {
+            boost::timer timer;
+            size_t records = 0, kept = 0;
+            dropped = this->expire_partition(first_day, records, kept);
+            if (dropped) {
+               syslog_.notice() << "Expired " << (unsigned int) (records - kept) << " records by dropping the partition of day "
+                                << first_day << " and kept " << (unsigned int) kept << " records that were reported more than once, in "
+                                << timer.elapsed() << " seconds";
+            }
+         } catch (std::exception const& e) {
+            syslog_.error() << "Error during partition expiration: " << e.what();
+         }
+      }
+
+      this->schedule_expire(dropped ? 1 : EXPIRE_INTERVAL);
    }
 
-   void master::process_report_update(update const& update, bool spam)
+   bool master::expire_partition(boost::uint32_t first_day, size_t& records, size_t& kept)
+   {
+      // Only this thread drops partitions, so the handle stays valid
+
+      DB* db = NULL;
+
+      {
+         scoped_rwlock lock(partitions_lock_, false);
+         for (size_t i = 0; i < partitions_->size(); i++) {
+            if (partitions_->first_day(i) == first_day) {
+               db = partitions_->handle(i);
+            }
+         }
+      }
+
+      if (db == NULL) {
+         return false;
+      }
+
+      // Find the records that were reported more than once; those move to the newest partition.
+      // The shards only delete from this partition, so a deadlock just means scanning again.
+
+      std::vector< std::pair<hash, record> > keep;
+      int ret = DB_LOCK_DEADLOCK;
+
+      for (unsigned int attempt = 0; ret == DB_LOCK_DEADLOCK && attempt < 8; attempt++) {
+         keep.clear();
+         records = 0;
+
+         DBC* cursor;
+         ret = db->cursor(db, NULL, &cursor, 0);
+         if (ret != 0) {
+            syslog_.error() << "Cannot create a cursor: " << db_strerror(ret);
+            return false;
+         }
+
+         DBT key, data;
+         memset(&key, 0, sizeof(DBT));
+         memset(&data, 0, sizeof(DBT));
+
+         while ((ret = cursor->get(cursor, &key, &data, DB_NEXT)) == 0) {
+            records++;
+            record* r = static_cast<record*>(data.data);
+            if (key.size == sizeof(hash) && data.size == sizeof(record) && r->report_count() > 1) {
+               keep.push_back(std::make_pair(hash(static_cast<boost::uint8_t*>(key.data)), *r));
+            }
+         }
+
+         cursor->close(cursor);
+      }
+
+      if (ret != DB_NOTFOUND) {
+         syslog_.error() << "Cannot scan the partition of day " << first_day << ": " << db_strerror(ret);
+         return false;
+      }
+
+      // Move them in small transactions
+
+      for (size_t first = 0; first < keep.size(); first += MAX_RECORDS_TO_KEEP) {
+         size_t last = std::min(first + MAX_RECORDS_TO_KEEP, keep.size());
+
+         ret = DB_LOCK_DEADLOCK;
+         for (unsigned int attempt = 0; ret == DB_LOCK_DEADLOCK && attempt < 8; attempt++) {
+            if (attempt != 0) {
+               usleep(1000 << attempt);
+            }
+            scoped_rwlock lock(partitions_lock_, false);
+            ret = this->keep_records(db, keep, first, last, kept);
+         }
+
+         if (ret != 0) {
+            syslog_.error() << "Cannot move the records out of the partition of day " << first_day << ": " << db_strerror(ret);
+            return false;
+         }
+      }
+
+      // Drop the partition
+
+      scoped_rwlock lock(partitions_lock_, true);
+      return partitions_->remove(first_day) == 0;
+   }
+
+   int master::keep_records(DB* from, std::vector< std::pair<hash, record> > const& records, size_t first, size_t last, size_t& kept)
    {
-      pyzor::record r;
-      memset(&r, 0, sizeof(record));
-      
-      // Start a transaction
-         
       DB_TXN* txn;
-         
+
       int ret = env_->txn_begin(env_, NULL, &txn, 0);
       if (ret != 0) {
          syslog_.error() << "Cannot start a transaction: " << db_strerror(ret);
          throw std::runtime_error("Cannot create a transaction");
       }
-         
-      // Try to find the record
-         
-      DBT key;
-      memset(&key, 0, sizeof(DBT));
-      key.data = (void*) &(update.ghash());
-      key.size = sizeof(hash);
-         
-      DBT data;
-      memset(&data, 0, sizeof(DBT));
-      data.data = &r;
-      data.ulen = sizeof(record);
-      data.flags = DB_DBT_USERMEM;
-      
-      int result = db_->get(db_, txn, &key, &data, 0);
-      if (result == 0 || result == DB_NOTFOUND)
-      {
-         // Update the record
-         
-         if (spam) {
-            r.report(update.time());
-         } else {
-            r.whitelist(update.time());
+
+      size_t moved = 0;
+
+      for (size_t i = first; i < last && ret == 0; i++) {
+         // Leave the record alone if a shard moved it to a newer partition in the meantime
+
+         record r;
+         size_t index = 0;
+         ret = partitions_->get(txn, records[i].first, r, index);
+         if (ret == DB_NOTFOUND || (ret == 0 && partitions_->handle(index) != from)) {
+            ret = 0;
+            continue;
          }
-            
-         // Write the record back
-         
-         memset(&key, 0, sizeof(DBT));
-         key.data = (void*) &(update.ghash());
-         key.size = sizeof(hash);
-         
-         memset(&data, 0, sizeof(DBT));
-         data.data = &r;
-         data.size = sizeof(record);
-         
-         int ret = db_->put(db_, txn, &key, &data, 0);
+
          if (ret == 0) {
-            ret = txn->commit(txn, 0);
-            if (ret != 0) {
-               syslog_.error() << "Cannot commit transaction: " << db_strerror(ret);
+            DBT key;
+            memset(&key, 0, sizeof(DBT));
+            key.data = (void*) records[i].first.data_;
+            key.size = sizeof(hash);
+
+            DBT data;
+            memset(&data, 0, sizeof(DBT));
+            data.data = (void*) &records[i].second;
+            data.size = sizeof(record);
+
+            DB* to = partitions_->handle(0);
+            ret = to->put(to, txn, &key, &data, DB_NOOVERWRITE);
+            if (ret == 0) {
+               moved++;
+            } else if (ret == DB_KEYEXIST) {
+               ret = 0;
             }
-         } else {
-            syslog_.error() << "Cannot put record: " << db_strerror(ret);
-            txn->abort(txn);
          }
       }
-      else
-      {
-         syslog_.error() << "Cannot get record: " << db_strerror(ret);
+
+      if (ret != 0) {
          txn->abort(txn);
+         return ret;
       }
+
+      ret = txn->commit(txn, 0);
+      if (ret != 0) {
+         syslog_.error() << "Cannot commit transaction: " << db_strerror(ret);
+         return ret;
+      }
+
+      kept += moved;
+      return 0;
    }
 
-   /// Erasing a record really means setting it's report and whitelist count to zero
-   
-   void master::process_erase_update(update const& update)
-   {      
+   void master::process_update(update const& update)
+   {
+      shards_[update.ghash().data_[0] % shards_.size()]->post(update);
+   }
+
+   int master::apply_delta(DB_TXN* txn, hash const& digest, update_delta const& delta)
+   {
       pyzor::record r;
       memset(&r, 0, sizeof(record));
       
-      // Start a transaction
-         
-      DB_TXN* txn;
-         
-      int ret = env_->txn_begin(env_, NULL, &txn, 0);
-      if (ret != 0) {
-         syslog_.error() << "Cannot start a transaction: " << db_strerror(ret);
-         throw std::runtime_error("Cannot create a transaction");
-      }
-         
       // Try to find the record
          
       DBT key;
       memset(&key, 0, sizeof(DBT));
-      key.data = (void*) &(update.ghash());
+      key.data = (void*) digest.data_;
       key.size = sizeof(hash);
          
       DBT data;
@@ -653,39 +1083,60 @@ namespace pyzor {
       data.ulen = sizeof(record);
       data.flags = DB_DBT_USERMEM;
       
-      int result = db_->get(db_, txn, &key, &data, 0);
-      if (result == 0 || result == DB_NOTFOUND)
-      {
-         // Reset/Delete the record
-         
-         r.reset();
-         
-         // Write the record back
-         
-         memset(&key, 0, sizeof(DBT));
-         key.data = (void*) &(update.ghash());
-         key.size = sizeof(hash);
-         
-         memset(&data, 0, sizeof(DBT));
-         data.data = &r;
-         data.size = sizeof(record);
-         
-         int ret = db_->put(db_, txn, &key, &data, 0);
-         if (ret == 0) {
-            ret = txn->commit(txn, 0);
+      // With partitions the record is written to the newest one and removed from where it was
+
+      DB* db = db_;
+      int ret;
+
+      if (partitions_) {
+         size_t index = 0;
+         ret = partitions_->get(txn, digest, r, index);
+         db = partitions_->handle(0);
+         if (ret == 0 && index != 0) {
+            DB* from = partitions_->handle(index);
+            ret = from->del(from, txn, &key, 0);
             if (ret != 0) {
-               syslog_.error() << "Cannot commit transaction: " << db_strerror(ret);
+               syslog_.error() << "Cannot move record: " << db_strerror(ret);
+               return ret;
             }
-         } else {
-            syslog_.error() << "Cannot put record: " << db_strerror(ret);
-            txn->abort(txn);
          }
+      } else {
+         ret = db_->get(db_, txn, &key, &data, 0);
       }
-      else
-      {
+
+      if (ret != 0 && ret != DB_NOTFOUND) {
          syslog_.error() << "Cannot get record: " << db_strerror(ret);
-         txn->abort(txn);
+         return ret;
+      }
+
+      // Update the record; erasing a record really means setting it's report and whitelist count to zero
+
+      delta.apply(r);
+
+      // The replicas follow the updated time to find the records that changed, so it is when the
+      // master wrote the record and not the older time of a report that arrived late
+
+      boost::uint32_t now = time(NULL);
+      if (r.updated() < now) {
+         r.updated(now);
+      }
+            
+      // Write the record back
+         
+      memset(&key, 0, sizeof(DBT));
+      key.data = (void*) digest.data_;
+      key.size = sizeof(hash);
+         
+      memset(&data, 0, sizeof(DBT));
+      data.data = &r;
+      data.size = sizeof(record);
+         
+      ret = db->put(db, txn, &key, &data, 0);
+      if (ret != 0) {
+         syslog_.error() << "Cannot put record: " << db_strerror(ret);
       }
+
+      return ret;
    }
 
    void master::handle_local_accept(master::session_ptr session, const asio::error_code& error)
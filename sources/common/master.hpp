@@ -2,11 +2,15 @@
 #ifndef PYZOR_MASTER_HPP
 #define PYZOR_MASTER_HPP
 
+#include <pthread.h>
+
+#include <map>
 #include <string>
 #include <vector>
 
 #include <boost/filesystem.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <asio.hpp>
 
@@ -16,8 +20,11 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <asio.hpp>
 
+#include "partition_set.hpp"
 #include "record.hpp"
 #include "update.hpp"
+#include "update_delta.hpp"
+#include "update_frame.hpp"
 #include "syslog.hpp"
 
 namespace pyzor {
@@ -44,7 +51,7 @@ namespace pyzor {
             public:
                
                void start();
-               void handle_read(const asio::error_code& error);
+               void handle_read(const asio::error_code& error, size_t bytes_transferred);
                
             public:
                
@@ -55,7 +62,8 @@ namespace pyzor {
                
                asio::ip::tcp::socket socket_;
                pyzor::syslog& syslog_;
-               update update_;
+               update_reader reader_;
+               std::vector<update> updates_;
                master& master_;
                asio::deadline_timer ping_timer_;
                bool connected_;
@@ -63,6 +71,82 @@ namespace pyzor {
          
          typedef boost::shared_ptr<session> session_ptr;
          
+      private:
+
+         struct hash_less
+         {
+            public:
+
+               bool operator()(hash const& a, hash const& b) const;
+         };
+
+         typedef std::map<hash, update_delta, hash_less> delta_map;
+
+         /// Applies the updates for a share of the digests on a thread of its own. A digest always
+         /// goes to the same shard, so its updates are applied in the order they came in.
+
+         class shard : boost::noncopyable
+         {
+            public:
+
+               shard(master& master, size_t index, size_t batch_size, unsigned int batch_delay);
+
+            public:
+
+               void start();
+               /// Commit what is left and wait for the thread to finish
+               void stop();
+
+               /// Called from the io_service thread of the master
+               void post(update const& u);
+
+            private:
+
+               void run();
+               void handle_stop();
+
+               void process_update(update u);
+               void handle_batch_timeout(const asio::error_code& error);
+               void commit_batch();
+               int commit(delta_map::const_iterator first, delta_map::const_iterator last);
+
+               void schedule_statistics();
+               void handle_statistics(const asio::error_code& error);
+
+            private:
+
+               enum { statistics_interval = 60, max_retries = 8 };
+
+               master& master_;
+               size_t index_;
+               asio::io_service io_service_;
+               boost::shared_ptr<asio::io_service::work> work_;
+               boost::shared_ptr<asio::thread> thread_;
+
+               // Updates are merged here per digest until the next commit
+               size_t batch_size_;
+               unsigned int batch_delay_;
+               delta_map batch_;
+               asio::deadline_timer batch_timer_;
+               bool batch_timer_armed_;
+
+               // Posted but not picked up by the thread yet
+               size_t queued_;
+
+               // Since the last time they were logged
+               asio::deadline_timer statistics_timer_;
+               boost::uint64_t committed_updates_;
+               boost::uint64_t written_records_;
+               boost::uint64_t commits_;
+               boost::uint64_t largest_batch_;
+               boost::uint64_t commit_time_;
+               boost::uint64_t slowest_commit_;
+               boost::uint64_t deadlocks_;
+               boost::uint64_t retries_;
+         };
+
+         typedef boost::shared_ptr<shard> shard_ptr;
+
       public:
 
          master(pyzor::syslog& syslog, asio::io_service& io_service, boost::filesystem::path const& home, std::string const& local, std::vector<std::string> const& replicas, bool verbose = false);
@@ -73,6 +157,19 @@ namespace pyzor {
          void run();
          void stop();
 
+         /// Collect updates until batch_size digests have changed or the oldest update has waited
+         /// delay milliseconds, then write each changed record once in a single transaction. The
+         /// default commits every update on its own.
+         void enable_group_commit(size_t batch_size, unsigned int delay);
+
+         /// Apply updates on several threads, each with its own share of the digests
+         void enable_apply_threads(size_t threads);
+
+         /// Keep the records in a partition per period of days instead of in signatures.db, moving
+         /// a record to the newest partition whenever it changes. Expiry then drops whole
+         /// partitions. Only for a master that has no records in signatures.db yet.
+         void enable_partitions(unsigned int days);
+
       private:
 
          static void log_message(const DB_ENV *dbenv, const char *msg);
@@ -92,11 +189,18 @@ namespace pyzor {
          void schedule_expire(int interval);
          void handle_expire(const asio::error_code& error);
 
+         void open_current_partition();
+         void expire_partitions();
+         bool expire_partition(boost::uint32_t first_day, size_t& records, size_t& kept);
+         int keep_records(DB* from, std::vector< std::pair<hash, record> > const& records, size_t first, size_t last, size_t& kept);
+
       public:
          
          void process_update(update const& update);
-         void process_report_update(update const& update, bool spam);
-         void process_erase_update(update const& update);
+
+      private:
+
+         int apply_delta(DB_TXN* txn, hash const& digest, update_delta const& delta);
 
       private:
 
@@ -119,6 +223,18 @@ namespace pyzor {
          asio::ip::tcp::acceptor local_acceptor_;
          asio::deadline_timer checkpoint_timer_;
          asio::deadline_timer expire_timer_;
+
+         // Partitions are added by the shards and dropped by the expiry; both hold the lock for
+         // writing, while a transaction that reads or writes the partitions holds it for reading
+         unsigned int partition_days_;
+         boost::scoped_ptr<partition_set> partitions_;
+         pthread_rwlock_t partitions_lock_;
+
+         // Only started while the master runs
+         size_t batch_size_;
+         unsigned int batch_delay_;
+         size_t apply_threads_;
+         std::vector<shard_ptr> shards_;
    };
 
    typedef boost::shared_ptr<master> master_ptr;
@@ -0,0 +1,289 @@
+// message.cpp
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "message.hpp"
+
+namespace pyzor {
+
+   const char* const field_names[field_unknown] = {
+      "Code",
+      "Count",
+      "Diag",
+      "Op",
+      "Op-Digest",
+      "PV",
+      "Thread",
+      "Time",
+      "WL-Count"
+   };
+
+   field find_field(string_ref const& name)
+   {
+      for (int i = 0; i < field_unknown; i++) {
+         if (name == field_names[i]) {
+            return (field) i;
+         }
+      }
+      return field_unknown;
+   }
+
+   namespace {
+
+      const char* const op_names[] = { "", "check", "report", "whitelist", "ping", "shutdown", "statistics", "mcheck" };
+
+      request::op find_op(string_ref const& name)
+      {
+         for (int i = request::op_check; i <= request::op_mcheck; i++) {
+            if (name == op_names[i]) {
+               return (request::op) i;
+            }
+         }
+         return request::op_unknown;
+      }
+
+   }
+
+   /// Request
+
+   request::request()
+      : binary(false), op_(op_unknown), digest_count(0)
+   {
+   }
+
+   bool request::parse(const char* buffer, size_t length)
+   {
+      if (binary::detect(buffer, length)) {
+         return this->parse_binary(buffer, length);
+      }
+
+      packet_view view;
+      bool valid = view.parse(buffer, length);
+
+      string_ref digest_hex;
+
+      for (size_t i = 0; i < view.size(); i++) {
+         switch (find_field(view.name(i))) {
+            case field_op:
+               op_ = find_op(view.value(i));
+               break;
+            case field_op_digest:
+               digest_hex = view.value(i);
+               if (digest_count < max_digests && hash::valid(view.value(i).data, view.value(i).length)) {
+                  digests[digest_count++] = hash(view.value(i).data, view.value(i).length);
+               }
+               break;
+            case field_pv:
+               pv = view.value(i);
+               break;
+            case field_thread:
+               thread = view.value(i);
+               break;
+            default:
+               break;
+         }
+      }
+
+      // The view already checked the digests of the ops that need them
+
+      if (valid && hash::valid(digest_hex.data, digest_hex.length)) {
+         digest = hash(digest_hex.data, digest_hex.length);
+      }
+
+      return valid;
+   }
+
+   bool request::parse_binary(const char* buffer, size_t length)
+   {
+      binary = true;
+
+      // Only the current version passes the protocol version check of the handlers
+
+      const unsigned char* header = (const unsigned char*) buffer;
+      if (header[2] == binary::version) {
+         pv = string_ref("2.0", 3);
+      }
+
+      if (header[3] >= op_check && header[3] <= op_mcheck) {
+         op_ = (op) header[3];
+      }
+
+      thread = string_ref(buffer + 4, 4);
+
+      // Ops with digests must carry exactly the digests and nothing else
+
+      const char* digests_data = buffer + binary::header_size;
+      size_t digests_length = length - binary::header_size;
+
+      switch (op_) {
+         case op_check:
+         case op_report:
+         case op_whitelist:
+            if (digests_length != binary::digest_size) {
+               return false;
+            }
+            break;
+         case op_mcheck:
+            if (digests_length == 0 || (digests_length % binary::digest_size) != 0
+                || (digests_length / binary::digest_size) > max_digests)
+            {
+               return false;
+            }
+            break;
+         default:
+            return true;
+      }
+
+      for (size_t i = 0; i < digests_length; i += binary::digest_size) {
+         memcpy(digests[digest_count++].data_, digests_data + i, binary::digest_size);
+      }
+      digest = digests[digest_count - 1];
+
+      return true;
+   }
+
+   /// Reply writer
+
+   reply_writer::reply_writer(char* buffer, size_t size)
+      : buffer_(buffer), size_(size), length_(0)
+   {
+   }
+
+   void reply_writer::write(const char* name, string_ref const& value)
+   {
+      append(name, strlen(name));
+      append(": ", 2);
+      append(value.data, value.length);
+      append("\n", 1);
+   }
+
+   void reply_writer::write(const char* name, boost::uint64_t value)
+   {
+      char digits[20];
+      size_t n = 0;
+      do {
+         digits[sizeof(digits) - ++n] = '0' + (value % 10);
+         value /= 10;
+      } while (value != 0);
+
+      append(name, strlen(name));
+      append(": ", 2);
+      append(digits + sizeof(digits) - n, n);
+      append("\n", 1);
+   }
+
+   size_t reply_writer::length() const
+   {
+      return length_;
+   }
+
+   void reply_writer::append(const char* data, size_t length)
+   {
+      if (length > size_ - length_) {
+         length = size_ - length_;
+      }
+      memcpy(buffer_ + length_, data, length);
+      length_ += length;
+   }
+
+   /// Reply
+
+   reply::reply()
+      : binary(false), op_(request::op_unknown), code(200), diag("OK"), counts_(0), statistics_(0)
+   {
+   }
+
+   void reply::respond_to(request const& req)
+   {
+      binary = req.binary;
+      op_ = req.op_;
+      thread = req.thread;
+   }
+
+   void reply::status(unsigned int code, const char* diag)
+   {
+      this->code = code;
+      this->diag = diag;
+   }
+
+   void reply::counts(boost::uint32_t count, boost::uint32_t wl_count)
+   {
+      if (counts_ < max_counts) {
+         count_[counts_] = count;
+         wl_count_[counts_] = wl_count;
+         counts_++;
+      }
+   }
+
+   void reply::statistic(const char* name, boost::uint64_t value)
+   {
+      if (statistics_ < max_statistics) {
+         statistic_names_[statistics_] = name;
+         statistic_values_[statistics_] = value;
+         statistics_++;
+      }
+   }
+
+   size_t reply::archive(char* buffer, size_t buffer_size) const
+   {
+      if (binary) {
+         return this->archive_binary(buffer, buffer_size);
+      }
+
+      reply_writer writer(buffer, buffer_size);
+
+      writer.write(field_names[field_code], (boost::uint64_t) code);
+      for (size_t i = 0; i < counts_; i++) {
+         writer.write(field_names[field_count], (boost::uint64_t) count_[i]);
+      }
+      writer.write(field_names[field_diag], string_ref(diag, strlen(diag)));
+      writer.write(field_names[field_pv], string_ref("2.0", 3));
+      for (size_t i = 0; i < statistics_; i++) {
+         writer.write(statistic_names_[i], statistic_values_[i]);
+      }
+      writer.write(field_names[field_thread], thread);
+      for (size_t i = 0; i < counts_; i++) {
+         writer.write(field_names[field_wl_count], (boost::uint64_t) wl_count_[i]);
+      }
+
+      return writer.length();
+   }
+
+   size_t reply::archive_binary(char* buffer, size_t buffer_size) const
+   {
+      if (buffer_size < binary::reply_header_size) {
+         return 0;
+      }
+
+      size_t counts = counts_;
+      if (counts > (buffer_size - binary::reply_header_size) / binary::counts_size) {
+         counts = (buffer_size - binary::reply_header_size) / binary::counts_size;
+      }
+
+      unsigned char* header = (unsigned char*) buffer;
+      header[0] = binary::magic_0;
+      header[1] = binary::magic_1;
+      header[2] = binary::version;
+      header[3] = (unsigned char) op_;
+
+      memset(buffer + 4, 0, 4);
+      if (thread.length == 4) {
+         memcpy(buffer + 4, thread.data, 4);
+      }
+
+      boost::uint16_t code_and_counts[2] = { htons((boost::uint16_t) code), htons((boost::uint16_t) counts) };
+      memcpy(buffer + binary::header_size, code_and_counts, sizeof(code_and_counts));
+
+      char* p = buffer + binary::reply_header_size;
+      for (size_t i = 0; i < counts; i++) {
+         boost::uint32_t pair[2] = { htonl(count_[i]), htonl(wl_count_[i]) };
+         memcpy(p, pair, sizeof(pair));
+         p += sizeof(pair);
+      }
+
+      return p - buffer;
+   }
+
+}
@@ -0,0 +1,144 @@
+// message.hpp
+
+#ifndef PYZOR_MESSAGE_HPP
+#define PYZOR_MESSAGE_HPP
+
+#include <boost/cstdint.hpp>
+
+#include "hash.hpp"
+#include "packet.hpp"
+
+namespace pyzor {
+
+   /// The header names the servers read and write, sorted the way packet::archive used to write them.
+
+   enum field {
+      field_code,
+      field_count,
+      field_diag,
+      field_op,
+      field_op_digest,
+      field_pv,
+      field_thread,
+      field_time,
+      field_wl_count,
+      field_unknown
+   };
+
+   extern const char* const field_names[field_unknown];
+
+   field find_field(string_ref const& name);
+
+   /// A parsed Pyzor request, in either the text or the binary protocol. The string fields point
+   /// into the receive buffer; for a binary request the thread is the 4 raw header bytes.
+
+   struct request
+   {
+      public:
+
+         enum op { op_unknown, op_check, op_report, op_whitelist, op_ping, op_shutdown, op_statistics, op_mcheck };
+         enum { max_digests = packet_view::max_digests };
+
+      public:
+
+         request();
+
+      public:
+
+         bool parse(const char* buffer, size_t length);
+
+      private:
+
+         bool parse_binary(const char* buffer, size_t length);
+
+      public:
+
+         bool binary;
+         op op_;
+         string_ref pv;
+         string_ref thread;
+         hash digest;
+
+         // Every valid Op-Digest in the order they were sent; digest is the last of them
+         size_t digest_count;
+         hash digests[max_digests];
+   };
+
+   /// Formats header lines straight into a send buffer. Output that does not fit is dropped.
+
+   class reply_writer
+   {
+      public:
+
+         reply_writer(char* buffer, size_t size);
+
+      public:
+
+         void write(const char* name, string_ref const& value);
+         void write(const char* name, boost::uint64_t value);
+
+         size_t length() const;
+
+      private:
+
+         void append(const char* data, size_t length);
+
+      private:
+
+         char* buffer_;
+         size_t size_;
+         size_t length_;
+   };
+
+   /// A Pyzor reply. Counts are only written for answered check requests; a multi check gets a
+   /// Count and a WL-Count line per digest, in the order of the digests. Statistics are written in
+   /// the order they were added, which must be sorted by name, and only in text replies.
+
+   struct reply
+   {
+      public:
+
+         enum { max_statistics = 40, max_counts = request::max_digests };
+
+      public:
+
+         reply();
+
+      public:
+
+         /// Answer in the same protocol as the request and with its thread
+         void respond_to(request const& req);
+
+         void status(unsigned int code, const char* diag);
+         /// Add the counts for the next digest
+         void counts(boost::uint32_t count, boost::uint32_t wl_count);
+         void statistic(const char* name, boost::uint64_t value);
+
+         size_t archive(char* buffer, size_t buffer_size) const;
+
+      public:
+
+         bool binary;
+         request::op op_;
+         string_ref thread;
+         unsigned int code;
+         const char* diag;
+
+      private:
+
+         size_t archive_binary(char* buffer, size_t buffer_size) const;
+
+      private:
+
+         size_t counts_;
+         boost::uint32_t count_[max_counts];
+         boost::uint32_t wl_count_[max_counts];
+
+         size_t statistics_;
+         const char* statistic_names_[max_statistics];
+         boost::uint64_t statistic_values_[max_statistics];
+   };
+
+}
+
+#endif // PYZOR_MESSAGE_HPP
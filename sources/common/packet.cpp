@@ -1,8 +1,6 @@
 
 #include <ctype.h>
-
-#include <boost/tokenizer.hpp>
-#include <boost/regex.hpp>
+#include <cstring>
 
 #include "packet.hpp"
 
@@ -10,64 +8,247 @@
 
 namespace pyzor {
 
-   bool packet::parse(packet& packet, const char* buffer, size_t length)
+   namespace {
+
+      inline bool is_space(char c)
+      {
+         return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+      }
+
+      inline bool is_word(string_ref const& s)
+      {
+         for (size_t i = 0; i < s.length; i++) {
+            if (!isalnum((unsigned char) s.data[i]) && s.data[i] != '_') {
+               return false;
+            }
+         }
+         return true;
+      }
+
+      inline bool is_digest(string_ref const& s)
+      {
+         if (s.length != 40) {
+            return false;
+         }
+         for (size_t i = 0; i < s.length; i++) {
+            if (isxdigit((unsigned char) s.data[i]) == 0) {
+               return false;
+            }
+         }
+         return true;
+      }
+
+      /// Match a single line against "^(\S+?):\s+(.*)$" without a regex: the name runs up to the
+      /// first colon that is followed by whitespace and the value starts after that whitespace.
+
+      bool split_line(const char* line, size_t length, string_ref& name, string_ref& value)
+      {
+         if (length == 0 || is_space(line[0])) {
+            return false;
+         }
+
+         for (size_t i = 1; i + 1 < length && !is_space(line[i]); i++) {
+            if (line[i] == ':' && is_space(line[i + 1])) {
+               size_t start = i + 1;
+               while (start < length && is_space(line[start])) {
+                  start++;
+               }
+               name = string_ref(line, i);
+               value = string_ref(line + start, length - start);
+               return true;
+            }
+         }
+
+         return false;
+      }
+
+   }
+
+   /// String reference
+
+   string_ref::string_ref()
+      : data(""), length(0)
    {
-      std::string tmp(buffer, length);
+   }
 
-      boost::char_separator<char> separator("\r\n");
-      boost::tokenizer< boost::char_separator<char> > tokenizer(tmp, separator);
-      
-      for (boost::tokenizer< boost::char_separator<char> >::iterator i = tokenizer.begin(); i!=tokenizer.end(); ++i) {
-         boost::regex regex("^(\\S+?):\\s+(.*)$", boost::regex::perl);
-         boost::smatch matches;
-         if (boost::regex_match(*i, matches, regex)) {
-            packet.attributes_[matches[1].str()] = matches[2].str();
+   string_ref::string_ref(const char* data, size_t length)
+      : data(data), length(length)
+   {
+   }
+
+   bool string_ref::empty() const
+   {
+      return length == 0;
+   }
+
+   std::string string_ref::str() const
+   {
+      return std::string(data, length);
+   }
+
+   bool string_ref::operator==(const char* s) const
+   {
+      return strlen(s) == length && memcmp(data, s, length) == 0;
+   }
+
+   bool string_ref::operator!=(const char* s) const
+   {
+      return !(*this == s);
+   }
+
+   bool string_ref::operator==(string_ref const& s) const
+   {
+      return length == s.length && memcmp(data, s.data, length) == 0;
+   }
+
+   std::ostream& operator<<(std::ostream& stream, string_ref const& s)
+   {
+      return stream.write(s.data, s.length);
+   }
+
+   /// Binary protocol
+
+   bool binary::detect(const char* buffer, size_t length)
+   {
+      return length >= header_size && (unsigned char) buffer[0] == magic_0 && (unsigned char) buffer[1] == magic_1;
+   }
+
+   /// Packet view
+
+   packet_view::packet_view()
+      : size_(0)
+   {
+   }
+
+   bool packet_view::parse(const char* buffer, size_t length)
+   {
+      size_ = 0;
+
+      const char* end = buffer + length;
+      const char* line = buffer;
+
+      while (line < end) {
+         const char* eol = line;
+         while (eol < end && *eol != '\r' && *eol != '\n') {
+            eol++;
          }
+
+         string_ref name, value;
+         if (split_line(line, eol - line, name, value)) {
+            this->add(name, value);
+         }
+
+         line = eol + 1;
       }
-      
+
       // Packets must have PV, Op, Time and Thread
 
-      if (!packet.has("PV") || !packet.has("Op") || !packet.has("Time") || !packet.has("Thread")) {
+      if (!this->has("PV") || !this->has("Op") || !this->has("Time") || !this->has("Thread")) {
          return false;
       }
-      
+
       // Check if the check, report and whitelist commands have a correct digest
-      
-      if (packet.get("Op") == "check" || packet.get("Op") == "report" || packet.get("Op") == "whitelist") {
-         if (!packet.has("Op-Digest")) {
+
+      string_ref op = this->get("Op");
+      if (op == "check" || op == "report" || op == "whitelist") {
+         if (!this->has("Op-Digest") || !is_digest(this->get("Op-Digest"))) {
             return false;
-         } else {
-            std::string digest = packet.get("Op-Digest");
-            if (digest.length() != 40) {
-               return false;
-            }
-            for (size_t i = 0; i < digest.length(); i++) {
-               if (isxdigit(digest[i]) == 0) {
+         }
+      }
+
+      // A multi check needs between one and max_digests digests, all of them correct
+
+      if (op == "mcheck") {
+         size_t digests = 0;
+         for (size_t i = 0; i < size_; i++) {
+            if (names_[i] == "Op-Digest") {
+               if (!is_digest(values_[i]) || ++digests > max_digests) {
                   return false;
                }
             }
          }
+         if (digests == 0) {
+            return false;
+         }
       }
 
       return true;
    }
 
+   void packet_view::add(string_ref const& name, string_ref const& value)
+   {
+      // Requests only carry a handful of fields; anything past the limit is ignored
+      if (size_ < max_fields) {
+         names_[size_] = name;
+         values_[size_] = value;
+         size_++;
+      }
+   }
+
+   bool packet_view::has(const char* name) const
+   {
+      for (size_t i = 0; i < size_; i++) {
+         if (names_[i] == name) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   string_ref packet_view::get(const char* name) const
+   {
+      // A repeated field replaces the earlier one, like it does in the map
+      for (size_t i = size_; i > 0; i--) {
+         if (names_[i - 1] == name) {
+            return values_[i - 1];
+         }
+      }
+      return string_ref();
+   }
+
+   size_t packet_view::size() const
+   {
+      return size_;
+   }
+
+   string_ref packet_view::name(size_t i) const
+   {
+      return names_[i];
+   }
+
+   string_ref packet_view::value(size_t i) const
+   {
+      return values_[i];
+   }
+
+   /// Packet
+
+   bool packet::parse(packet& packet, const char* buffer, size_t length)
+   {
+      packet_view view;
+      bool valid = view.parse(buffer, length);
+
+      for (size_t i = 0; i < view.size(); i++) {
+         packet.attributes_[view.name(i).str()] = view.value(i).str();
+      }
+
+      return valid;
+   }
+
    packet::packet()
    {
    }
 
    packet::packet(const char* buffer, size_t length)
    {
-      std::string tmp(buffer, length);            
+      packet_view view;
+      view.parse(buffer, length);
 
-      boost::char_separator<char> separator("\r\n");
-      boost::tokenizer< boost::char_separator<char> > tokenizer(tmp, separator);
-      
-      for (boost::tokenizer< boost::char_separator<char> >::iterator i = tokenizer.begin(); i!=tokenizer.end(); ++i) {
-         boost::regex regex("^(\\w+):\\s+(.*)$", boost::regex::perl);
-         boost::smatch matches;
-         if (boost::regex_match(*i, matches, regex)) {
-            attributes_[matches[1].str()] = matches[2].str();
+      // Responses only use plain word characters in their field names
+
+      for (size_t i = 0; i < view.size(); i++) {
+         if (is_word(view.name(i))) {
+            attributes_[view.name(i).str()] = view.value(i).str();
          }
       }
    }
@@ -2,11 +2,102 @@
 #ifndef PACKET_HPP
 #define PACKET_HPP
 
+#include <iostream>
 #include <map>
 #include <string>
 
 namespace pyzor {
-   
+
+   /// A run of characters inside a buffer that is owned by someone else.
+
+   struct string_ref
+   {
+      public:
+
+         string_ref();
+         string_ref(const char* data, size_t length);
+
+      public:
+
+         bool empty() const;
+         std::string str() const;
+
+         bool operator==(const char* s) const;
+         bool operator!=(const char* s) const;
+         bool operator==(string_ref const& s) const;
+
+      public:
+
+         const char* data;
+         size_t length;
+   };
+
+   std::ostream& operator<<(std::ostream& stream, string_ref const& s);
+
+   /// The binary protocol. Every datagram starts with a fixed header in network byte order:
+   ///
+   ///   magic (2 bytes) | version (1 byte) | op (1 byte) | thread (4 bytes)
+   ///
+   /// A request follows it with the raw 20 byte digests of the op, if any. A reply follows it with
+   /// a 2 byte code, a 2 byte count of digests and a 4 byte Count and WL-Count for each digest.
+   /// The first magic byte is not ASCII, so a text packet never looks like a binary one.
+
+   namespace binary {
+
+      enum {
+         magic_0 = 0xb7,
+         magic_1 = 0x5a,
+         version = 1,
+         header_size = 8,
+         digest_size = 20,
+         reply_header_size = header_size + 4,
+         counts_size = 8
+      };
+
+      bool detect(const char* buffer, size_t length);
+
+   }
+
+   /// A request parsed in place. The fields point into the receive buffer, which must outlive the
+   /// view; parsing is a single pass over the datagram and does not allocate.
+
+   class packet_view
+   {
+      public:
+
+         enum { max_fields = 48, max_digests = 32 };
+
+      public:
+
+         packet_view();
+
+      public:
+
+         /// Split the buffer into fields and check that it is a valid request. Like packet::parse
+         /// the fields are available even when the request turns out to be invalid. Repeated
+         /// fields are all kept; get() returns the last one.
+         bool parse(const char* buffer, size_t length);
+
+      public:
+
+         bool has(const char* name) const;
+         string_ref get(const char* name) const;
+
+         size_t size() const;
+         string_ref name(size_t i) const;
+         string_ref value(size_t i) const;
+
+      private:
+
+         void add(string_ref const& name, string_ref const& value);
+
+      private:
+
+         size_t size_;
+         string_ref names_[max_fields];
+         string_ref values_[max_fields];
+   };
+
    class packet
    {
       public:
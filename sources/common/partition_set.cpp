@@ -0,0 +1,304 @@
+// partition_set.cpp
+
+#include <errno.h>
+
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "partition_set.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      const char partition_prefix[] = "signatures-";
+      const char partition_suffix[] = ".db";
+
+      enum { day_digits = 6 };
+
+   }
+
+   partition_set::partition_set(pyzor::syslog& syslog, DB_ENV* env, boost::filesystem::path const& home, bool writable)
+      : syslog_(syslog), env_(env), home_(home), writable_(writable), skips_(0), false_positives_(0)
+   {
+   }
+
+   partition_set::~partition_set()
+   {
+      for (size_t i = 0; i < partitions_.size(); i++) {
+         this->close(partitions_[i].db);
+      }
+   }
+
+   bool partition_set::exists(boost::filesystem::path const& home)
+   {
+      if (!boost::filesystem::exists(home)) {
+         return false;
+      }
+
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator i(home); i != end; ++i) {
+         std::string name = i->path().string();
+         boost::uint32_t first_day;
+         if (parse(name.substr(name.rfind('/') + 1), first_day)) {
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   bool partition_set::refresh()
+   {
+      std::set<boost::uint32_t> found;
+
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator i(home_); i != end; ++i) {
+         std::string name = i->path().string();
+         boost::uint32_t first_day;
+         if (parse(name.substr(name.rfind('/') + 1), first_day)) {
+            found.insert(first_day);
+         }
+      }
+
+      bool changed = false;
+
+      // Close the partitions that were removed
+
+      for (size_t i = 0; i < partitions_.size(); ) {
+         if (found.erase(partitions_[i].first_day) == 0) {
+            this->close(partitions_[i].db);
+            partitions_.erase(partitions_.begin() + i);
+            changed = true;
+         } else {
+            i++;
+         }
+      }
+
+      // Open the new ones; a replica may see the file before the database is complete, so those
+      // are tried again on the next refresh
+
+      for (std::set<boost::uint32_t>::const_iterator i = found.begin(); i != found.end(); ++i) {
+         DB* db = this->open(*i, false);
+         if (db != NULL) {
+            partition p;
+            p.first_day = *i;
+            p.db = db;
+
+            size_t j = 0;
+            while (j < partitions_.size() && partitions_[j].first_day > *i) {
+               j++;
+            }
+            partitions_.insert(partitions_.begin() + j, p);
+            changed = true;
+         }
+      }
+
+      return changed;
+   }
+
+   int partition_set::get(DB_TXN* txn, hash const& digest, record& r, size_t& index) const
+   {
+      DBT key;
+      memset(&key, 0, sizeof(DBT));
+      key.data = (void*) digest.data_;
+      key.size = sizeof(digest.data_);
+
+      DBT data;
+      memset(&data, 0, sizeof(DBT));
+      data.data = &r;
+      data.ulen = sizeof(record);
+      data.flags = DB_DBT_USERMEM;
+
+      for (size_t i = 0; i < partitions_.size(); i++) {
+         partition const& p = partitions_[i];
+
+         if (p.filter && !p.filter->may_contain(digest)) {
+            __atomic_fetch_add(&skips_, 1, __ATOMIC_RELAXED);
+            continue;
+         }
+
+         int ret = p.db->get(p.db, txn, &key, &data, 0);
+         if (ret == 0) {
+            index = i;
+            return 0;
+         }
+
+         if (ret == DB_NOTFOUND) {
+            if (p.filter) {
+               __atomic_fetch_add(&false_positives_, 1, __ATOMIC_RELAXED);
+            }
+            continue;
+         }
+
+         // The master dropped the partition; it is closed on the next refresh
+
+         if (ret == DB_REP_HANDLE_DEAD) {
+            continue;
+         }
+
+         return ret;
+      }
+
+      return DB_NOTFOUND;
+   }
+
+   size_t partition_set::size() const
+   {
+      return partitions_.size();
+   }
+
+   DB* partition_set::handle(size_t index) const
+   {
+      return partitions_[index].db;
+   }
+
+   boost::uint32_t partition_set::first_day(size_t index) const
+   {
+      return partitions_[index].first_day;
+   }
+
+   void partition_set::create(boost::uint32_t first_day)
+   {
+      size_t j = 0;
+      while (j < partitions_.size() && partitions_[j].first_day > first_day) {
+         j++;
+      }
+
+      if (j < partitions_.size() && partitions_[j].first_day == first_day) {
+         return;
+      }
+
+      partition p;
+      p.first_day = first_day;
+      p.db = this->open(first_day, true);
+      partitions_.insert(partitions_.begin() + j, p);
+
+      syslog_.notice() << "Created the partition " << name(first_day);
+   }
+
+   int partition_set::remove(boost::uint32_t first_day)
+   {
+      for (size_t i = 0; i < partitions_.size(); i++) {
+         if (partitions_[i].first_day == first_day) {
+            this->close(partitions_[i].db);
+            partitions_.erase(partitions_.begin() + i);
+
+            int ret = env_->dbremove(env_, NULL, name(first_day).c_str(), NULL, DB_AUTO_COMMIT);
+            if (ret != 0) {
+               syslog_.error() << "Cannot remove the partition " << name(first_day) << ": " << db_strerror(ret);
+            }
+            return ret;
+         }
+      }
+
+      return ENOENT;
+   }
+
+   bool partition_set::filtered(size_t index) const
+   {
+      return partitions_[index].filter.get() != NULL;
+   }
+
+   void partition_set::set_filter(size_t index, boost::shared_ptr<bloom_filter> filter)
+   {
+      partitions_[index].filter = filter;
+   }
+
+   bool partition_set::filter_statistics(boost::uint64_t& bytes, boost::uint64_t& keys, boost::uint64_t& skips, boost::uint64_t& false_positives) const
+   {
+      bytes = keys = 0;
+      bool filtered = false;
+
+      for (size_t i = 0; i < partitions_.size(); i++) {
+         if (partitions_[i].filter) {
+            bytes += partitions_[i].filter->size_in_bytes();
+            keys += partitions_[i].filter->keys();
+            filtered = true;
+         }
+      }
+
+      skips = __atomic_load_n(&skips_, __ATOMIC_RELAXED);
+      false_positives = __atomic_load_n(&false_positives_, __ATOMIC_RELAXED);
+
+      return filtered;
+   }
+
+   //
+
+   std::string partition_set::name(boost::uint32_t first_day)
+   {
+      char name[64];
+      snprintf(name, sizeof(name), "%s%06u%s", partition_prefix, (unsigned int) first_day, partition_suffix);
+      return name;
+   }
+
+   bool partition_set::parse(std::string const& name, boost::uint32_t& first_day)
+   {
+      size_t prefix = sizeof(partition_prefix) - 1, suffix = sizeof(partition_suffix) - 1;
+
+      if (name.length() != prefix + day_digits + suffix || name.compare(0, prefix, partition_prefix) != 0
+         || name.compare(prefix + day_digits, suffix, partition_suffix) != 0)
+      {
+         return false;
+      }
+
+      first_day = 0;
+      for (size_t i = prefix; i < prefix + day_digits; i++) {
+         if (name[i] < '0' || name[i] > '9') {
+            return false;
+         }
+         first_day = first_day * 10 + (name[i] - '0');
+      }
+
+      return true;
+   }
+
+   DB* partition_set::open(boost::uint32_t first_day, bool create)
+   {
+      DB* db;
+
+      int ret = db_create(&db, env_, 0);
+      if (ret != 0) {
+         syslog_.error() << "Cannot create the partition " << name(first_day) << ": " << db_strerror(ret);
+         throw std::runtime_error("Cannot setup the partitions");
+      }
+
+      u_int32_t flags = DB_THREAD;
+      if (writable_) {
+         flags |= DB_AUTO_COMMIT | (create ? DB_CREATE : 0);
+      } else {
+         flags |= DB_RDONLY;
+      }
+
+      ret = db->open(db, NULL, name(first_day).c_str(), NULL, writable_ ? DB_HASH : DB_UNKNOWN, flags, 0);
+      if (ret != 0) {
+         (void) db->close(db, 0);
+
+         if (writable_) {
+            syslog_.error() << "Cannot open the partition " << name(first_day) << ": " << db_strerror(ret);
+            throw std::runtime_error("Cannot setup the partitions");
+         }
+
+         if (ret != ENOENT && ret != DB_LOCK_DEADLOCK && ret != DB_REP_HANDLE_DEAD) {
+            syslog_.error() << "Cannot open the partition " << name(first_day) << ": " << db_strerror(ret);
+         }
+         return NULL;
+      }
+
+      return db;
+   }
+
+   void partition_set::close(DB* db)
+   {
+      int ret = db->close(db, 0);
+      if (ret != 0) {
+         syslog_.error() << "Failed to close a partition: " << db_strerror(ret);
+      }
+   }
+
+}
@@ -0,0 +1,98 @@
+// partition_set.hpp
+
+#ifndef PYZOR_PARTITION_SET_HPP
+#define PYZOR_PARTITION_SET_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <db.h>
+
+#include "bloom_filter.hpp"
+#include "hash.hpp"
+#include "record.hpp"
+#include "syslog.hpp"
+
+namespace pyzor {
+
+   /// The signature records kept in one hash database per period of time instead of in
+   /// signatures.db. A record lives in the partition of the period in which it was last written:
+   /// the master moves it to the newest partition whenever it changes, so a partition that is older
+   /// than the records are kept only holds records that can go and is dropped as a whole.
+   ///
+   /// A partition is named after the day its period starts, signatures-<day>.db, so readers do not
+   /// need to know the period. Only the newest partition gets new records; the older ones can have
+   /// a filter. The set is not locked; the owner guards it.
+
+   class partition_set : boost::noncopyable
+   {
+      public:
+
+         /// The partitions of the environment that lives in the directory home
+         partition_set(pyzor::syslog& syslog, DB_ENV* env, boost::filesystem::path const& home, bool writable);
+         ~partition_set();
+
+      public:
+
+         /// True if the directory holds partitions
+         static bool exists(boost::filesystem::path const& home);
+
+         /// Open the partitions that appeared in the directory and close the ones that are gone.
+         /// Returns true if anything changed.
+         bool refresh();
+
+         /// Look the digest up from the newest partition to the oldest. Returns zero and the index
+         /// of the partition it was found in, DB_NOTFOUND or the error of the database.
+         int get(DB_TXN* txn, hash const& digest, record& r, size_t& index) const;
+
+         /// Ordered from new to old
+         size_t size() const;
+         DB* handle(size_t index) const;
+         boost::uint32_t first_day(size_t index) const;
+
+         /// Create the partition that starts at first_day, unless it exists
+         void create(boost::uint32_t first_day);
+         /// Close the partition and remove its file
+         int remove(boost::uint32_t first_day);
+
+         bool filtered(size_t index) const;
+         void set_filter(size_t index, boost::shared_ptr<bloom_filter> filter);
+         bool filter_statistics(boost::uint64_t& bytes, boost::uint64_t& keys, boost::uint64_t& skips, boost::uint64_t& false_positives) const;
+
+      private:
+
+         struct partition
+         {
+            public:
+
+               boost::uint32_t first_day;
+               DB* db;
+               boost::shared_ptr<bloom_filter> filter;
+         };
+
+         static std::string name(boost::uint32_t first_day);
+         static bool parse(std::string const& name, boost::uint32_t& first_day);
+
+         DB* open(boost::uint32_t first_day, bool create);
+         void close(DB* db);
+
+      private:
+
+         pyzor::syslog& syslog_;
+         DB_ENV* env_;
+         boost::filesystem::path home_;
+         bool writable_;
+         std::vector<partition> partitions_;
+
+         mutable boost::uint64_t skips_;
+         mutable boost::uint64_t false_positives_;
+   };
+
+}
+
+#endif // PYZOR_PARTITION_SET_HPP
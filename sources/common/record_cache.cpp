@@ -0,0 +1,172 @@
+// record_cache.cpp
+
+#include <cstring>
+
+#include "record_cache.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      class scoped_mutex : boost::noncopyable
+      {
+         public:
+
+            scoped_mutex(pthread_mutex_t& mutex)
+               : mutex_(mutex)
+            {
+               pthread_mutex_lock(&mutex_);
+            }
+
+            ~scoped_mutex()
+            {
+               pthread_mutex_unlock(&mutex_);
+            }
+
+         private:
+
+            pthread_mutex_t& mutex_;
+      };
+
+   }
+
+   record_cache::record_cache(size_t memory_budget, unsigned int ttl)
+      : ttl_(ttl)
+   {
+      sets_ = memory_budget / (sizeof(entry) * ways * shard_count);
+      if (sets_ == 0) {
+         sets_ = 1;
+      }
+
+      for (size_t i = 0; i < shard_count; i++) {
+         pthread_mutex_init(&shards_[i].lock, NULL);
+         shards_[i].entries.resize(sets_ * ways);
+         shards_[i].hands.resize(sets_);
+         shards_[i].hits = 0;
+         shards_[i].misses = 0;
+      }
+
+      this->clear();
+   }
+
+   record_cache::~record_cache()
+   {
+      for (size_t i = 0; i < shard_count; i++) {
+         pthread_mutex_destroy(&shards_[i].lock);
+      }
+   }
+
+   bool record_cache::get(hash const& key, record& value, bool& found)
+   {
+      shard& s = shard_for(key);
+      scoped_mutex lock(s.lock);
+
+      entry* set = &s.entries[set_for(key) * ways];
+      boost::uint32_t now = time(NULL);
+
+      for (size_t i = 0; i < ways; i++) {
+         if (set[i].used && memcmp(set[i].key.data_, key.data_, sizeof(key.data_)) == 0) {
+            if (set[i].expires <= now) {
+               set[i].used = false;
+               break;
+            }
+            set[i].referenced = true;
+            value = set[i].value;
+            found = set[i].found;
+            __atomic_fetch_add(&s.hits, 1, __ATOMIC_RELAXED);
+            return true;
+         }
+      }
+
+      __atomic_fetch_add(&s.misses, 1, __ATOMIC_RELAXED);
+      return false;
+   }
+
+   void record_cache::put(hash const& key, record const& value, bool found)
+   {
+      shard& s = shard_for(key);
+      scoped_mutex lock(s.lock);
+
+      size_t set_index = set_for(key);
+      entry* set = &s.entries[set_index * ways];
+
+      // Reuse the slot of the same digest or a free one before evicting anything
+
+      entry* slot = NULL;
+      for (size_t i = 0; i < ways && slot == NULL; i++) {
+         if (set[i].used && memcmp(set[i].key.data_, key.data_, sizeof(key.data_)) == 0) {
+            slot = &set[i];
+         }
+      }
+
+      for (size_t i = 0; i < ways && slot == NULL; i++) {
+         if (!set[i].used) {
+            slot = &set[i];
+         }
+      }
+
+      if (slot == NULL) {
+         unsigned char& hand = s.hands[set_index];
+         while (set[hand].referenced) {
+            set[hand].referenced = false;
+            hand = (hand + 1) % ways;
+         }
+         slot = &set[hand];
+         hand = (hand + 1) % ways;
+      }
+
+      slot->key = key;
+      slot->value = value;
+      slot->expires = time(NULL) + ttl_;
+      slot->used = true;
+      slot->referenced = false;
+      slot->found = found;
+   }
+
+   void record_cache::clear()
+   {
+      for (size_t i = 0; i < shard_count; i++) {
+         scoped_mutex lock(shards_[i].lock);
+         for (size_t j = 0; j < shards_[i].entries.size(); j++) {
+            shards_[i].entries[j].used = false;
+            shards_[i].entries[j].referenced = false;
+         }
+      }
+   }
+
+   size_t record_cache::capacity() const
+   {
+      return sets_ * ways * shard_count;
+   }
+
+   boost::uint64_t record_cache::hits() const
+   {
+      boost::uint64_t hits = 0;
+      for (size_t i = 0; i < shard_count; i++) {
+         hits += __atomic_load_n(&shards_[i].hits, __ATOMIC_RELAXED);
+      }
+      return hits;
+   }
+
+   boost::uint64_t record_cache::misses() const
+   {
+      boost::uint64_t misses = 0;
+      for (size_t i = 0; i < shard_count; i++) {
+         misses += __atomic_load_n(&shards_[i].misses, __ATOMIC_RELAXED);
+      }
+      return misses;
+   }
+
+   record_cache::shard& record_cache::shard_for(hash const& key)
+   {
+      return shards_[key.data_[0] % shard_count];
+   }
+
+   size_t record_cache::set_for(hash const& key) const
+   {
+      boost::uint32_t h;
+      memcpy(&h, key.data_ + 1, sizeof(h));
+      return h % sets_;
+   }
+
+}
@@ -0,0 +1,88 @@
+// record_cache.hpp
+
+#ifndef PYZOR_RECORD_CACHE_HPP
+#define PYZOR_RECORD_CACHE_HPP
+
+#include <pthread.h>
+#include <time.h>
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "hash.hpp"
+#include "record.hpp"
+
+namespace pyzor {
+
+   /// A bounded cache of database lookups, including the ones that found nothing. The entries are
+   /// spread over shards that each have their own lock. Within a shard a digest maps to a small set
+   /// of slots that is evicted in CLOCK order, so popular digests stay while one-off lookups cycle
+   /// through. Entries expire after ttl seconds, which bounds how long an update made by another
+   /// process stays invisible.
+
+   class record_cache : boost::noncopyable
+   {
+      public:
+
+         enum { ways = 8, shard_count = 64 };
+
+      public:
+
+         record_cache(size_t memory_budget, unsigned int ttl);
+         ~record_cache();
+
+      public:
+
+         /// Returns true when the digest was cached; found then says whether the database had it.
+         bool get(hash const& key, record& value, bool& found);
+         void put(hash const& key, record const& value, bool found);
+         void clear();
+
+      public:
+
+         size_t capacity() const;
+         boost::uint64_t hits() const;
+         boost::uint64_t misses() const;
+
+      private:
+
+         struct entry
+         {
+            public:
+
+               hash key;
+               record value;
+               boost::uint32_t expires;
+               bool used;
+               bool referenced;
+               bool found;
+         };
+
+         struct shard
+         {
+            public:
+
+               pthread_mutex_t lock;
+               std::vector<entry> entries;
+               std::vector<unsigned char> hands;
+               boost::uint64_t hits;
+               boost::uint64_t misses;
+         };
+
+      private:
+
+         shard& shard_for(hash const& key);
+         size_t set_for(hash const& key) const;
+
+      private:
+
+         unsigned int ttl_;
+         size_t sets_;
+         shard shards_[shard_count];
+   };
+
+}
+
+#endif // PYZOR_RECORD_CACHE_HPP
@@ -1,7 +1,9 @@
 // server.cpp
 
+#include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
@@ -9,6 +11,7 @@
 #include <string>
 
 #include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
@@ -18,24 +21,378 @@
 #include <asio.hpp>
 
 #include "database.hpp"
-#include "packet.hpp"
+#include "message.hpp"
 #include "syslog.hpp"
 #include "server.hpp"
 
 namespace pyzor {
 
-   server::server(syslog& syslog, asio::io_service& io_service, std::string const& address, std::string const& port, pyzor::database& db, bool verbose)
-      : syslog_(syslog), io_service_(io_service), address_(address), port_(port), db_(db), verbose_(verbose), socket_(io_service), shutdown_(false)
+   namespace {
+
+      class scoped_mutex : boost::noncopyable
+      {
+         public:
+
+            scoped_mutex(pthread_mutex_t& mutex)
+               : mutex_(mutex)
+            {
+               pthread_mutex_lock(&mutex_);
+            }
+
+            ~scoped_mutex()
+            {
+               pthread_mutex_unlock(&mutex_);
+            }
+
+         private:
+
+            pthread_mutex_t& mutex_;
+      };
+
+   }
+
+#if defined(SO_REUSEPORT)
+   typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+   /// Worker
+
+   server::worker::worker(server& server, size_t batch_size, bool io_uring)
+      : server_(server), batch_(batch_size), responses_(batch_.datagram_size()), work_(io_service_), socket_(io_service_),
+        unix_socket_(io_service_), backlogged_since_(0), stopped_(false)
+   {
+      if (io_uring) {
+         try {
+            uring_.reset(new uring_listener(boost::bind(&server::handle_request, &server_, _1, _2, _3, _4, _5, boost::ref(statistics_), (worker*) NULL, false)));
+         } catch (std::exception const& e) {
+            server_.syslog_.warning() << "Cannot use io_uring, falling back to asio: " << e.what();
+         }
+      }
+   }
+
+   void server::worker::run()
+   {
+      // With io_uring the ring is waited on with a short timeout so that the listener start and stop
+      // handlers posted to the io_service still get to run
+
+      while (uring_ && !stopped_) {
+         uring_->run_once(100);
+
+         if (uring_->failed()) {
+            server_.syslog_.warning() << "The kernel does not support multishot recvmsg; falling back to asio";
+            uring_.reset();
+            if (socket_.is_open()) {
+               this->start_receive();
+            }
+            break;
+         }
+
+         if (__atomic_load_n(&server_.shutdown_, __ATOMIC_RELAXED)) {
+            uring_->stop();
+         }
+
+         io_service_.poll();
+      }
+
+      if (!stopped_) {
+         io_service_.run();
+      }
+   }
+
+   void server::worker::stop()
+   {
+      stopped_ = true;
+      io_service_.stop();
+   }
+
+   void server::worker::start_listening(asio::ip::udp::endpoint const& endpoint, bool reuse_port, int adopted)
+   {
+      io_service_.post(boost::bind(&server::worker::handle_start_listening, this, endpoint, reuse_port, adopted));
+   }
+
+   void server::worker::stop_listening()
+   {
+      io_service_.post(boost::bind(&server::worker::handle_stop_listening, this));
+   }
+
+   void server::worker::stop_receiving()
+   {
+      io_service_.post(boost::bind(&server::worker::handle_stop_receiving, this));
+   }
+
+   void server::worker::start_unix_listening(std::string const& path)
+   {
+      io_service_.post(boost::bind(&server::worker::handle_start_unix_listening, this, path));
+   }
+
+   void server::worker::serve_stream(stream_listener& listener)
+   {
+      listener.add_target(io_service_, boost::bind(&server::handle_request, &server_, _1, _2, _3, _4, _5,
+         boost::ref(statistics_), (worker*) NULL, false));
+   }
+
+   server::statistics const& server::worker::counters() const
+   {
+      return statistics_;
+   }
+
+   int server::worker::native_socket()
+   {
+      return socket_.is_open() ? socket_.native() : -1;
+   }
+
+   boost::uint32_t server::worker::backlog() const
+   {
+      boost::uint32_t since = backlogged_since_;
+      return (since == 0) ? 0 : (admission_control::now() - since);
+   }
+
+   void server::worker::handle_start_listening(asio::ip::udp::endpoint endpoint, bool reuse, int adopted)
    {
+      scoped_mutex lock(server_.sockets_lock_);
+
+      try {
+         if (adopted >= 0) {
+            socket_.assign(endpoint.protocol(), adopted);
+         } else {
+            socket_.open(endpoint.protocol());
+#if defined(SO_REUSEPORT)
+            if (reuse) {
+               socket_.set_option(reuse_port(true));
+            }
+#endif
+            socket_.bind(endpoint);
+         }
+      } catch (std::exception const& e) {
+         server_.syslog_.error() << "Cannot bind Pyzor listener: " << e.what();
+         socket_.close();
+         return;
+      }
+
+      if (uring_) {
+         uring_->start(socket_.native());
+      } else {
+         this->start_receive();
+      }
+   }
+
+   void server::worker::handle_stop_listening()
+   {
+      if (uring_) {
+         uring_->stop();
+      }
+
+      {
+         scoped_mutex lock(server_.sockets_lock_);
+         socket_.close();
+      }
+
+      if (unix_socket_.is_open()) {
+         unix_socket_.close();
+         // After a handoff the file belongs to the new process
+         if (!server_.handed_off_) {
+            ::unlink(unix_path_.c_str());
+         }
+      }
+   }
+
+   void server::worker::handle_stop_receiving()
+   {
+      // The socket stays open for the replies that are still to be sent
+
+      if (uring_) {
+         uring_->stop();
+      }
+
+      asio::error_code error;
+      socket_.cancel(error);
+      unix_socket_.cancel(error);
+   }
+
+   void server::worker::handle_start_unix_listening(std::string path)
+   {
+      try {
+         bind_unix_socket(unix_socket_, path, 0660);
+      } catch (std::exception const& e) {
+         server_.syslog_.error() << "Cannot bind Unix socket listener: " << e.what();
+         unix_socket_.close();
+         return;
+      }
+
+      unix_path_ = path;
+      unix_request_.resize(batch_.datagram_size());
+      this->start_unix_receive();
+   }
+
+   void server::worker::handle_unix_receive_from(const asio::error_code& error, size_t bytes_recvd)
+   {
+      if (error == asio::error::operation_aborted || error == asio::error::bad_descriptor) {
+         return;
+      }
+
+      // Clients that did not bind their socket cannot get a reply
+
+      if (!error && bytes_recvd > 0 && !unix_sender_.unnamed()) {
+         char* response = responses_.acquire();
+         size_t length = server_.handle_request(&unix_request_[0], bytes_recvd, response, responses_.buffer_size(),
+            asio::ip::udp::endpoint(), statistics_, NULL, true);
+         unix_socket_.async_send_to(
+            asio::buffer(response, length),
+            unix_sender_,
+            make_arena_handler(handlers_, boost::bind(&server::worker::handle_send_to, this, response,
+               asio::placeholders::error, asio::placeholders::bytes_transferred))
+         );
+      }
+
+      if (!__atomic_load_n(&server_.shutdown_, __ATOMIC_RELAXED)) {
+         this->start_unix_receive();
+      }
+   }
+
+   void server::worker::start_unix_receive()
+   {
+      unix_socket_.async_receive_from(
+         asio::buffer(unix_request_),
+         unix_sender_,
+         make_arena_handler(handlers_, boost::bind(&server::worker::handle_unix_receive_from, this,
+            asio::placeholders::error, asio::placeholders::bytes_transferred))
+      );
+   }
+
+   void server::worker::handle_receive_from(const asio::error_code& error, size_t bytes_recvd)
+   {
+      if (error == asio::error::operation_aborted || error == asio::error::bad_descriptor) {
+         return;
+      }
+
+      if (!error && bytes_recvd > 0)
+      {
+         // Pick up whatever else is already waiting on the socket
+
+         batch_.set_request(0, bytes_recvd, sender_endpoint_);
+         size_t n = batch_.receive(socket_.native(), 1);
+
+         // Requests that are still waiting after the batch mean the listener is falling behind
+
+         if (server_.admission_) {
+            asio::error_code ec;
+            if (socket_.available(ec) == 0) {
+               backlogged_since_ = 0;
+            } else if (backlogged_since_ == 0) {
+               backlogged_since_ = admission_control::now();
+            }
+         }
+
+         // Send back the replies. A single reply is sent asynchronously from a pooled buffer that
+         // stays reserved until the send has completed. Checks handed to the lookup pool have no
+         // reply yet; the pool completes them later.
+
+         if (batch_.enabled()) {
+            for (size_t i = 0; i < n; i++) {
+               batch_.set_response(i, server_.handle_request(batch_.request(i), batch_.request_length(i),
+                  batch_.response(i), batch_.datagram_size(), batch_.endpoint(i), statistics_, this, false));
+            }
+            batch_.send(socket_.native(), n);
+         } else {
+            char* response = responses_.acquire();
+            size_t length = server_.handle_request(batch_.request(0), batch_.request_length(0),
+               response, responses_.buffer_size(), sender_endpoint_, statistics_, this, false);
+            if (length == 0) {
+               responses_.release(response);
+            } else {
+               socket_.async_send_to(
+                  asio::buffer(response, length),
+                  sender_endpoint_,
+                  make_arena_handler(handlers_, boost::bind(&server::worker::handle_send_to, this, response,
+                     asio::placeholders::error, asio::placeholders::bytes_transferred))
+               );
+            }
+         }
+      }
+
+      // Receive the next incoming packet
+
+      if (!__atomic_load_n(&server_.shutdown_, __ATOMIC_RELAXED)) {
+         this->start_receive();
+      }
+   }
+
+   void server::worker::handle_send_to(char* response, const asio::error_code& error, size_t bytes_sent)
+   {
+      responses_.release(response);
+   }
+
+   void server::worker::lookup_completed(std::string thread, bool binary, asio::ip::udp::endpoint sender_endpoint, bool found, record r)
+   {
+      io_service_.post(boost::bind(&server::worker::handle_lookup_completed, this, thread, binary, sender_endpoint, found, r));
+   }
+
+   void server::worker::handle_lookup_completed(std::string thread, bool binary, asio::ip::udp::endpoint sender_endpoint, bool found, record r)
+   {
+      reply res;
+      res.binary = binary;
+      res.op_ = request::op_check;
+      res.thread = string_ref(thread.data(), thread.length());
+      server_.answer_check(res, found, r, statistics_);
+
+      char* response = responses_.acquire();
+      size_t length = res.archive(response, responses_.buffer_size());
+      socket_.async_send_to(
+         asio::buffer(response, length),
+         sender_endpoint,
+         make_arena_handler(handlers_, boost::bind(&server::worker::handle_send_to, this, response,
+            asio::placeholders::error, asio::placeholders::bytes_transferred))
+      );
+   }
+
+   void server::worker::start_receive()
+   {
+      socket_.async_receive_from(
+         asio::buffer(batch_.request(0), batch_.datagram_size()),
+         sender_endpoint_,
+         make_arena_handler(handlers_, boost::bind(&server::worker::handle_receive_from, this,
+            asio::placeholders::error, asio::placeholders::bytes_transferred))
+      );
+   }
+
+   /// Server
+
+   server::server(syslog& syslog, asio::io_service& io_service, std::string const& address, std::string const& port, pyzor::database& db, size_t threads, size_t batch_size, bool io_uring, bool verbose)
+      : syslog_(syslog), io_service_(io_service), address_(address), port_(port), db_(db), verbose_(verbose), shutdown_(false), stream_enabled_(false), shm_stopped_(false),
+        handed_off_(false), drain_timer_(io_service)
+   {
+      pthread_mutex_init(&sockets_lock_, NULL);
+
+#if !defined(SO_REUSEPORT)
+      if (threads > 1) {
+         syslog_.warning() << "SO_REUSEPORT is not supported on this platform; running a single listener thread";
+         threads = 1;
+      }
+#endif
+
+      if (threads == 0) {
+         threads = 1;
+      }
+
+      for (size_t i = 0; i < threads; i++) {
+         workers_.push_back(worker_ptr(new worker(*this, batch_size, io_uring)));
+      }
+
       db_.start_signal_.connect(boost::bind(&server::start_listening, this));
       db_.stop_signal_.connect(boost::bind(&server::stop_listening, this));
    }
 
+   server::~server()
+   {
+      pthread_mutex_destroy(&sockets_lock_);
+   }
+
    //
 
    void server::start_listening()
    {
-      syslog_.notice() << "Local database has gone online; starting Pyzor listener on " << address_ << ":" << port_;
+      syslog_.notice() << "Local database has gone online; starting Pyzor listener on " << address_ << ":" << port_
+                       << " with " << (unsigned int) workers_.size() << " threads";
 
       asio::ip::udp::resolver resolver(io_service_);
       asio::ip::udp::resolver::query query(address_, port_);
@@ -46,29 +403,208 @@ namespace pyzor {
          throw std::runtime_error(std::string("Cannot resolve hostname for ") + address_);
       }
       
-      // Start receiving requests
+      // Start receiving requests on all workers
 
       asio::ip::udp::endpoint endpoint = *endpoint_iterator;
-      
-      socket_.open(endpoint.protocol());
-      socket_.bind(endpoint);
 
-      socket_.async_receive_from(
-         asio::buffer(data_, max_length),
-         sender_endpoint_,
-         boost::bind(&server::handle_receive_from, this, asio::placeholders::error,  asio::placeholders::bytes_transferred)
-      );
+      for (size_t i = 0; i < workers_.size(); i++) {
+         workers_[i]->start_listening(endpoint, workers_.size() > 1, handoff_client_.adopt(handoff_socket::udp));
+      }
+
+      // Stream connections go through the same handler as datagrams
+
+      if (stream_enabled_) {
+         asio::ip::tcp::endpoint stream_endpoint(endpoint.address(), endpoint.port());
+         int acceptor = handoff_client_.adopt(handoff_socket::tcp);
+         scoped_mutex lock(sockets_lock_);
+         if (acceptor >= 0) {
+            stream_.reset(new stream_listener(syslog_, io_service_, stream_endpoint, acceptor));
+         } else {
+            stream_.reset(new stream_listener(syslog_, io_service_, stream_endpoint));
+         }
+         for (size_t i = 0; i < workers_.size(); i++) {
+            workers_[i]->serve_stream(*stream_);
+         }
+         stream_->start();
+      }
+
+      // There is only one socket file, so the first worker serves it
+
+      if (!unix_path_.empty()) {
+         workers_[0]->start_unix_listening(unix_path_);
+      }
+
+      // Now that this process answers requests the previous one can go, and the next one can take over
+
+      if (handoff_client_.connected()) {
+         handoff_client_.ready();
+         syslog_.notice() << "Took over the listening sockets; the previous server is draining";
+      }
+
+      if (!handoff_path_.empty() && !handoff_) {
+         handoff_.reset(new handoff_server(handoff_path_, boost::bind(&server::handoff_sockets, this),
+            boost::bind(&server::handed_off, this)));
+      }
    }
 
    void server::stop_listening()
    {
       syslog_.notice() << "Local database has gone offline; stopping Pyzor listener";
-      socket_.close();
+
+      // The listener is kept until the next start so that its aborted accept can still complete
+      if (stream_) {
+         scoped_mutex lock(sockets_lock_);
+         stream_->stop();
+      }
+
+      for (size_t i = 0; i < workers_.size(); i++) {
+         workers_[i]->stop_listening();
+      }
+   }
+
+   void server::enable_lookup_pool(size_t threads, size_t queue_limit)
+   {
+      bool (database::*get)(hash const&, record&) = &database::get;
+      lookups_.reset(new lookup_pool(boost::bind(get, &db_, _1, _2), threads, queue_limit));
+      syslog_.notice() << "Looking up checks on " << (unsigned int) threads << " threads with up to "
+                       << (unsigned int) queue_limit << " queued lookups";
+   }
+
+   void server::enable_stream()
+   {
+      stream_enabled_ = true;
+   }
+
+   void server::enable_unix_socket(std::string const& path)
+   {
+      unix_path_ = path;
+   }
+
+   void server::enable_shm(std::string const& name)
+   {
+      shm_.reset(new shm_server(name, boost::bind(&server::answer_shm_check, this, _1, _2, _3)));
+      syslog_.notice() << "Answering checks through shared memory segment " << name;
+   }
+
+   void server::enable_admission_control(unsigned int max_queue_age, unsigned int source_rate)
+   {
+      admission_.reset(new admission_control(max_queue_age, source_rate));
+      if (max_queue_age != 0) {
+         syslog_.notice() << "Shedding reports after " << max_queue_age << "ms and checks after "
+                          << (2 * max_queue_age) << "ms of queueing";
+      }
+      if (source_rate != 0) {
+         syslog_.notice() << "Shedding requests above " << source_rate << " per second from a single source";
+      }
+   }
+
+   void server::enable_handoff(std::string const& path)
+   {
+      handoff_path_ = path;
+      if (handoff_client_.take_over(path)) {
+         syslog_.notice() << "Taking over from the server running on " << path;
+      }
+   }
+
+   std::vector<handoff_socket> server::handoff_sockets()
+   {
+      // Runs on the handoff thread; the duplicates stay valid when the listeners close meanwhile
+
+      scoped_mutex lock(sockets_lock_);
+
+      std::vector<handoff_socket> sockets;
+      for (size_t i = 0; i < workers_.size(); i++) {
+         int native = workers_[i]->native_socket();
+         if (native >= 0 && (native = ::dup(native)) >= 0) {
+            sockets.push_back(handoff_socket(handoff_socket::udp, native));
+         }
+      }
+      int native = stream_ ? stream_->native() : -1;
+      if (native >= 0 && (native = ::dup(native)) >= 0) {
+         sockets.push_back(handoff_socket(handoff_socket::tcp, native));
+      }
+      return sockets;
+   }
+
+   void server::handed_off()
+   {
+      io_service_.post(boost::bind(&server::handle_handed_off, this));
+   }
+
+   void server::handle_handed_off()
+   {
+      syslog_.notice() << "Handed the listening sockets to a new server; draining for " << (int) drain_interval << " seconds";
+
+      handed_off_ = true;
+
+      // Open stream connections may still have requests in flight, so only new ones are refused
+
+      if (stream_) {
+         scoped_mutex lock(sockets_lock_);
+         stream_->stop_accepting();
+      }
+
+      for (size_t i = 0; i < workers_.size(); i++) {
+         workers_[i]->stop_receiving();
+      }
+
+      drain_timer_.expires_from_now(boost::posix_time::seconds((long) drain_interval));
+      drain_timer_.async_wait(boost::bind(&server::handle_drained, this, asio::placeholders::error));
+   }
+
+   void server::handle_drained(const asio::error_code& error)
+   {
+      // The main thread waits for a signal to shut down
+      if (!error) {
+         if (stream_) {
+            stream_->stop();
+         }
+         ::kill(::getpid(), SIGTERM);
+      }
+   }
+
+   void server::serve_shm()
+   {
+      while (!__atomic_load_n(&shm_stopped_, __ATOMIC_RELAXED)) {
+         shm_->serve(100);
+      }
    }
 
    void server::run()
    {
+      // Every worker gets its own thread; the database connection keeps running on this one
+
+      std::vector< boost::shared_ptr<asio::thread> > threads;
+      for (size_t i = 0; i < workers_.size(); i++) {
+         threads.push_back(boost::shared_ptr<asio::thread>(new asio::thread(boost::bind(&server::worker::run, workers_[i]))));
+      }
+
+      boost::shared_ptr<asio::thread> shm_thread;
+      if (shm_) {
+         shm_thread.reset(new asio::thread(boost::bind(&server::serve_shm, this)));
+      }
+
       io_service_.run();
+
+      if (handoff_) {
+         handoff_->stop();
+      }
+
+      if (shm_thread) {
+         __atomic_store_n(&shm_stopped_, true, __ATOMIC_RELAXED);
+         shm_thread->join();
+      }
+
+      // Outstanding lookups post their replies to the workers, so stop the pool first
+
+      if (lookups_) {
+         lookups_->stop();
+      }
+
+      for (size_t i = 0; i < workers_.size(); i++) {
+         workers_[i]->stop();
+         threads[i]->join();
+      }
    }
 
    void server::stop()
@@ -83,129 +619,217 @@ namespace pyzor {
       admin_addresses_.insert(address.c_str());
    }
 
-   bool server::authorize_admin_request(packet const& request, asio::ip::udp::endpoint const& sender_endpoint_)
+   bool server::authorize_admin_request(request const& req, asio::ip::udp::endpoint const& sender_endpoint_)
    {
       return admin_addresses_.find(sender_endpoint_.address().to_string()) != admin_addresses_.end();
    }
 
-   void server::handle_receive_from(const asio::error_code& error, size_t bytes_recvd)
+   boost::uint64_t server::average(statistics_ring statistics::* ring) const
    {
-      if (!error && bytes_recvd > 0)
+      boost::uint64_t average = 0;
+      for (size_t i = 0; i < workers_.size(); i++) {
+         average += (workers_[i]->counters().*ring).average();
+      }
+      average += (shm_statistics_.*ring).average();
+      return average;
+   }
+
+   boost::uint64_t server::total(statistics_ring statistics::* ring) const
+   {
+      boost::uint64_t total = 0;
+      for (size_t i = 0; i < workers_.size(); i++) {
+         total += (workers_[i]->counters().*ring).total();
+      }
+      total += (shm_statistics_.*ring).total();
+      return total;
+   }
+
+   boost::uint32_t server::backlog() const
+   {
+      boost::uint32_t backlog = 0;
+      for (size_t i = 0; i < workers_.size(); i++) {
+         backlog = std::max(backlog, workers_[i]->backlog());
+      }
+      return backlog;
+   }
+
+   size_t server::handle_request(const char* data, size_t length, char* response, size_t response_size,
+      asio::ip::udp::endpoint const& sender_endpoint, statistics& statistics, worker* deferred, bool trusted)
+   {
+      // Parse the request
+
+      request req;
+      reply res;
+
+      bool valid = req.parse(data, length);
+      res.respond_to(req);
+
+      if (!valid) {
+         res.status(400, "Bad Request");
+      } else if (req.pv != "2.0") {
+         res.status(505, "Version Not Supported");
+      } else if (admission_ && admission_->check(req.op_, sender_endpoint, trusted, db_.pending_updates(), this->backlog())
+                 != admission_control::admit)
       {
-         // Parse the request
-         
-         packet res, req;
-         
-         if (!packet::parse(req, data_, bytes_recvd)) {
-            res.set("Thread", req.get("Thread"));
-            res.set("PV", "2.0");
-            res.set("Code", "400");
-            res.set("Diag", "Bad Request");
-         } else {
-            res.set("Thread", req.get("Thread"));
-            res.set("PV", "2.0");
-            res.set("Diag", "OK");
-            res.set("Code", "200");
-            if (req.get("PV") != "2.0") {
-               res.set("Code", "505");
-               res.set("Diag", "Version Not Supported");                  
-            } else {
-               request_statistics_.report();
-               
-               if (req.get("Op") == "shutdown" || req.get("Op") == "statistics") {
-                  if (!authorize_admin_request(req, sender_endpoint_)) {
-                     res.set("Code", "401");
-                     res.set("Diag", "Unauthorized");
-                  } else {
-                     if (req.get("Op") == "shutdown") {
-                        shutdown_ = true;
-                     } else if (req.get("Op") == "statistics") {
-                        res.set("Stats-Average-Requests", boost::lexical_cast<std::string>(request_statistics_.average()));
-                        res.set("Stats-Average-Checks", boost::lexical_cast<std::string>(check_statistics_.average()));
-                        res.set("Stats-Average-Hits", boost::lexical_cast<std::string>(hit_statistics_.average()));
-                        res.set("Stats-Average-Reports", boost::lexical_cast<std::string>(report_statistics_.average()));
-                        res.set("Stats-Average-Whitelists", boost::lexical_cast<std::string>(whitelist_statistics_.average()));
-                        res.set("Stats-Total-Requests", boost::lexical_cast<std::string>(request_statistics_.total()));
-                        res.set("Stats-Total-Checks", boost::lexical_cast<std::string>(check_statistics_.total()));
-                        res.set("Stats-Total-Hits", boost::lexical_cast<std::string>(hit_statistics_.total()));
-                        res.set("Stats-Total-Reports", boost::lexical_cast<std::string>(report_statistics_.total()));
-                        res.set("Stats-Total-Whitelists", boost::lexical_cast<std::string>(whitelist_statistics_.total()));
-                     }
-                  }
+         res.status(503, "Service Busy");
+      } else {
+         statistics.requests.report();
+
+         switch (req.op_) {
+            case request::op_shutdown:
+            case request::op_statistics:
+               if (!trusted && !authorize_admin_request(req, sender_endpoint)) {
+                  res.status(401, "Unauthorized");
+               } else if (req.op_ == request::op_shutdown) {
+                  __atomic_store_n(&shutdown_, true, __ATOMIC_RELAXED);
                } else {
-                  if (req.get("Op") == "check") {
-                     check_statistics_.report();
-                     if (verbose_) {
-                        syslog_.debug() << "Request to check digest " << req.get("Op-Digest");
-                     }
-                     
-                     pyzor::record r;
-
-                     res.set("Count", boost::lexical_cast<std::string>(0));
-                     res.set("WL-Count", boost::lexical_cast<std::string>(0));
-
-                     if (db_.get(req.get("Op-Digest"), r) == true) {
-                        if (r.report_count() == 1 && (time(NULL) - r.entered()) > (3 * 28 * 86400)) {
-                           // Ignore records with 1 report that are older than 3 months
-                        } else {
-                           hit_statistics_.report();
-                           res.set("Count", boost::lexical_cast<std::string>(r.report_count()));
-                           res.set("WL-Count", boost::lexical_cast<std::string>(r.whitelist_count()));
-                        }
-                     }
-                  } else if (req.get("Op") == "report") {
-                     report_statistics_.report();                  
-                     if (verbose_) {
-                        syslog_.debug() << "Request to report digest " << req.get("Op-Digest");
-                     }
-                     db_.report(req.get("Op-Digest"));
+                  res.statistic("Stats-Average-Checks", average(&statistics::checks));
+                  res.statistic("Stats-Average-Hits", average(&statistics::hits));
+                  res.statistic("Stats-Average-Reports", average(&statistics::reports));
+                  res.statistic("Stats-Average-Requests", average(&statistics::requests));
+                  res.statistic("Stats-Average-Whitelists", average(&statistics::whitelists));
+                  if (db_.cache() != NULL) {
+                     res.statistic("Stats-Cache-Hits", db_.cache()->hits());
+                     res.statistic("Stats-Cache-Misses", db_.cache()->misses());
                   }
-
-                  else if (req.get("Op") == "whitelist") {
-                     whitelist_statistics_.report();                     
-                     if (verbose_) {
-                        syslog_.debug() << "Request to whitelist digest " << req.get("Op-Digest");
-                     }                     
-#if PYZOR_WHITELIST_ENABLED
-                     db_.whitelist(req.get("Op-Digest"));
-#endif
+                  boost::uint64_t bytes, keys, skips, false_positives;
+                  if (db_.filter_statistics(bytes, keys, skips, false_positives)) {
+                     res.statistic("Stats-Filter-Bytes", bytes);
+                     res.statistic("Stats-Filter-False-Positives", false_positives);
+                     res.statistic("Stats-Filter-Keys", keys);
+                     res.statistic("Stats-Filter-Skipped", skips);
                   }
-
-                  else if (req.get("Op") == "ping") {
-                     // Nothing to do for ping, just send back a plain response
-                  } else {
-                     res.set("Code", "501");
-                     res.set("Diag", "Not supported operation");
+                  if (lookups_) {
+                     res.statistic("Stats-Lookup-Coalesced", lookups_->coalesced());
+                     res.statistic("Stats-Lookup-Overflows", lookups_->overflows());
+                     res.statistic("Stats-Lookup-Queue-Depth", lookups_->depth());
+                     res.statistic("Stats-Lookup-Queue-P99-Usec", lookups_->queue_latency().percentile(99));
+                     res.statistic("Stats-Lookup-Queue-Usec", lookups_->queue_latency().average());
+                     res.statistic("Stats-Lookup-Service-P99-Usec", lookups_->service_latency().percentile(99));
+                     res.statistic("Stats-Lookup-Service-Usec", lookups_->service_latency().average());
+                  }
+                  if (admission_) {
+                     res.statistic("Stats-Shed-Checks", admission_->shed_checks());
+                     res.statistic("Stats-Shed-Sources", admission_->shed_sources());
+                     res.statistic("Stats-Shed-Updates", admission_->shed_updates());
+                  }
+                  if (shm_) {
+                     res.statistic("Stats-Shm-Checks", shm_->served());
+                  }
+                  if (db_.table_size() != 0) {
+                     res.statistic("Stats-Table-Signatures", db_.table_size());
+                  }
+                  res.statistic("Stats-Threads", workers_.size());
+                  res.statistic("Stats-Total-Checks", total(&statistics::checks));
+                  res.statistic("Stats-Total-Hits", total(&statistics::hits));
+                  res.statistic("Stats-Total-Reports", total(&statistics::reports));
+                  res.statistic("Stats-Total-Requests", total(&statistics::requests));
+                  res.statistic("Stats-Total-Whitelists", total(&statistics::whitelists));
+                  res.statistic("Stats-Updates-Pending", db_.pending_updates());
+                  boost::uint64_t warmed, warmup_total;
+                  if (db_.warmup_progress(warmed, warmup_total)) {
+                     res.statistic("Stats-Warmup-Digests", warmup_total);
+                     res.statistic("Stats-Warmup-Done", warmed);
                   }
                }
+               break;
+
+            case request::op_check: {
+               statistics.checks.report();
+               if (verbose_) {
+                  syslog_.debug() << "Request to check digest " << boost::lexical_cast<std::string>(req.digest);
+               }
+
+               // With a lookup pool the reply goes out once the pool has found the record
+
+               if (lookups_ && deferred != NULL && lookups_->submit(req.digest, boost::bind(&server::worker::lookup_completed,
+                  deferred, req.thread.str(), req.binary, sender_endpoint, _1, _2)))
+               {
+                  return 0;
+               }
+
+               pyzor::record r;
+               bool found = db_.get(req.digest, r);
+               this->answer_check(res, found, r, statistics);
+               break;
             }
+
+            case request::op_mcheck: {
+               // All digests are looked up together on this thread, so there is one reply to send
+
+               pyzor::record records[request::max_digests];
+               bool found[request::max_digests];
+               db_.get(req.digests, req.digest_count, records, found);
+               for (size_t i = 0; i < req.digest_count; i++) {
+                  statistics.checks.report();
+                  this->answer_check(res, found[i], records[i], statistics);
+               }
+               break;
+            }
+
+            case request::op_report:
+               statistics.reports.report();
+               if (verbose_) {
+                  syslog_.debug() << "Request to report digest " << boost::lexical_cast<std::string>(req.digest);
+               }
+               db_.report(req.digest);
+               break;
+
+            case request::op_whitelist:
+               statistics.whitelists.report();
+               if (verbose_) {
+                  syslog_.debug() << "Request to whitelist digest " << boost::lexical_cast<std::string>(req.digest);
+               }
+#if PYZOR_WHITELIST_ENABLED
+               db_.whitelist(req.digest);
+#endif
+               break;
+
+            case request::op_ping:
+               // Nothing to do for ping, just send back a plain response
+               break;
+
+            default:
+               res.status(501, "Not supported operation");
+               break;
          }
-         
-         // Send back the reply
-         
-         size_t length = res.archive(data_, sizeof(data_));
-         
-         socket_.async_send_to(
-            asio::buffer(data_, length),
-            sender_endpoint_,
-            boost::bind(&server::handle_send_to, this, asio::placeholders::error, asio::placeholders::bytes_transferred)
-         );
-      }
-      
-      // Receive the next incoming packet
-      
-      if (!shutdown_) {
-         socket_.async_receive_from(
-            asio::buffer(data_, max_length),
-            sender_endpoint_,
-            boost::bind(&server::handle_receive_from, this, asio::placeholders::error, asio::placeholders::bytes_transferred)
-         );
       }
+
+      return res.archive(response, response_size);
    }
-   
-   void server::handle_send_to(const asio::error_code& error, size_t bytes_sent)
+
+   void server::answer_check(reply& res, bool found, record& r, statistics& statistics)
    {
-      // Nothing
+      boost::uint32_t count, wl_count;
+      this->count_check(found, r, statistics, count, wl_count);
+      res.counts(count, wl_count);
+   }
+
+   void server::answer_shm_check(hash const& digest, boost::uint32_t& count, boost::uint32_t& wl_count)
+   {
+      shm_statistics_.requests.report();
+      shm_statistics_.checks.report();
+
+      record r;
+      bool found = db_.get(digest, r);
+      this->count_check(found, r, shm_statistics_, count, wl_count);
+   }
+
+   void server::count_check(bool found, record& r, statistics& statistics, boost::uint32_t& count, boost::uint32_t& wl_count)
+   {
+      if (found) {
+         if (r.report_count() == 1 && (time(NULL) - r.entered()) > (3 * 28 * 86400)) {
+            // Ignore records with 1 report that are older than 3 months
+         } else {
+            statistics.hits.report();
+            count = r.report_count();
+            wl_count = r.whitelist_count();
+            return;
+         }
+      }
+
+      count = 0;
+      wl_count = 0;
    }
          
 }
@@ -8,36 +8,178 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 #include <asio.hpp>
 
+#include "admission.hpp"
+#include "buffer_pool.hpp"
 #include "database.hpp"
+#include "datagram.hpp"
+#include "handoff.hpp"
 #include "hash.hpp"
+#include "lookup_pool.hpp"
+#include "message.hpp"
 #include "record.hpp"
+#include "shm_server.hpp"
 #include "statistics.hpp"
+#include "stream.hpp"
 #include "syslog.hpp"
+#include "unix_socket.hpp"
+#include "uring.hpp"
 
 namespace pyzor {
 
    class server
    {
       public:
-         
-         server(syslog& syslog, asio::io_service& io_service, std::string const& address, std::string const& port, pyzor::database& db, bool verbose = false);
+
+         /// Request counters. Every worker owns a set; they are merged when the statistics op is answered.
+
+         struct statistics
+         {
+            public:
+
+               statistics_ring requests;
+               statistics_ring checks;
+               statistics_ring hits;
+               statistics_ring reports;
+               statistics_ring whitelists;
+         };
+
+         /// A worker runs its own io_service on its own thread and receives on its own socket. When
+         /// there is more than one worker the sockets are bound with SO_REUSEPORT so that the kernel
+         /// spreads incoming datagrams over them. A worker can receive through io_uring instead of
+         /// asio; it then alternates between the ring and its io_service.
+
+         class worker : boost::noncopyable
+         {
+            public:
+
+               worker(server& server, size_t batch_size, bool io_uring);
+
+            public:
+
+               void run();
+               void stop();
+
+               /// Binds a new socket unless it is given the one that the previous process handed off
+               void start_listening(asio::ip::udp::endpoint const& endpoint, bool reuse_port, int adopted = -1);
+               void stop_listening();
+               void stop_receiving();
+               void serve_stream(stream_listener& listener);
+               void start_unix_listening(std::string const& path);
+
+               statistics const& counters() const;
+               int native_socket();
+
+               /// Milliseconds since the socket was last found empty, 0 when it was empty after the last receive
+               boost::uint32_t backlog() const;
+
+               /// Called on a lookup pool thread; the reply is sent from the worker thread.
+               void lookup_completed(std::string thread, bool binary, asio::ip::udp::endpoint sender_endpoint, bool found, record r);
+
+            private:
+
+               void handle_start_listening(asio::ip::udp::endpoint endpoint, bool reuse_port, int adopted);
+               void handle_stop_listening();
+               void handle_stop_receiving();
+               void handle_start_unix_listening(std::string path);
+               void handle_unix_receive_from(const asio::error_code& error, size_t bytes_recvd);
+               void start_unix_receive();
+               void handle_receive_from(const asio::error_code& error, size_t bytes_recvd);
+               void handle_send_to(char* response, const asio::error_code& error, size_t bytes_sent);
+               void handle_lookup_completed(std::string thread, bool binary, asio::ip::udp::endpoint sender_endpoint, bool found, record r);
+               void start_receive();
+
+            private:
+
+               server& server_;
+               // The buffers come before the io_service so they outlive the handlers it still holds
+               datagram_batch batch_;
+               buffer_pool responses_;
+               handler_arena handlers_;
+               asio::io_service io_service_;
+               asio::io_service::work work_;
+               asio::ip::udp::socket socket_;
+               asio::ip::udp::endpoint sender_endpoint_;
+               unix_datagram::socket unix_socket_;
+               unix_endpoint unix_sender_;
+               std::string unix_path_;
+               std::vector<char> unix_request_;
+               statistics statistics_;
+               boost::shared_ptr<uring_listener> uring_;
+               volatile boost::uint32_t backlogged_since_;
+               volatile bool stopped_;
+         };
+
+         typedef boost::shared_ptr<worker> worker_ptr;
+
+         friend class worker;
+
+      public:
+
+         server(syslog& syslog, asio::io_service& io_service, std::string const& address, std::string const& port, pyzor::database& db, size_t threads = 1, size_t batch_size = 1, bool io_uring = false, bool verbose = false);
+         ~server();
 
       public:
 
          void start_listening();
          void stop_listening();
-         
+
          void run();
          void stop();
 
-         void add_admin_address(std::string const& address);         
-         bool authorize_admin_request(packet const& request, asio::ip::udp::endpoint const& sender_endpoint_);
-         void handle_receive_from(const asio::error_code& error, size_t bytes_recvd);
-         void handle_send_to(const asio::error_code& error, size_t bytes_sent);
-            
+         /// Look up checks on a pool of threads instead of on the listener threads. Listeners that
+         /// receive through io_uring keep doing their lookups themselves.
+         void enable_lookup_pool(size_t threads, size_t queue_limit);
+
+         /// Also accept pipelined requests over TCP on the same address and port. The connections
+         /// are spread over the workers.
+         void enable_stream();
+
+         /// Also accept datagrams on a Unix socket. The file is created with mode 0660 and admin ops
+         /// on it are allowed without an address check.
+         void enable_unix_socket(std::string const& path);
+
+         /// Also answer checks from clients on this host through a shared memory ring, see
+         /// shm_ring.hpp. The ring is served by a thread of its own.
+         void enable_shm(std::string const& name);
+
+         /// Answer with 503 instead of doing the work when the server falls behind or a source sends
+         /// more than its share. Receive queue ages are only measured on asio listeners.
+         void enable_admission_control(unsigned int max_queue_age, unsigned int source_rate);
+
+         /// Take the listening sockets over from a server that is still running, and hand them on
+         /// to the next one through the same path. A server that hands off its sockets stops
+         /// receiving, drains for a few seconds and then exits.
+         void enable_handoff(std::string const& path);
+
+         void add_admin_address(std::string const& address);
+         bool authorize_admin_request(request const& req, asio::ip::udp::endpoint const& sender_endpoint_);
+
+      private:
+
+         /// Returns 0 when the reply is left to the lookup pool; it is then sent by the worker.
+         /// Trusted requests came in over the Unix socket and may use the admin ops.
+         size_t handle_request(const char* data, size_t length, char* response, size_t response_size,
+            asio::ip::udp::endpoint const& sender_endpoint, statistics& statistics, worker* deferred, bool trusted);
+         void answer_check(reply& res, bool found, record& r, statistics& statistics);
+         void answer_shm_check(hash const& digest, boost::uint32_t& count, boost::uint32_t& wl_count);
+         void count_check(bool found, record& r, statistics& statistics, boost::uint32_t& count, boost::uint32_t& wl_count);
+         void serve_shm();
+
+         boost::uint64_t average(statistics_ring statistics::* ring) const;
+         boost::uint64_t total(statistics_ring statistics::* ring) const;
+         boost::uint32_t backlog() const;
+
+         std::vector<handoff_socket> handoff_sockets();
+         void handed_off();
+         void handle_handed_off();
+         void handle_drained(const asio::error_code& error);
+
       private:
 
          syslog& syslog_;
@@ -46,17 +188,28 @@ namespace pyzor {
          std::string port_;
          database& db_;
          bool verbose_;
-         asio::ip::udp::socket socket_;
-         asio::ip::udp::endpoint sender_endpoint_;
-         enum { max_length = 8192 };
-         char data_[max_length];
+         // Set by the worker that handles a shutdown request, read by all of them
          bool shutdown_;
 
-         statistics_ring request_statistics_;
-         statistics_ring check_statistics_;
-         statistics_ring hit_statistics_;
-         statistics_ring report_statistics_;
-         statistics_ring whitelist_statistics_;
+         std::vector<worker_ptr> workers_;
+         boost::shared_ptr<lookup_pool> lookups_;
+         bool stream_enabled_;
+         boost::shared_ptr<stream_listener> stream_;
+         std::string unix_path_;
+         boost::shared_ptr<shm_server> shm_;
+         statistics shm_statistics_;
+         bool shm_stopped_;
+         boost::shared_ptr<admission_control> admission_;
+
+         enum { drain_interval = 2 };
+         std::string handoff_path_;
+         handoff_client handoff_client_;
+         boost::shared_ptr<handoff_server> handoff_;
+         volatile bool handed_off_;
+         asio::deadline_timer drain_timer_;
+         // The handoff thread reads the listening sockets while the workers and the io_service
+         // open and close them
+         pthread_mutex_t sockets_lock_;
 
          std::set<std::string> admin_addresses_;
    };
@@ -0,0 +1,281 @@
+// shm_ring.hpp
+
+#ifndef PYZOR_SHM_RING_HPP
+#define PYZOR_SHM_RING_HPP
+
+// This header is the client side of the shared memory interface and is meant to be copied into
+// other projects; it only needs POSIX and GCC. Without Linux futexes the waits turn into short sleeps.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace pyzor {
+
+   namespace shm {
+
+      /// A ring of request slots in a POSIX shared memory segment. A client takes a ticket from the
+      /// tail, waits until the slot of that ticket is free, claims it, writes the raw digest and
+      /// publishes it. The server answers the slots in ticket order and the client then frees its
+      /// slot for the next round. The sequence number of a slot tells whose turn it is:
+      ///
+      ///   ticket      free, the client with this ticket may claim it
+      ///   ticket + 3  claimed, the client is writing its digest
+      ///   ticket + 1  the digest is ready for the server
+      ///   ticket + 2  the counts are ready for the client
+      ///
+      /// Every change is a compare and swap, so a slot can be taken away from a client that is too
+      /// slow. A client that stops waiting for its answer marks the slot abandoned and the server
+      /// frees it. When the slot at the head has not become ready long after its ticket was taken,
+      /// the server skips the ticket, or frees the slot if the client of the previous round never
+      /// did. The client of a skipped ticket finds its slot gone and fails the check.
+      ///
+      /// Nobody makes a system call while both sides are busy. A server with nothing to do sleeps on
+      /// the doorbell and a client that has waited too long sleeps on its slot; the other side only
+      /// calls futex wake when it sees that someone is waiting.
+
+      enum { magic = 0x505a5247, version = 2 };
+
+      struct slot
+      {
+         volatile uint32_t sequence;
+         volatile uint32_t waiting;
+         volatile uint32_t abandoned;
+         uint32_t count;
+         uint32_t wl_count;
+         unsigned char digest[20];
+         char padding[24];
+      };
+
+      struct header
+      {
+         uint32_t magic;
+         uint32_t version;
+         uint32_t slots;
+         char padding0[52];
+
+         volatile uint32_t tail;
+         char padding1[60];
+
+         volatile uint32_t server_waiting;
+         volatile uint32_t doorbell;
+         char padding2[56];
+      };
+
+      inline size_t segment_size(uint32_t slots)
+      {
+         return sizeof(header) + (slots * sizeof(slot));
+      }
+
+      inline slot* slots_of(header* h)
+      {
+         return reinterpret_cast<slot*>(h + 1);
+      }
+
+      inline void futex_wait(volatile uint32_t* word, uint32_t value, long timeout_ms)
+      {
+#if defined(__linux__)
+         timespec timeout;
+         timeout.tv_sec = timeout_ms / 1000;
+         timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+         syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+         usleep(1000);
+#endif
+      }
+
+      inline void futex_wake(volatile uint32_t* word)
+      {
+#if defined(__linux__)
+         syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+      }
+
+      /// Move a slot on from one sequence number to the next and wake whoever waits for it. Returns
+      /// false if the slot was not at from.
+      inline bool release(slot& s, uint32_t from, uint32_t to)
+      {
+         if (!__atomic_compare_exchange_n(&s.sequence, &from, to, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return false;
+         }
+         if (__atomic_load_n(&s.waiting, __ATOMIC_SEQ_CST) != 0) {
+            futex_wake(&s.sequence);
+         }
+         return true;
+      }
+
+      /// Busy wait a little; after the first rounds give the CPU away in case the other side is
+      /// waiting for it.
+      inline void backoff(int round)
+      {
+         if (round < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+         } else {
+            sched_yield();
+         }
+      }
+
+      /// A client of the ring. One instance can be shared by any number of threads.
+
+      class client
+      {
+         public:
+
+            enum { spins = 256, timeout_ms = 1000 };
+
+         public:
+
+            client()
+               : header_(NULL), slots_(NULL), size_(0)
+            {
+            }
+
+            ~client()
+            {
+               this->close();
+            }
+
+         public:
+
+            /// Map the segment the server created, for example "/pyzor". Returns false if there is
+            /// no server or it uses another version of the ring.
+            bool open(const char* name)
+            {
+               this->close();
+
+               int fd = ::shm_open(name, O_RDWR, 0);
+               if (fd < 0) {
+                  return false;
+               }
+
+               struct stat st;
+               if (::fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+                  ::close(fd);
+                  return false;
+               }
+
+               void* p = ::mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+               ::close(fd);
+               if (p == MAP_FAILED) {
+                  return false;
+               }
+
+               header* h = static_cast<header*>(p);
+               if (h->magic != magic || h->version != version || segment_size(h->slots) > (size_t) st.st_size) {
+                  ::munmap(p, st.st_size);
+                  return false;
+               }
+
+               header_ = h;
+               slots_ = slots_of(h);
+               size_ = st.st_size;
+
+               return true;
+            }
+
+            void close()
+            {
+               if (header_ != NULL) {
+                  ::munmap(header_, size_);
+                  header_ = NULL;
+               }
+            }
+
+            /// Check a raw 20 byte digest. Returns false if the server did not answer in time; when
+            /// that keeps happening the ring should be opened again.
+            bool check(const unsigned char digest[20], uint32_t& count, uint32_t& wl_count)
+            {
+               uint32_t slots = header_->slots;
+               uint32_t ticket = __atomic_fetch_add(&header_->tail, 1, __ATOMIC_ACQ_REL);
+               slot& s = slots_[ticket & (slots - 1)];
+
+               // Wait for the client from the previous round to be done with the slot, then claim
+               // it unless the server has skipped the ticket in the meantime
+
+               if (!this->wait_for(s, ticket) || !release(s, ticket, ticket + 3)) {
+                  return false;
+               }
+
+               memcpy(s.digest, digest, sizeof(s.digest));
+               if (!release(s, ticket + 3, ticket + 1)) {
+                  return false;
+               }
+
+               if (__atomic_load_n(&header_->server_waiting, __ATOMIC_SEQ_CST) != 0) {
+                  __atomic_fetch_add(&header_->doorbell, 1, __ATOMIC_SEQ_CST);
+                  futex_wake(&header_->doorbell);
+               }
+
+               // Once abandoned, the server frees the slot when it answers; if the answer came in
+               // just now, free it here
+
+               if (!this->wait_for(s, ticket + 2)) {
+                  __atomic_store_n(&s.abandoned, ticket, __ATOMIC_SEQ_CST);
+                  release(s, ticket + 2, ticket + slots);
+                  return false;
+               }
+
+               count = s.count;
+               wl_count = s.wl_count;
+
+               // A client of the next round may already be waiting for the slot
+               return release(s, ticket + 2, ticket + slots);
+            }
+
+         private:
+
+            bool wait_for(slot& s, uint32_t sequence)
+            {
+               for (int i = 0; i < spins; i++) {
+                  if (__atomic_load_n(&s.sequence, __ATOMIC_ACQUIRE) == sequence) {
+                     return true;
+                  }
+                  backoff(i);
+               }
+
+               time_t started = time(NULL);
+               bool found = false;
+
+               __atomic_fetch_add(&s.waiting, 1, __ATOMIC_SEQ_CST);
+               for (;;) {
+                  uint32_t current = __atomic_load_n(&s.sequence, __ATOMIC_SEQ_CST);
+                  if (current == sequence) {
+                     found = true;
+                     break;
+                  }
+                  if (time(NULL) - started > (timeout_ms / 1000)) {
+                     break;
+                  }
+                  futex_wait(&s.sequence, current, 10);
+               }
+               __atomic_fetch_sub(&s.waiting, 1, __ATOMIC_SEQ_CST);
+
+               return found;
+            }
+
+         private:
+
+            header* header_;
+            slot* slots_;
+            size_t size_;
+      };
+
+   }
+
+}
+
+#endif // PYZOR_SHM_RING_HPP
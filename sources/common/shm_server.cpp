@@ -0,0 +1,206 @@
+// shm_server.cpp
+
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "shm_server.hpp"
+
+namespace pyzor {
+
+   shm_server::shm_server(std::string const& name, lookup_function lookup, boost::uint32_t slots)
+      : name_(name), lookup_(lookup), header_(NULL), slots_(NULL), size_(0), head_(0), served_(0), stalled_(false),
+        stalled_head_(0), stalled_since_(0)
+   {
+      // The four sequence numbers of a round must not meet those of the next round
+
+      boost::uint32_t n = minimum_slots;
+      while (n < slots) {
+         n <<= 1;
+      }
+
+      ::shm_unlink(name_.c_str());
+
+      int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+      if (fd < 0) {
+         throw std::runtime_error(std::string("Cannot create shared memory segment ") + name_);
+      }
+
+      // The mode given to shm_open is masked by the umask
+      ::fchmod(fd, 0660);
+
+      struct stat st;
+      size_ = shm::segment_size(n);
+      if (::fstat(fd, &st) != 0 || ::ftruncate(fd, size_) != 0) {
+         ::close(fd);
+         ::shm_unlink(name_.c_str());
+         throw std::runtime_error(std::string("Cannot size shared memory segment ") + name_);
+      }
+
+      device_ = st.st_dev;
+      inode_ = st.st_ino;
+
+      void* p = ::mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED) {
+         ::shm_unlink(name_.c_str());
+         throw std::runtime_error(std::string("Cannot map shared memory segment ") + name_);
+      }
+
+      header_ = static_cast<shm::header*>(p);
+      slots_ = shm::slots_of(header_);
+
+      for (boost::uint32_t i = 0; i < n; i++) {
+         slots_[i].sequence = i;
+         slots_[i].abandoned = i - n;
+      }
+
+      header_->slots = n;
+      header_->version = shm::version;
+
+      // Clients check the magic last, so it is only set once the ring is ready
+      __atomic_store_n(&header_->magic, (uint32_t) shm::magic, __ATOMIC_RELEASE);
+   }
+
+   shm_server::~shm_server()
+   {
+      ::munmap(header_, size_);
+
+      // A server that took over from this one may already have replaced the segment
+
+      int fd = ::shm_open(name_.c_str(), O_RDONLY, 0);
+      if (fd >= 0) {
+         struct stat st;
+         if (::fstat(fd, &st) == 0 && st.st_dev == device_ && st.st_ino == inode_) {
+            ::shm_unlink(name_.c_str());
+         }
+         ::close(fd);
+      }
+   }
+
+   size_t shm_server::serve(int timeout)
+   {
+      size_t answered = 0;
+      int spins = 0;
+
+      for (;;) {
+         shm::slot& s = slots_[head_ & (header_->slots - 1)];
+
+         if (this->ready(s)) {
+            this->answer(s);
+            answered++;
+            spins = 0;
+            continue;
+         }
+
+         if (answered != 0) {
+            break;
+         }
+
+         if (spins < shm_server::spins) {
+            shm::backoff(spins++);
+            continue;
+         }
+
+         if (this->reclaim(s)) {
+            spins = 0;
+            continue;
+         }
+
+         // Tell the clients to ring the doorbell, then look once more before going to sleep
+
+         uint32_t doorbell = __atomic_load_n(&header_->doorbell, __ATOMIC_SEQ_CST);
+         __atomic_store_n(&header_->server_waiting, 1, __ATOMIC_SEQ_CST);
+
+         if (!this->ready(s)) {
+            shm::futex_wait(&header_->doorbell, doorbell, timeout);
+         }
+
+         __atomic_store_n(&header_->server_waiting, 0, __ATOMIC_SEQ_CST);
+
+         if (!this->ready(s)) {
+            break;
+         }
+      }
+
+      __atomic_add_fetch(&served_, answered, __ATOMIC_RELAXED);
+
+      return answered;
+   }
+
+   boost::uint64_t shm_server::served() const
+   {
+      return __atomic_load_n(&served_, __ATOMIC_RELAXED);
+   }
+
+   bool shm_server::ready(shm::slot& s) const
+   {
+      return __atomic_load_n(&s.sequence, __ATOMIC_SEQ_CST) == head_ + 1;
+   }
+
+   void shm_server::answer(shm::slot& s)
+   {
+      hash digest;
+      memcpy(digest.data_, s.digest, sizeof(digest.data_));
+
+      boost::uint32_t count = 0, wl_count = 0;
+      lookup_(digest, count, wl_count);
+
+      s.count = count;
+      s.wl_count = wl_count;
+
+      shm::release(s, head_ + 1, head_ + 2);
+
+      // The client stopped waiting for the answer, so nobody else frees the slot
+
+      if (__atomic_load_n(&s.abandoned, __ATOMIC_SEQ_CST) == head_) {
+         shm::release(s, head_ + 2, head_ + header_->slots);
+      }
+
+      head_++;
+   }
+
+   bool shm_server::reclaim(shm::slot& s)
+   {
+      // Nothing is late while no client holds the ticket at the head
+
+      if (__atomic_load_n(&header_->tail, __ATOMIC_SEQ_CST) == head_) {
+         stalled_ = false;
+         return false;
+      }
+
+      time_t now = time(NULL);
+      if (!stalled_ || stalled_head_ != head_) {
+         stalled_ = true;
+         stalled_head_ = head_;
+         stalled_since_ = now;
+         return false;
+      }
+
+      if (now - stalled_since_ <= deadline) {
+         return false;
+      }
+
+      stalled_ = false;
+
+      boost::uint32_t slots = header_->slots;
+      boost::uint32_t sequence = __atomic_load_n(&s.sequence, __ATOMIC_SEQ_CST);
+
+      // The client of the previous round never freed the slot; hand it to the client of this one.
+      // If that one gave up as well, the ticket is skipped after the next deadline.
+
+      if (sequence == head_ - slots + 2) {
+         return shm::release(s, sequence, head_);
+      }
+
+      // The client of this ticket gave up or died before it published its digest
+
+      if ((sequence == head_ || sequence == head_ + 3) && shm::release(s, sequence, head_ + slots)) {
+         head_++;
+         return true;
+      }
+
+      return false;
+   }
+
+}
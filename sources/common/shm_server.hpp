@@ -0,0 +1,75 @@
+// shm_server.hpp
+
+#ifndef PYZOR_SHM_SERVER_HPP
+#define PYZOR_SHM_SERVER_HPP
+
+#include <sys/types.h>
+
+#include <string>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "hash.hpp"
+#include "shm_ring.hpp"
+
+namespace pyzor {
+
+   /// The server side of the shared memory ring in shm_ring.hpp. It creates the segment, replacing
+   /// the one of a previous run, and answers checks from the thread that calls serve(). Clients that
+   /// still have the old segment mapped time out and have to open the ring again.
+   ///
+   /// The ring answers in ticket order. A ticket whose client gave up or died holds up the clients
+   /// behind it until the deadline has passed and the server skips it.
+
+   class shm_server : boost::noncopyable
+   {
+      public:
+
+         typedef boost::function<void (hash const& digest, boost::uint32_t& count, boost::uint32_t& wl_count)> lookup_function;
+
+         /// The deadline is in seconds and longer than a client waits for a slot
+         enum { default_slots = 1024, minimum_slots = 4, spins = 256, deadline = 3 };
+
+      public:
+
+         /// The name is a POSIX shared memory name like "/pyzor". Slots is rounded up to a power of two.
+         shm_server(std::string const& name, lookup_function lookup, boost::uint32_t slots = default_slots);
+         ~shm_server();
+
+      public:
+
+         /// Answer the checks that are ready. When there are none, wait up to timeout milliseconds
+         /// for one. Returns the number of checks that were answered.
+         size_t serve(int timeout);
+
+         boost::uint64_t served() const;
+
+      private:
+
+         bool ready(shm::slot& s) const;
+         void answer(shm::slot& s);
+         bool reclaim(shm::slot& s);
+
+      private:
+
+         std::string name_;
+         lookup_function lookup_;
+         shm::header* header_;
+         shm::slot* slots_;
+         size_t size_;
+         dev_t device_;
+         ino_t inode_;
+         boost::uint32_t head_;
+         boost::uint64_t served_;
+
+         // Since when the slot at the head is not ready while its ticket was taken
+         bool stalled_;
+         boost::uint32_t stalled_head_;
+         time_t stalled_since_;
+   };
+
+}
+
+#endif // PYZOR_SHM_SERVER_HPP
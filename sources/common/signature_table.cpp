@@ -0,0 +1,244 @@
+// signature_table.cpp
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+#include "dump.hpp"
+#include "signature_table.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      const char table_magic[8] = { 'P', 'Y', 'Z', 'O', 'R', 'T', 'B', 'L' };
+      const boost::uint32_t table_version = 1;
+
+      inline bool signature_less(dump_record_v2 const& a, dump_record_v2 const& b)
+      {
+         return memcmp(a.signature.data_, b.signature.data_, sizeof(a.signature.data_)) < 0;
+      }
+
+      inline bool signature_equal(dump_record_v2 const& a, dump_record_v2 const& b)
+      {
+         return memcmp(a.signature.data_, b.signature.data_, sizeof(a.signature.data_)) == 0;
+      }
+
+      inline boost::uint32_t bucket_of(hash const& key, boost::uint32_t bits)
+      {
+         boost::uint32_t prefix = (key.data_[0] << 24) | (key.data_[1] << 16) | (key.data_[2] << 8) | key.data_[3];
+         return (bits == 0) ? 0 : (prefix >> (32 - bits));
+      }
+
+   }
+
+   size_t signature_table::build(boost::filesystem::path const& snapshot, boost::filesystem::path const& table)
+   {
+      // Read the dump
+
+      boost::iostreams::filtering_istream in;
+      in.push(boost::iostreams::gzip_decompressor());
+      in.push(boost::iostreams::file_source(snapshot.string(), std::ios::binary));
+
+      boost::uint32_t version = 0;
+      in.read(reinterpret_cast<char*>(&version), sizeof(version));
+      if (!in || ntohl(version) != 2) {
+         throw std::runtime_error("Snapshot is not a version 2 dump");
+      }
+
+      std::vector<dump_record_v2> records;
+
+      dump_record_v2 r;
+      while (in.read(reinterpret_cast<char*>(&r), sizeof(r))) {
+         records.push_back(r);
+      }
+
+      // Sort by signature; when a signature appears twice the later record wins
+
+      std::stable_sort(records.begin(), records.end(), signature_less);
+
+      std::vector<dump_record_v2> unique;
+      unique.reserve(records.size());
+      for (size_t i = 0; i < records.size(); i++) {
+         if (!unique.empty() && signature_equal(unique.back(), records[i])) {
+            unique.back() = records[i];
+         } else {
+            unique.push_back(records[i]);
+         }
+      }
+      records.clear();
+
+      // Aim for about eight keys per bucket
+
+      boost::uint32_t bits = 0;
+      while (bits < 24 && ((size_t) 8 << bits) < unique.size()) {
+         bits++;
+      }
+
+      boost::uint32_t buckets = (boost::uint32_t) 1 << bits;
+      std::vector<boost::uint32_t> index(buckets + 1, 0);
+      for (size_t i = 0; i < unique.size(); i++) {
+         index[bucket_of(unique[i].signature, bits) + 1]++;
+      }
+      for (boost::uint32_t b = 0; b < buckets; b++) {
+         index[b + 1] += index[b];
+      }
+      for (size_t b = 0; b < index.size(); b++) {
+         index[b] = htonl(index[b]);
+      }
+
+      // Write it next to the destination and move it into place
+
+      boost::filesystem::path tmp = table.string() + ".tmp";
+
+      std::ofstream out(tmp.string().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+      if (!out.is_open()) {
+         throw std::runtime_error(std::string("Cannot create ") + tmp.string());
+      }
+
+      header h;
+      memcpy(h.magic, table_magic, sizeof(h.magic));
+      h.version = htonl(table_version);
+      h.bucket_bits = htonl(bits);
+      h.count = htonl((boost::uint32_t) unique.size());
+      h.reserved = 0;
+
+      out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      out.write(reinterpret_cast<const char*>(&index[0]), index.size() * sizeof(boost::uint32_t));
+      for (size_t i = 0; i < unique.size(); i++) {
+         out.write(reinterpret_cast<const char*>(unique[i].signature.data_), sizeof(unique[i].signature.data_));
+      }
+      for (size_t i = 0; i < unique.size(); i++) {
+         compact_record c;
+         c.entered = unique[i].entered;
+         c.updated = unique[i].updated;
+         c.report_count = unique[i].report_count;
+         c.whitelist_count = unique[i].whitelist_count;
+         out.write(reinterpret_cast<const char*>(&c), sizeof(c));
+      }
+
+      out.close();
+      if (!out) {
+         throw std::runtime_error(std::string("Cannot write ") + tmp.string());
+      }
+
+      if (::rename(tmp.string().c_str(), table.string().c_str()) != 0) {
+         throw std::runtime_error(std::string("Cannot rename ") + tmp.string());
+      }
+
+      return unique.size();
+   }
+
+   signature_table::signature_table(boost::filesystem::path const& path)
+      : path_(path), fd_(-1), map_(MAP_FAILED), size_(0)
+   {
+      fd_ = ::open(path.string().c_str(), O_RDONLY);
+      if (fd_ < 0) {
+         throw std::runtime_error(std::string("Cannot open signature table ") + path.string());
+      }
+
+      struct stat st;
+      if (::fstat(fd_, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+         ::close(fd_);
+         throw std::runtime_error(std::string("Signature table is too small: ") + path.string());
+      }
+
+      size_ = st.st_size;
+      inode_ = st.st_ino;
+      mtime_ = st.st_mtime;
+
+      map_ = ::mmap(NULL, size_, PROT_READ, MAP_SHARED, fd_, 0);
+      if (map_ == MAP_FAILED) {
+         ::close(fd_);
+         throw std::runtime_error(std::string("Cannot map signature table ") + path.string());
+      }
+
+      // Lookups jump around the whole file; read ahead would only waste the page cache
+
+      ::madvise(map_, size_, MADV_RANDOM);
+
+      const header* h = static_cast<const header*>(map_);
+      bucket_bits_ = ntohl(h->bucket_bits);
+      count_ = ntohl(h->count);
+
+      size_t expected = sizeof(header) + ((((size_t) 1 << bucket_bits_) + 1) * sizeof(boost::uint32_t))
+         + ((size_t) count_ * (sizeof(hash) + sizeof(compact_record)));
+
+      if (memcmp(h->magic, table_magic, sizeof(table_magic)) != 0 || ntohl(h->version) != table_version
+          || bucket_bits_ > 24 || expected != size_)
+      {
+         ::munmap(map_, size_);
+         ::close(fd_);
+         throw std::runtime_error(std::string("Not a valid signature table: ") + path.string());
+      }
+
+      const char* base = static_cast<const char*>(map_) + sizeof(header);
+      buckets_ = reinterpret_cast<const boost::uint32_t*>(base);
+      base += (((size_t) 1 << bucket_bits_) + 1) * sizeof(boost::uint32_t);
+      keys_ = reinterpret_cast<const hash*>(base);
+      base += (size_t) count_ * sizeof(hash);
+      records_ = reinterpret_cast<const compact_record*>(base);
+   }
+
+   signature_table::~signature_table()
+   {
+      ::munmap(map_, size_);
+      ::close(fd_);
+   }
+
+   bool signature_table::lookup(hash const& key, record& r) const
+   {
+      r = record();
+
+      boost::uint32_t bucket = bucket_of(key, bucket_bits_);
+      boost::uint32_t low = ntohl(buckets_[bucket]);
+      boost::uint32_t high = ntohl(buckets_[bucket + 1]);
+
+      while (low < high) {
+         boost::uint32_t middle = low + ((high - low) / 2);
+         int c = memcmp(keys_[middle].data_, key.data_, sizeof(key.data_));
+         if (c == 0) {
+            compact_record const& found = records_[middle];
+            r.entered_ = found.entered;
+            r.updated_ = found.updated;
+            r.report_count_ = found.report_count;
+            r.whitelist_count_ = found.whitelist_count;
+            return !(r.report_count() == 0 && r.whitelist_count() == 0);
+         } else if (c < 0) {
+            low = middle + 1;
+         } else {
+            high = middle;
+         }
+      }
+
+      return false;
+   }
+
+   size_t signature_table::size() const
+   {
+      return count_;
+   }
+
+   bool signature_table::modified() const
+   {
+      struct stat st;
+      if (::stat(path_.string().c_str(), &st) != 0) {
+         return false;
+      }
+      return st.st_ino != inode_ || st.st_mtime != mtime_ || (size_t) st.st_size != size_;
+   }
+
+}
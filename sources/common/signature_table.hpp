@@ -0,0 +1,89 @@
+// signature_table.hpp
+
+#ifndef PYZOR_SIGNATURE_TABLE_HPP
+#define PYZOR_SIGNATURE_TABLE_HPP
+
+#include <sys/types.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "hash.hpp"
+#include "record.hpp"
+
+namespace pyzor {
+
+   /// A read-only signature table that is memory mapped from disk. The file holds the digests sorted
+   /// in one array and their counters in a parallel array, with an index of where every prefix bucket
+   /// starts. A lookup reads the bucket bounds and then searches a handful of neighbouring keys; it
+   /// takes no locks and allocates nothing.
+   ///
+   /// Tables are built from a version 2 dump and replaced as a whole. Write the new table next to
+   /// the old one and rename it into place; opened tables notice through modified().
+
+   class signature_table : boost::noncopyable
+   {
+      public:
+
+         /// Build a table from a gzipped version 2 dump. Returns the number of signatures written.
+         static size_t build(boost::filesystem::path const& snapshot, boost::filesystem::path const& table);
+
+      public:
+
+         signature_table(boost::filesystem::path const& path);
+         ~signature_table();
+
+      public:
+
+         /// Same semantics as database::get: true only for records that were not reset.
+         bool lookup(hash const& key, record& r) const;
+
+         size_t size() const;
+         bool modified() const;
+
+      private:
+
+         struct header
+         {
+            public:
+
+               char magic[8];
+               boost::uint32_t version;
+               boost::uint32_t bucket_bits;
+               boost::uint32_t count;
+               boost::uint32_t reserved;
+         };
+
+         struct compact_record
+         {
+            public:
+
+               boost::uint32_t entered;
+               boost::uint32_t updated;
+               boost::uint32_t report_count;
+               boost::uint32_t whitelist_count;
+         };
+
+      private:
+
+         boost::filesystem::path path_;
+         int fd_;
+         void* map_;
+         size_t size_;
+         ino_t inode_;
+         time_t mtime_;
+
+         boost::uint32_t bucket_bits_;
+         boost::uint32_t count_;
+         const boost::uint32_t* buckets_;
+         const hash* keys_;
+         const compact_record* records_;
+   };
+
+   typedef boost::shared_ptr<signature_table> signature_table_ptr;
+
+}
+
+#endif // PYZOR_SIGNATURE_TABLE_HPP
@@ -34,35 +34,40 @@ namespace pyzor {
    {
       syslog_.debug() << "Starting session";
 
-      asio::async_read(
-         socket_,
-         asio::buffer(&incoming_update_, sizeof(pyzor::update)),
-         boost::bind(&slave::session::handle_read, shared_from_this(), asio::placeholders::error)
+      socket_.async_read_some(
+         reader_.buffer(),
+         boost::bind(&slave::session::handle_read, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred)
       );
 
       ping_timer_.expires_from_now(boost::posix_time::seconds(3));
       ping_timer_.async_wait(boost::bind(&slave::session::write_ping, shared_from_this()));      
    }
    
-   void slave::session::handle_read(const asio::error_code& error)
+   void slave::session::handle_read(const asio::error_code& error, size_t bytes_transferred)
    {
-      if (!error)
+      if (!error && reader_.consume(bytes_transferred, incoming_updates_))
       {
-         // Ask the slave to deal with this update.
+         // Ask the slave to deal with these updates.
          
-         slave_.write_update(incoming_update_);
+         for (size_t i = 0; i < incoming_updates_.size(); i++) {
+            slave_.write_update(incoming_updates_[i]);
+         }
+         incoming_updates_.clear();
          
-         // Read the next update
+         // Read the next updates
 
-         asio::async_read(
-            socket_,
-            asio::buffer(&incoming_update_, sizeof(pyzor::update)),
-            boost::bind(&slave::session::handle_read, shared_from_this(), asio::placeholders::error)
+         socket_.async_read_some(
+            reader_.buffer(),
+            boost::bind(&slave::session::handle_read, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred)
          );
       }
       else
       {
-         syslog_.notice() << "Could not read packet from slave session. Closing Socket. Reason: " << error.message();
+         if (error) {
+            syslog_.notice() << "Could not read packet from slave session. Closing Socket. Reason: " << error.message();
+         } else {
+            syslog_.error() << "Received a damaged update frame from slave session. Closing Socket.";
+         }
          socket_.close();
          ping_timer_.cancel();
          connected_ = false;
@@ -102,7 +107,8 @@ namespace pyzor {
       : syslog_(syslog), io_service_(io_service), home_(home), db_home_(home / "db"), cache_size_(cache_size), local_(local), master_(master), slaves_(slaves),
         verbose_(verbose), env_(NULL), db_(NULL),
         acceptor_(io_service_, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 5555), true),
-        shutdown_(false), socket_(io_service), connect_timer_(io_service_), connected_(false)
+        shutdown_(false), socket_(io_service), spool_timer_(io_service_), connect_timer_(io_service_), connected_(false),
+        pending_updates_(0)
    {
       // Setup the database. This will block until syncing is done and replication is going.
       this->setup();
@@ -135,6 +141,38 @@ namespace pyzor {
    {
       io_service_.post(boost::bind(&slave::handle_stop, this));
    }
+
+   void slave::enable_spool(boost::filesystem::path const& path, size_t memory_limit)
+   {
+      spool_.reset(new update_spool(path, memory_limit, update_queue_));
+      __atomic_fetch_add(&pending_updates_, spool_->size(), __ATOMIC_RELAXED);
+      syslog_.notice() << "Spooling updates in " << path.string() << "; " << (unsigned int) spool_->size() << " left from the last run";
+      this->schedule_spool_sync();
+   }
+
+   void slave::schedule_spool_sync()
+   {
+      spool_timer_.expires_from_now(boost::posix_time::seconds((long) spool_sync_interval));
+      spool_timer_.async_wait(boost::bind(&slave::handle_spool_sync, this, asio::placeholders::error));
+   }
+
+   void slave::handle_spool_sync(const asio::error_code& error)
+   {
+      if (!error) {
+         spool_->sync();
+         this->schedule_spool_sync();
+      }
+   }
+
+   DB_ENV* slave::environment()
+   {
+      return env_;
+   }
+
+   DB* slave::db()
+   {
+      return db_;
+   }
    
    //
 
@@ -261,7 +299,7 @@ namespace pyzor {
             
          // Open the database
 
-         ret = db_->open(db_, NULL, "signatures.db", NULL, DB_HASH, DB_AUTO_COMMIT, 0);            
+         ret = db_->open(db_, NULL, "signatures.db", NULL, DB_HASH, DB_AUTO_COMMIT | DB_THREAD, 0);            
          if (ret != 0) {
             if (ret == ENOENT || ret == DB_LOCK_DEADLOCK || ret == DB_REP_HANDLE_DEAD) {
                syslog_.notice() << "Cannot open the database: it is not online yet ... retrying in 5 seconds";
@@ -353,15 +391,11 @@ namespace pyzor {
          connected_ = true;
          syslog_.notice() << "Connected to the master database.";
          
-         if (!update_queue_.empty())
+         if (!update_queue_.empty() && frame_.size() == 0)
          {
             syslog_.debug() << "Sending " << (unsigned int) update_queue_.size() << " queued updates to the master database.";
             
-            asio::async_write(
-               socket_,
-               asio::buffer((void*) &(update_queue_.front()), sizeof(update)),
-               boost::bind(&slave::handle_write_update, this, asio::placeholders::error)
-            );
+            this->send_updates();
          }
       }
       else
@@ -377,41 +411,66 @@ namespace pyzor {
 
    void slave::write_update(update u)
    {
-      bool write_in_progress = !update_queue_.empty();
+      if (spool_) {
+         try {
+            spool_->push(u, update_queue_);
+         } catch (std::exception const& e) {
+            syslog_.error() << "Cannot spool an update: " << e.what();
+            return;
+         }
+      } else {
+         update_queue_.push_back(u);
+      }
 
-      update_queue_.push_back(u);
+      __atomic_fetch_add(&pending_updates_, 1, __ATOMIC_RELAXED);
       
-      if (connected_ && !write_in_progress) {
-         asio::async_write(
-            socket_,
-            asio::buffer((void*) &(update_queue_.front()), sizeof(update)),
-            boost::bind(&slave::handle_write_update, this, asio::placeholders::error)
-         );
+      // Updates that come in while a frame is being written go out together in the next one
+
+      if (connected_ && frame_.size() == 0 && !update_queue_.empty()) {
+         this->send_updates();
       }
    }
 
+   size_t slave::pending_updates() const
+   {
+      return __atomic_load_n(&pending_updates_, __ATOMIC_RELAXED);
+   }
+
+   void slave::send_updates()
+   {
+      frame_.pack(update_queue_);
+      asio::async_write(
+         socket_,
+         frame_.buffer(),
+         boost::bind(&slave::handle_write_update, this, asio::placeholders::error)
+      );
+   }
+
    void slave::handle_write_update(const asio::error_code& error)
    {
       if (!error)
       {
-         // We're done with the front most item, discard it
-         update_queue_.pop_front();
+         // We're done with the framed items, discard them
+         if (spool_) {
+            spool_->delivered(frame_.size(), update_queue_);
+         } else {
+            update_queue_.erase(update_queue_.begin(), update_queue_.begin() + frame_.size());
+         }
+         __atomic_fetch_sub(&pending_updates_, frame_.size(), __ATOMIC_RELAXED);
+         frame_.clear();
          
-         // If there is more to do then we send the next one
+         // If there is more to do then we send the next frame
          if (connected_ && !update_queue_.empty())
          {
             syslog_.debug() << "Sending " << (unsigned int) update_queue_.size() << " queued updates to the master database.";
 
-            asio::async_write(
-               socket_,
-               asio::buffer((void*) &(update_queue_.front()), sizeof(update)),
-               boost::bind(&slave::handle_write_update, this, asio::placeholders::error)
-            );
+            this->send_updates();
          }
       }
       else
       {
          syslog_.error() << "Could not send update to the master database; retrying after 5 seconds.";
+         frame_.clear();
          socket_.close();
          connected_ = false;
          
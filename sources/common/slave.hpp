@@ -15,6 +15,8 @@
 #include <db.h>
 
 #include "update.hpp"
+#include "update_frame.hpp"
+#include "update_spool.hpp"
 #include "record.hpp"
 #include "syslog.hpp"
 
@@ -40,7 +42,7 @@ namespace pyzor {
             public:
                
                void start();
-               void handle_read(const asio::error_code& error);
+               void handle_read(const asio::error_code& error, size_t bytes_transferred);
 
                void write_ping();
                void handle_write_ping(const asio::error_code& error);
@@ -49,7 +51,8 @@ namespace pyzor {
 
                asio::ip::tcp::socket socket_;
                pyzor::syslog& syslog_;
-               pyzor::update incoming_update_;
+               pyzor::update_reader reader_;
+               std::vector<pyzor::update> incoming_updates_;
                pyzor::slave& slave_;
                asio::deadline_timer ping_timer_;
                bool connected_;
@@ -74,6 +77,22 @@ namespace pyzor {
          void run();
          void stop();
 
+         /// The replicated environment and database, for a server that runs in the same process.
+         /// They are opened free-threaded and stay valid until the slave is destroyed.
+         DB_ENV* environment();
+         DB* db();
+
+         /// Queue an update for the master. Only call this from the io_service thread.
+         void write_update(update u);
+
+         /// Updates that were queued for the master but not written yet, on disk and in memory.
+         /// Safe to call from any thread.
+         size_t pending_updates() const;
+
+         /// Journal the updates for the master in a directory, keeping at most memory_limit of them
+         /// in memory. Updates that were left there by the previous run are sent first.
+         void enable_spool(boost::filesystem::path const& path, size_t memory_limit);
+
       private:
 
          void handle_stop();
@@ -95,8 +114,10 @@ namespace pyzor {
 
          void connect();
          void handle_connect(const asio::error_code& error);
-         void write_update(update u);
+         void send_updates();
          void handle_write_update(const asio::error_code& error);
+         void schedule_spool_sync();
+         void handle_spool_sync(const asio::error_code& error);
          
       private:
 
@@ -117,8 +138,13 @@ namespace pyzor {
 
          asio::ip::tcp::socket socket_;
          update_queue update_queue_;
+         update_frame frame_;
+         enum { spool_sync_interval = 1 };
+         boost::shared_ptr<update_spool> spool_;
+         asio::deadline_timer spool_timer_;
          asio::deadline_timer connect_timer_;
          bool connected_;
+         size_t pending_updates_;
          
    };
 
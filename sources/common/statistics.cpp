@@ -13,24 +13,30 @@ namespace pyzor {
    
    void statistics_ring::report()
    {
-      total_++;
+      __atomic_store_n(&total_, total_ + 1, __ATOMIC_RELAXED);
       advance();
-      current_->count++;
+      __atomic_store_n(&current_->count, current_->count + 1, __ATOMIC_RELAXED);
    }
    
-   boost::uint64_t statistics_ring::average()
+   // Only the owning thread writes the ring, but other threads read it while it does, so every
+   // field is read and written atomically. Readers simply skip buckets that fell out of the
+   // window, which lets them merge the rings of several worker threads.
+
+   boost::uint64_t statistics_ring::average() const
    {
-      advance();
+      time_t now = time(NULL);
       boost::uint64_t total = 0;
       for (size_t i = 0; i < buckets_.size(); i++) {
-         total += buckets_[i].count;
+         if (now - __atomic_load_n(&buckets_[i].time, __ATOMIC_ACQUIRE) < (time_t) buckets_.size()) {
+            total += __atomic_load_n(&buckets_[i].count, __ATOMIC_RELAXED);
+         }
       }
       return (total / buckets_.size());
    }
 
-   boost::uint64_t statistics_ring::total()
+   boost::uint64_t statistics_ring::total() const
    {
-      return total_;
+      return __atomic_load_n(&total_, __ATOMIC_RELAXED);
    }
 
    void statistics_ring::advance()
@@ -43,10 +49,59 @@ namespace pyzor {
             if (current_ == buckets_.end()) {
                current_ = buckets_.begin();
             }
-            current_->count = 0;
-            current_->time = t;
+            __atomic_store_n(&current_->count, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&current_->time, t, __ATOMIC_RELEASE);
          }
       }
    }
 
+   //
+
+   latency_histogram::latency_histogram()
+      : count_(0), sum_(0)
+   {
+      for (size_t i = 0; i < buckets; i++) {
+         counts_[i] = 0;
+      }
+   }
+
+   void latency_histogram::report(boost::uint64_t usec)
+   {
+      size_t bucket = 0;
+      while (bucket < buckets - 1 && ((boost::uint64_t) 1 << bucket) < usec) {
+         bucket++;
+      }
+
+      __atomic_fetch_add(&counts_[bucket], 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&count_, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&sum_, usec, __ATOMIC_RELAXED);
+   }
+
+   boost::uint64_t latency_histogram::average() const
+   {
+      boost::uint64_t count = __atomic_load_n(&count_, __ATOMIC_RELAXED);
+      return (count == 0) ? 0 : (__atomic_load_n(&sum_, __ATOMIC_RELAXED) / count);
+   }
+
+   boost::uint64_t latency_histogram::percentile(unsigned int percent) const
+   {
+      boost::uint64_t counts[buckets];
+      boost::uint64_t count = 0;
+      for (size_t i = 0; i < buckets; i++) {
+         counts[i] = __atomic_load_n(&counts_[i], __ATOMIC_RELAXED);
+         count += counts[i];
+      }
+
+      boost::uint64_t rank = (count * percent + 99) / 100;
+      boost::uint64_t seen = 0;
+      for (size_t i = 0; i < buckets; i++) {
+         seen += counts[i];
+         if (seen >= rank && seen != 0) {
+            return (boost::uint64_t) 1 << i;
+         }
+      }
+
+      return 0;
+   }
+
 }
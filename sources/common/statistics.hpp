@@ -17,8 +17,8 @@ namespace pyzor  {
       public:
 
          void report();
-         boost::uint64_t average();
-         boost::uint64_t total();
+         boost::uint64_t average() const;
+         boost::uint64_t total() const;
 
       private:
 
@@ -60,6 +60,32 @@ namespace pyzor  {
          std::vector<bucket>::iterator current_;
          boost::uint64_t total_;
    };
+
+   /// Latencies in microseconds, counted in power of two buckets. Any thread can report; the
+   /// percentiles are rounded up to the bucket boundary.
+
+   class latency_histogram
+   {
+      public:
+
+         enum { buckets = 32 };
+
+      public:
+
+         latency_histogram();
+
+      public:
+
+         void report(boost::uint64_t usec);
+         boost::uint64_t average() const;
+         boost::uint64_t percentile(unsigned int percent) const;
+
+      private:
+
+         boost::uint64_t counts_[buckets];
+         boost::uint64_t count_;
+         boost::uint64_t sum_;
+   };
    
 }
 
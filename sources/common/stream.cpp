@@ -0,0 +1,266 @@
+// stream.cpp
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include <boost/bind.hpp>
+
+#include "stream.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      const size_t length_size = sizeof(boost::uint32_t);
+
+   }
+
+   /// Connection
+
+   stream_connection::stream_connection(asio::io_service& io_service, request_handler handler)
+      : socket_(io_service), handler_(handler), input_(8 * (length_size + max_request_size)), input_length_(0),
+        reading_(false), closed_(false)
+   {
+   }
+
+   asio::ip::tcp::socket& stream_connection::socket()
+   {
+      return socket_;
+   }
+
+   void stream_connection::start()
+   {
+      asio::error_code error;
+      asio::ip::tcp::endpoint peer = socket_.remote_endpoint(error);
+      if (!error) {
+         peer_ = asio::ip::udp::endpoint(peer.address(), peer.port());
+      }
+
+      // Replies are small and written as soon as they are ready
+      socket_.set_option(asio::ip::tcp::no_delay(true), error);
+
+      this->start_read();
+   }
+
+   void stream_connection::close()
+   {
+      if (!closed_) {
+         closed_ = true;
+         asio::error_code error;
+         socket_.close(error);
+      }
+   }
+
+   void stream_connection::start_read()
+   {
+      reading_ = true;
+      socket_.async_read_some(
+         asio::buffer(&input_[input_length_], input_.size() - input_length_),
+         boost::bind(&stream_connection::handle_read, shared_from_this(), asio::placeholders::error,
+            asio::placeholders::bytes_transferred)
+      );
+   }
+
+   void stream_connection::handle_read(const asio::error_code& error, size_t bytes_transferred)
+   {
+      reading_ = false;
+
+      if (error || closed_) {
+         this->close();
+         return;
+      }
+
+      input_length_ += bytes_transferred;
+
+      if (!this->process_requests()) {
+         this->close();
+         return;
+      }
+
+      if (writing_.empty() && !output_.empty()) {
+         this->start_write();
+      }
+
+      // Let TCP push back on the client while the replies pile up
+
+      if (output_.size() < max_pending_output) {
+         this->start_read();
+      }
+   }
+
+   bool stream_connection::process_requests()
+   {
+      size_t offset = 0;
+
+      while (input_length_ - offset >= length_size) {
+         boost::uint32_t length;
+         memcpy(&length, &input_[offset], length_size);
+         length = ntohl(length);
+
+         if (length == 0 || length > max_request_size) {
+            return false;
+         }
+
+         if (input_length_ - offset < length_size + length) {
+            break;
+         }
+
+         char reply[max_request_size];
+         size_t reply_length = handler_(&input_[offset + length_size], length, reply, sizeof(reply), peer_);
+
+         boost::uint32_t prefix = htonl((boost::uint32_t) reply_length);
+         output_.insert(output_.end(), (char*) &prefix, (char*) &prefix + length_size);
+         output_.insert(output_.end(), reply, reply + reply_length);
+
+         offset += length_size + length;
+      }
+
+      // Keep the partial request at the front of the buffer
+
+      if (offset != 0) {
+         memmove(&input_[0], &input_[offset], input_length_ - offset);
+         input_length_ -= offset;
+      }
+
+      return true;
+   }
+
+   void stream_connection::start_write()
+   {
+      writing_.swap(output_);
+      asio::async_write(
+         socket_,
+         asio::buffer(writing_),
+         boost::bind(&stream_connection::handle_write, shared_from_this(), asio::placeholders::error,
+            asio::placeholders::bytes_transferred)
+      );
+   }
+
+   void stream_connection::handle_write(const asio::error_code& error, size_t bytes_transferred)
+   {
+      writing_.clear();
+
+      if (error || closed_) {
+         this->close();
+         return;
+      }
+
+      if (!output_.empty()) {
+         this->start_write();
+      }
+
+      if (!reading_ && output_.size() < max_pending_output) {
+         this->start_read();
+      }
+   }
+
+   /// Listener
+
+   stream_listener::stream_listener(pyzor::syslog& syslog, asio::io_service& io_service, asio::ip::tcp::endpoint const& endpoint)
+      : syslog_(syslog), acceptor_(io_service, endpoint, true), accept_timer_(io_service), next_target_(0)
+   {
+   }
+
+   stream_listener::stream_listener(pyzor::syslog& syslog, asio::io_service& io_service, asio::ip::tcp::endpoint const& endpoint, int native)
+      : syslog_(syslog), acceptor_(io_service), accept_timer_(io_service), next_target_(0)
+   {
+      acceptor_.assign(endpoint.protocol(), native);
+   }
+
+   stream_listener::~stream_listener()
+   {
+      this->stop();
+   }
+
+   void stream_listener::add_target(asio::io_service& io_service, stream_connection::request_handler handler)
+   {
+      target t;
+      t.io_service = &io_service;
+      t.handler = handler;
+      targets_.push_back(t);
+   }
+
+   void stream_listener::start()
+   {
+      this->start_accept();
+   }
+
+   void stream_listener::stop()
+   {
+      this->stop_accepting();
+
+      // Connections are closed on their own threads
+
+      for (size_t i = 0; i < connections_.size(); i++) {
+         stream_connection_ptr connection = connections_[i].lock();
+         if (connection) {
+            connection->socket().get_io_service().post(boost::bind(&stream_connection::close, connection));
+         }
+      }
+      connections_.clear();
+   }
+
+   void stream_listener::stop_accepting()
+   {
+      asio::error_code error;
+      acceptor_.close(error);
+      accept_timer_.cancel();
+   }
+
+   int stream_listener::native()
+   {
+      return acceptor_.is_open() ? acceptor_.native() : -1;
+   }
+
+   void stream_listener::start_accept()
+   {
+      target& t = targets_[next_target_];
+      next_target_ = (next_target_ + 1) % targets_.size();
+
+      stream_connection_ptr connection(new stream_connection(*t.io_service, t.handler));
+      acceptor_.async_accept(
+         connection->socket(),
+         boost::bind(&stream_listener::handle_accept, this, connection, asio::placeholders::error)
+      );
+   }
+
+   void stream_listener::handle_accept(stream_connection_ptr connection, const asio::error_code& error)
+   {
+      if (error == asio::error::operation_aborted || !acceptor_.is_open()) {
+         return;
+      }
+
+      if (!error) {
+         // Forget the connections that have gone away in the meantime
+
+         std::vector< boost::weak_ptr<stream_connection> > connections;
+         for (size_t i = 0; i < connections_.size(); i++) {
+            if (!connections_[i].expired()) {
+               connections.push_back(connections_[i]);
+            }
+         }
+         connections.push_back(connection);
+         connections_.swap(connections);
+
+         connection->socket().get_io_service().post(boost::bind(&stream_connection::start, connection));
+      } else {
+         // Accepting again right away would spin as long as the error lasts
+
+         syslog_.error() << "Cannot accept a stream connection: " << error.message();
+         accept_timer_.expires_from_now(boost::posix_time::milliseconds((long) accept_retry_delay));
+         accept_timer_.async_wait(boost::bind(&stream_listener::handle_accept_timeout, this, asio::placeholders::error));
+         return;
+      }
+
+      this->start_accept();
+   }
+
+   void stream_listener::handle_accept_timeout(const asio::error_code& error)
+   {
+      if (!error && acceptor_.is_open()) {
+         this->start_accept();
+      }
+   }
+
+}
@@ -0,0 +1,125 @@
+// stream.hpp
+
+#ifndef PYZOR_STREAM_HPP
+#define PYZOR_STREAM_HPP
+
+#include <vector>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <asio.hpp>
+
+#include "syslog.hpp"
+
+namespace pyzor {
+
+   /// Pyzor requests over a persistent TCP connection. Every request and every reply is preceded by
+   /// its length as a 4 byte integer in network byte order. A client can send many requests without
+   /// waiting; the replies come back in the same order. Requests go through the same handler as the
+   /// datagrams, with the peer address passed as a UDP endpoint.
+
+   class stream_connection : public boost::enable_shared_from_this<stream_connection>, boost::noncopyable
+   {
+      public:
+
+         typedef boost::function<size_t (const char* data, size_t length, char* response, size_t response_size,
+            asio::ip::udp::endpoint const& sender_endpoint)> request_handler;
+
+         /// Stop reading while this much output is waiting for the peer to read it
+         enum { max_request_size = 8192, max_pending_output = 256 * 1024 };
+
+      public:
+
+         stream_connection(asio::io_service& io_service, request_handler handler);
+
+      public:
+
+         asio::ip::tcp::socket& socket();
+
+         void start();
+         void close();
+
+      private:
+
+         void start_read();
+         void handle_read(const asio::error_code& error, size_t bytes_transferred);
+         bool process_requests();
+
+         void start_write();
+         void handle_write(const asio::error_code& error, size_t bytes_transferred);
+
+      private:
+
+         asio::ip::tcp::socket socket_;
+         request_handler handler_;
+         asio::ip::udp::endpoint peer_;
+
+         std::vector<char> input_;
+         size_t input_length_;
+         std::vector<char> output_;
+         std::vector<char> writing_;
+         bool reading_;
+         bool closed_;
+   };
+
+   typedef boost::shared_ptr<stream_connection> stream_connection_ptr;
+
+   /// Accepts stream connections and hands them out in turn to the io_services that were added as
+   /// targets; a connection is then served on the thread that runs its io_service.
+
+   class stream_listener : boost::noncopyable
+   {
+      public:
+
+         stream_listener(pyzor::syslog& syslog, asio::io_service& io_service, asio::ip::tcp::endpoint const& endpoint);
+         /// Accept on a socket that is already bound and listening
+         stream_listener(pyzor::syslog& syslog, asio::io_service& io_service, asio::ip::tcp::endpoint const& endpoint, int native);
+         ~stream_listener();
+
+      public:
+
+         void add_target(asio::io_service& io_service, stream_connection::request_handler handler);
+
+         void start();
+         void stop();
+         /// Close the listening socket but keep serving the connections that are open
+         void stop_accepting();
+
+         /// The listening socket, or -1 once the listener is stopped
+         int native();
+
+      private:
+
+         struct target
+         {
+            public:
+
+               asio::io_service* io_service;
+               stream_connection::request_handler handler;
+         };
+
+      private:
+
+         void start_accept();
+         void handle_accept(stream_connection_ptr connection, const asio::error_code& error);
+         void handle_accept_timeout(const asio::error_code& error);
+
+      private:
+
+         /// Wait before accepting again after an error such as running out of file descriptors
+         enum { accept_retry_delay = 100 };
+
+         pyzor::syslog& syslog_;
+         asio::ip::tcp::acceptor acceptor_;
+         asio::deadline_timer accept_timer_;
+         std::vector<target> targets_;
+         size_t next_target_;
+         std::vector< boost::weak_ptr<stream_connection> > connections_;
+   };
+
+}
+
+#endif // PYZOR_STREAM_HPP
@@ -0,0 +1,97 @@
+// unix_socket.cpp
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#include "unix_socket.hpp"
+
+namespace pyzor {
+
+   unix_endpoint::unix_endpoint()
+      : size_(offsetof(sockaddr_un, sun_path))
+   {
+      memset(&data_, 0, sizeof(data_));
+      data_.sun_family = AF_UNIX;
+   }
+
+   unix_endpoint::unix_endpoint(std::string const& path)
+      : size_(offsetof(sockaddr_un, sun_path))
+   {
+      if (path.length() >= sizeof(data_.sun_path)) {
+         throw std::runtime_error(std::string("Unix socket path is too long: ") + path);
+      }
+
+      memset(&data_, 0, sizeof(data_));
+      data_.sun_family = AF_UNIX;
+      memcpy(data_.sun_path, path.c_str(), path.length());
+      size_ += path.length() + 1;
+   }
+
+   unix_endpoint::protocol_type unix_endpoint::protocol() const
+   {
+      return unix_datagram();
+   }
+
+   unix_endpoint::data_type* unix_endpoint::data()
+   {
+      return reinterpret_cast<data_type*>(&data_);
+   }
+
+   const unix_endpoint::data_type* unix_endpoint::data() const
+   {
+      return reinterpret_cast<const data_type*>(&data_);
+   }
+
+   std::size_t unix_endpoint::size() const
+   {
+      return size_;
+   }
+
+   void unix_endpoint::resize(std::size_t size)
+   {
+      size_ = (size > sizeof(data_)) ? sizeof(data_) : size;
+   }
+
+   std::size_t unix_endpoint::capacity() const
+   {
+      return sizeof(data_);
+   }
+
+   bool unix_endpoint::unnamed() const
+   {
+      return size_ <= offsetof(sockaddr_un, sun_path);
+   }
+
+   std::string unix_endpoint::path() const
+   {
+      if (this->unnamed()) {
+         return std::string();
+      }
+      return std::string(data_.sun_path, strnlen(data_.sun_path, size_ - offsetof(sockaddr_un, sun_path)));
+   }
+
+   void bind_unix_socket(unix_datagram::socket& socket, std::string const& path, mode_t mode)
+   {
+      // Only replace what is left of an earlier run
+
+      struct stat st;
+      if (::lstat(path.c_str(), &st) == 0) {
+         if (!S_ISSOCK(st.st_mode)) {
+            throw std::runtime_error(std::string("Not a socket: ") + path);
+         }
+         ::unlink(path.c_str());
+      }
+
+      socket.open(unix_datagram());
+      socket.bind(unix_endpoint(path));
+
+      if (::chmod(path.c_str(), mode) != 0) {
+         throw std::runtime_error(std::string("Cannot change the mode of ") + path);
+      }
+   }
+
+}
@@ -0,0 +1,74 @@
+// unix_socket.hpp
+
+#ifndef PYZOR_UNIX_SOCKET_HPP
+#define PYZOR_UNIX_SOCKET_HPP
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+#include <asio.hpp>
+
+namespace pyzor {
+
+   class unix_datagram;
+
+   /// A Unix domain socket address, usable as an asio endpoint. A peer that did not bind its socket
+   /// has no address and cannot be answered.
+
+   class unix_endpoint
+   {
+      public:
+
+         typedef unix_datagram protocol_type;
+         typedef asio::detail::socket_addr_type data_type;
+
+      public:
+
+         unix_endpoint();
+         unix_endpoint(std::string const& path);
+
+      public:
+
+         protocol_type protocol() const;
+
+         data_type* data();
+         const data_type* data() const;
+         std::size_t size() const;
+         void resize(std::size_t size);
+         std::size_t capacity() const;
+
+         bool unnamed() const;
+         std::string path() const;
+
+      private:
+
+         sockaddr_un data_;
+         std::size_t size_;
+   };
+
+   /// Datagrams over Unix domain sockets, for use with asio::basic_datagram_socket.
+
+   class unix_datagram
+   {
+      public:
+
+         typedef unix_endpoint endpoint;
+         typedef asio::basic_datagram_socket<unix_datagram> socket;
+
+      public:
+
+         int type() const { return SOCK_DGRAM; }
+         int protocol() const { return 0; }
+         int family() const { return AF_UNIX; }
+   };
+
+   /// Bind a socket to path, replacing a stale socket file, and give the file the mode. The mode
+   /// decides who may talk to the server, so requests on it are trusted like local admin requests.
+   void bind_unix_socket(unix_datagram::socket& socket, std::string const& path, mode_t mode);
+
+}
+
+#endif // PYZOR_UNIX_SOCKET_HPP
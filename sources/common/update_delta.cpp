@@ -0,0 +1,124 @@
+// update_delta.cpp
+
+#include <time.h>
+
+#include "update_delta.hpp"
+
+namespace pyzor {
+
+   /// Phase
+
+   update_delta::phase::phase()
+      : reports(0), report_first(0), report_latest(0), whitelists(0), whitelist_first(0), whitelist_latest(0),
+        whitelisted_first(false)
+   {
+   }
+
+   void update_delta::phase::add(update::update_type type, boost::uint32_t time)
+   {
+      if (type == update::report) {
+         if (reports == 0) {
+            report_first = report_latest = time;
+         } else if (time > report_latest) {
+            report_latest = time;
+         }
+         reports++;
+      } else {
+         if (whitelists == 0) {
+            whitelisted_first = (reports == 0);
+            whitelist_first = whitelist_latest = time;
+         } else if (time > whitelist_latest) {
+            whitelist_latest = time;
+         }
+         whitelists++;
+      }
+   }
+
+   void update_delta::phase::keep_first(phase const& later)
+   {
+      if (this->empty()) {
+         whitelisted_first = later.whitelisted_first;
+      }
+
+      if (reports == 0 && later.reports != 0) {
+         reports = 1;
+         report_first = report_latest = later.report_first;
+      }
+
+      if (whitelists == 0 && later.whitelists != 0) {
+         whitelists = 1;
+         whitelist_first = whitelist_latest = later.whitelist_first;
+      }
+   }
+
+   void update_delta::phase::replay(record& r) const
+   {
+      // The first update of the phase decides the entered time of the record
+
+      if (whitelisted_first) {
+         r.whitelist(whitelist_first);
+      }
+
+      if (reports != 0) {
+         r.report(report_first);
+         if (reports > 1) {
+            r.report(report_latest);
+            r.report_count(r.report_count() + reports - 2);
+         }
+      }
+
+      if (whitelists != 0) {
+         if (!whitelisted_first) {
+            r.whitelist(whitelist_first);
+         }
+         if (whitelists > 1) {
+            r.whitelist(whitelist_latest);
+            r.whitelist_count(r.whitelist_count() + whitelists - 2);
+         }
+      }
+   }
+
+   bool update_delta::phase::empty() const
+   {
+      return reports == 0 && whitelists == 0;
+   }
+
+   /// Update Delta
+
+   update_delta::update_delta()
+      : reset_(false), reset_time_(0), updates_(0)
+   {
+   }
+
+   void update_delta::add(update const& u)
+   {
+      // The master resets a record at the time it processes the erase, not at the time of the update
+
+      if (u.type() == update::erase) {
+         before_.keep_first(after_);
+         after_ = phase();
+         reset_ = true;
+         reset_time_ = ::time(NULL);
+      } else {
+         after_.add(u.type(), u.time() != 0 ? u.time() : ::time(NULL));
+      }
+
+      updates_++;
+   }
+
+   void update_delta::apply(record& r) const
+   {
+      if (reset_) {
+         before_.replay(r);
+         r.reset(reset_time_);
+      }
+
+      after_.replay(r);
+   }
+
+   boost::uint32_t update_delta::updates() const
+   {
+      return updates_;
+   }
+
+}
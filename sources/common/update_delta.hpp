@@ -0,0 +1,74 @@
+// update_delta.hpp
+
+#ifndef PYZOR_UPDATE_DELTA_HPP
+#define PYZOR_UPDATE_DELTA_HPP
+
+#include <boost/cstdint.hpp>
+
+#include "record.hpp"
+#include "update.hpp"
+
+namespace pyzor {
+
+   /// The combined effect of a run of updates to one digest. Applying the delta to a record gives
+   /// the same record as applying the updates one by one: only the counts, the first time and the
+   /// latest time of each kind matter, and a reset throws away everything before it except the
+   /// times at which the record and its counts were first entered.
+   ///
+   /// That relies on a record with no report_entered time never having a report_updated time,
+   /// which holds for every record that was only changed through report, whitelist and reset.
+
+   struct update_delta
+   {
+      public:
+
+         update_delta();
+
+      public:
+
+         void add(update const& u);
+         void apply(record& r) const;
+
+         /// The number of updates that were added
+         boost::uint32_t updates() const;
+
+      private:
+
+         struct phase
+         {
+            public:
+
+               phase();
+
+            public:
+
+               void add(update::update_type type, boost::uint32_t time);
+               /// Keep the first times of a later phase for the kinds this one has not seen
+               void keep_first(phase const& later);
+               void replay(record& r) const;
+               bool empty() const;
+
+            public:
+
+               boost::uint32_t reports;
+               boost::uint32_t report_first;
+               boost::uint32_t report_latest;
+               boost::uint32_t whitelists;
+               boost::uint32_t whitelist_first;
+               boost::uint32_t whitelist_latest;
+               bool whitelisted_first;
+         };
+
+      private:
+
+         // Before the last reset only the first times are kept
+         phase before_;
+         bool reset_;
+         boost::uint32_t reset_time_;
+         phase after_;
+         boost::uint32_t updates_;
+   };
+
+}
+
+#endif // PYZOR_UPDATE_DELTA_HPP
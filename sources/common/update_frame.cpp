@@ -0,0 +1,209 @@
+// update_frame.cpp
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "update_frame.hpp"
+
+namespace pyzor {
+
+   namespace frame {
+
+      const boost::uint32_t magic = 0x505a5546; // "PZUF"
+
+      boost::uint32_t checksum(const void* data, size_t length, boost::uint32_t sum)
+      {
+         // FNV-1a
+
+         const unsigned char* p = (const unsigned char*) data;
+         for (size_t i = 0; i < length; i++) {
+            sum = (sum ^ p[i]) * 16777619u;
+         }
+         return sum;
+      }
+
+   }
+
+   namespace {
+
+      boost::uint32_t read32(const char* p)
+      {
+         boost::uint32_t v;
+         memcpy(&v, p, sizeof(v));
+         return ntohl(v);
+      }
+
+      boost::uint16_t read16(const char* p)
+      {
+         boost::uint16_t v;
+         memcpy(&v, p, sizeof(v));
+         return ntohs(v);
+      }
+
+      void write32(char* p, boost::uint32_t v)
+      {
+         v = htonl(v);
+         memcpy(p, &v, sizeof(v));
+      }
+
+      void write16(char* p, boost::uint16_t v)
+      {
+         v = htons(v);
+         memcpy(p, &v, sizeof(v));
+      }
+
+      /// The number of updates in the frame that starts at p, or zero if the header is not valid
+      size_t frame_count(const char* p)
+      {
+         size_t count = read16(p + 6);
+         if (read32(p) != frame::magic || read16(p + 4) != frame::version || count > frame::max_updates) {
+            return 0;
+         }
+         return count;
+      }
+
+   }
+
+   /// Update Frame
+
+   update_frame::update_frame()
+      : size_(0)
+   {
+      data_.reserve(frame::header_size + frame::max_updates * sizeof(update));
+   }
+
+   size_t update_frame::pack(update_queue const& queue)
+   {
+      size_ = queue.size() < (size_t) frame::max_updates ? queue.size() : (size_t) frame::max_updates;
+
+      data_.resize(frame::header_size + size_ * sizeof(update));
+      for (size_t i = 0; i < size_; i++) {
+         memcpy(&data_[frame::header_size + i * sizeof(update)], &queue[i], sizeof(update));
+      }
+
+      write32(&data_[0], frame::magic);
+      write16(&data_[4], frame::version);
+      write16(&data_[6], size_);
+      write32(&data_[8], frame::checksum(&data_[frame::header_size], size_ * sizeof(update)));
+
+      return size_;
+   }
+
+   void update_frame::clear()
+   {
+      size_ = 0;
+   }
+
+   size_t update_frame::size() const
+   {
+      return size_;
+   }
+
+   asio::const_buffers_1 update_frame::buffer() const
+   {
+      return asio::buffer(&data_[0], data_.size());
+   }
+
+   /// Update Reader
+
+   update_reader::update_reader(size_t capacity)
+      : buffer_(capacity), begin_(0), end_(0), format_(format_unknown)
+   {
+      // A whole frame must fit
+      if (buffer_.size() < frame::header_size + frame::max_updates * sizeof(update)) {
+         buffer_.resize(frame::header_size + frame::max_updates * sizeof(update));
+      }
+   }
+
+   asio::mutable_buffers_1 update_reader::buffer()
+   {
+      return asio::buffer(&buffer_[end_], buffer_.size() - end_);
+   }
+
+   bool update_reader::consume(size_t length, std::vector<update>& updates)
+   {
+      end_ += length;
+
+      if (!this->parse(updates)) {
+         return false;
+      }
+
+      // Keep the start of the next update or frame at the front of the buffer
+
+      if (begin_ != 0) {
+         memmove(&buffer_[0], &buffer_[begin_], end_ - begin_);
+         end_ -= begin_;
+         begin_ = 0;
+      }
+
+      return true;
+   }
+
+   bool update_reader::framed() const
+   {
+      return format_ == format_framed;
+   }
+
+   bool update_reader::parse(std::vector<update>& updates)
+   {
+      for (;;) {
+         const char* p = &buffer_[begin_];
+         size_t available = end_ - begin_;
+
+         // A bare stream starts with a digest, which may start with the magic as well; only a
+         // whole first frame that checks out makes the stream framed
+
+         if (format_ == format_unknown) {
+            if (available < frame::header_size) {
+               return true;
+            }
+
+            size_t count = frame_count(p);
+            if (count == 0) {
+               format_ = format_bare;
+            } else {
+               if (available < frame::header_size + count * sizeof(update)) {
+                  return true;
+               }
+               bool valid = frame::checksum(p + frame::header_size, count * sizeof(update)) == read32(p + 8);
+               format_ = valid ? format_framed : format_bare;
+            }
+         }
+
+         if (format_ == format_bare) {
+            if (available < sizeof(update)) {
+               return true;
+            }
+            updates.resize(updates.size() + 1);
+            memcpy(&updates.back(), p, sizeof(update));
+            begin_ += sizeof(update);
+            continue;
+         }
+
+         if (available < frame::header_size) {
+            return true;
+         }
+
+         size_t count = frame_count(p);
+         if (count == 0) {
+            return false;
+         }
+
+         size_t length = frame::header_size + count * sizeof(update);
+         if (available < length) {
+            return true;
+         }
+
+         if (frame::checksum(p + frame::header_size, count * sizeof(update)) != read32(p + 8)) {
+            return false;
+         }
+
+         size_t first = updates.size();
+         updates.resize(first + count);
+         memcpy(&updates[first], p + frame::header_size, count * sizeof(update));
+         begin_ += length;
+      }
+   }
+
+}
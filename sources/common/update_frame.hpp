@@ -0,0 +1,96 @@
+// update_frame.hpp
+
+#ifndef PYZOR_UPDATE_FRAME_HPP
+#define PYZOR_UPDATE_FRAME_HPP
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <asio.hpp>
+
+#include "update.hpp"
+
+namespace pyzor {
+
+   /// Updates travel from the servers to the slave and on to the master in frames: a header with
+   /// the number of updates and a checksum over them, followed by the packed updates. Peers that
+   /// predate the frames send bare updates; a receiver tells them apart by the first frame of the
+   /// connection, which must check out as a whole.
+
+   namespace frame {
+
+      enum { version = 1, header_size = 12, max_updates = 1024 };
+
+      extern const boost::uint32_t magic;
+
+      boost::uint32_t checksum(const void* data, size_t length, boost::uint32_t sum = 2166136261u);
+
+   }
+
+   /// Packs the updates at the front of a queue into a frame so that they go out in one write.
+   /// The updates stay in the queue until the write is done.
+
+   class update_frame : boost::noncopyable
+   {
+      public:
+
+         update_frame();
+
+      public:
+
+         /// Frame up to frame::max_updates updates from the front of the queue
+         size_t pack(update_queue const& queue);
+         void clear();
+
+         /// The number of updates in the frame; zero when nothing is being written
+         size_t size() const;
+         asio::const_buffers_1 buffer() const;
+
+      private:
+
+         std::vector<char> data_;
+         size_t size_;
+   };
+
+   /// Collects the bytes of an update stream, in frames or bare, and hands out the complete
+   /// updates after every read.
+
+   class update_reader : boost::noncopyable
+   {
+      public:
+
+         enum { default_capacity = 64 * 1024 };
+
+      public:
+
+         update_reader(size_t capacity = default_capacity);
+
+      public:
+
+         /// The free space to read into
+         asio::mutable_buffers_1 buffer();
+
+         /// Take in the bytes that were read into the buffer and append the complete updates.
+         /// Returns false if the stream is damaged and the connection should be dropped.
+         bool consume(size_t length, std::vector<update>& updates);
+
+         bool framed() const;
+
+      private:
+
+         enum format { format_unknown, format_bare, format_framed };
+
+         bool parse(std::vector<update>& updates);
+
+      private:
+
+         std::vector<char> buffer_;
+         size_t begin_;
+         size_t end_;
+         format format_;
+   };
+
+}
+
+#endif // PYZOR_UPDATE_FRAME_HPP
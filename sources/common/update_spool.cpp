@@ -0,0 +1,306 @@
+// update_spool.cpp
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "update_spool.hpp"
+
+namespace pyzor {
+
+   namespace {
+
+      const char spool_magic[8] = { 'P', 'Y', 'Z', 'O', 'R', 'S', 'P', 'L' };
+
+      void fail(std::string const& what, boost::filesystem::path const& path)
+      {
+         throw std::runtime_error(what + " " + path.string() + ": " + strerror(errno));
+      }
+
+      /// Returns an errno value
+      int reserve(int fd, off_t size)
+      {
+#if defined(__linux__)
+         return posix_fallocate(fd, 0, size);
+#else
+         return ftruncate(fd, size) == 0 ? 0 : errno;
+#endif
+      }
+
+      void flush(int fd)
+      {
+#if defined(__linux__)
+         (void) fdatasync(fd);
+#else
+         (void) fsync(fd);
+#endif
+      }
+
+   }
+
+   update_spool::update_spool(boost::filesystem::path const& directory, size_t memory_limit, update_queue& queue)
+      : directory_(directory), memory_limit_(memory_limit > 0 ? memory_limit : 1), delivered_(0), loaded_(0), appended_(0),
+        head_index_(0), head_fd_(-1), head_dirty_(false), tail_index_(0), tail_fd_(-1), tail_(NULL)
+   {
+      if (!boost::filesystem::exists(directory_)) {
+         boost::filesystem::create_directory(directory_);
+      }
+
+      // Segments are named after their index; the oldest one is the head, the newest the tail
+
+      bool found = false;
+      boost::uint64_t first = 0, last = 0;
+
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator i(directory_); i != end; ++i) {
+         unsigned long long index;
+         char extra;
+         std::string name = i->path().string();
+         name = name.substr(name.rfind('/') + 1);
+         if (name.length() == 22 && sscanf(name.c_str(), "%16llx.spool%c", &index, &extra) == 1) {
+            if (!found || index < first) {
+               first = index;
+            }
+            if (!found || index > last) {
+               last = index;
+            }
+            found = true;
+         }
+      }
+
+      this->open_tail(last, !found);
+      this->open_head(first);
+
+      appended_ = tail_index_ * capacity() + ((header*) tail_)->count;
+
+      header h;
+      if (pread(head_fd_, &h, sizeof(h), 0) != (ssize_t) sizeof(h)) {
+         fail("Cannot read the spool segment", this->segment_path(head_index_));
+      }
+      delivered_ = loaded_ = head_index_ * capacity() + h.delivered;
+
+      this->load(queue);
+   }
+
+   update_spool::~update_spool()
+   {
+      this->sync();
+      this->close_head();
+      this->close_tail();
+   }
+
+   void update_spool::push(update const& u, update_queue& queue)
+   {
+      header* h = (header*) tail_;
+      if (h->count == capacity()) {
+         this->open_tail(tail_index_ + 1, true);
+         h = (header*) tail_;
+      }
+
+      memcpy(tail_ + header_size + h->count * sizeof(update), &u, sizeof(update));
+      h->count++;
+      appended_++;
+
+      if (loaded_ + 1 == appended_ && queue.size() < memory_limit_) {
+         queue.push_back(u);
+         loaded_++;
+      }
+   }
+
+   void update_spool::delivered(size_t n, update_queue& queue)
+   {
+      queue.erase(queue.begin(), queue.begin() + n);
+      delivered_ += n;
+      head_dirty_ = true;
+
+      this->reclaim();
+
+      if (queue.size() <= memory_limit_ / 2) {
+         this->load(queue);
+      }
+   }
+
+   void update_spool::sync()
+   {
+      if (head_dirty_) {
+         boost::uint32_t delivered = delivered_ - head_index_ * capacity();
+         if (head_index_ == tail_index_) {
+            ((header*) tail_)->delivered = delivered;
+         } else {
+            (void) pwrite(head_fd_, &delivered, sizeof(delivered), offsetof(header, delivered));
+            flush(head_fd_);
+         }
+         head_dirty_ = false;
+      }
+
+      (void) msync(tail_, segment_size, MS_SYNC);
+   }
+
+   boost::uint64_t update_spool::size() const
+   {
+      return appended_ - delivered_;
+   }
+
+   boost::uint64_t update_spool::capacity()
+   {
+      return (segment_size - header_size) / sizeof(update);
+   }
+
+   boost::filesystem::path update_spool::segment_path(boost::uint64_t index) const
+   {
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx.spool", (unsigned long long) index);
+      return directory_ / name;
+   }
+
+   void update_spool::open_tail(boost::uint64_t index, bool create)
+   {
+      // The current tail stays in place until the next one is ready, so a failure leaves the spool
+      // as it was and the next push tries again
+
+      boost::filesystem::path path = this->segment_path(index);
+
+      int fd = open(path.string().c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+      if (fd == -1) {
+         fail("Cannot open the spool segment", path);
+      }
+
+      // Reserve the blocks up front; running out of disk while writing to the mapping would be fatal
+
+      if (create) {
+         errno = reserve(fd, segment_size);
+         if (errno != 0) {
+            close(fd);
+            unlink(path.string().c_str());
+            fail("Cannot allocate the spool segment", path);
+         }
+      } else {
+         struct stat st;
+         if (fstat(fd, &st) != 0 || st.st_size < segment_size) {
+            close(fd);
+            throw std::runtime_error("Truncated spool segment " + path.string());
+         }
+      }
+
+      void* mapping = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+         int error = errno;
+         close(fd);
+         if (create) {
+            unlink(path.string().c_str());
+         }
+         errno = error;
+         fail("Cannot map the spool segment", path);
+      }
+
+      header* h = (header*) mapping;
+      if (create) {
+         memcpy(h->magic, spool_magic, sizeof(spool_magic));
+         h->count = 0;
+         h->delivered = 0;
+      } else if (memcmp(h->magic, spool_magic, sizeof(spool_magic)) != 0 || h->count > capacity()) {
+         munmap(mapping, segment_size);
+         close(fd);
+         throw std::runtime_error("Not a spool segment: " + path.string());
+      }
+
+      this->close_tail();
+
+      tail_fd_ = fd;
+      tail_ = (char*) mapping;
+      tail_index_ = index;
+   }
+
+   void update_spool::close_tail()
+   {
+      if (tail_ != NULL) {
+         (void) msync(tail_, segment_size, MS_SYNC);
+         munmap(tail_, segment_size);
+         tail_ = NULL;
+      }
+
+      if (tail_fd_ != -1) {
+         close(tail_fd_);
+         tail_fd_ = -1;
+      }
+   }
+
+   void update_spool::open_head(boost::uint64_t index)
+   {
+      boost::filesystem::path path = this->segment_path(index);
+
+      head_fd_ = open(path.string().c_str(), O_RDWR);
+      if (head_fd_ == -1) {
+         fail("Cannot open the spool segment", path);
+      }
+
+      head_index_ = index;
+   }
+
+   void update_spool::close_head()
+   {
+      if (head_fd_ != -1) {
+         close(head_fd_);
+         head_fd_ = -1;
+      }
+   }
+
+   void update_spool::load(update_queue& queue)
+   {
+      std::vector<update> batch;
+
+      while (loaded_ < appended_ && queue.size() < memory_limit_) {
+         boost::uint64_t index = loaded_ / capacity();
+         boost::uint64_t offset = loaded_ % capacity();
+
+         size_t n = capacity() - offset;
+         if (n > appended_ - loaded_) {
+            n = appended_ - loaded_;
+         }
+         if (n > memory_limit_ - queue.size()) {
+            n = memory_limit_ - queue.size();
+         }
+
+         batch.resize(n);
+
+         if (index == tail_index_) {
+            memcpy(&batch[0], tail_ + header_size + offset * sizeof(update), n * sizeof(update));
+         } else {
+            boost::filesystem::path path = this->segment_path(index);
+            int fd = open(path.string().c_str(), O_RDONLY);
+            if (fd == -1) {
+               fail("Cannot open the spool segment", path);
+            }
+            ssize_t length = pread(fd, &batch[0], n * sizeof(update), header_size + offset * sizeof(update));
+            close(fd);
+            if (length != (ssize_t) (n * sizeof(update))) {
+               fail("Cannot read the spool segment", path);
+            }
+         }
+
+         queue.insert(queue.end(), batch.begin(), batch.end());
+         loaded_ += n;
+      }
+   }
+
+   void update_spool::reclaim()
+   {
+      while (head_index_ < tail_index_ && delivered_ >= (head_index_ + 1) * capacity()) {
+         this->close_head();
+         unlink(this->segment_path(head_index_).string().c_str());
+         this->open_head(head_index_ + 1);
+      }
+   }
+
+}
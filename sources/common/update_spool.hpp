@@ -0,0 +1,94 @@
+// update_spool.hpp
+
+#ifndef PYZOR_UPDATE_SPOOL_HPP
+#define PYZOR_UPDATE_SPOOL_HPP
+
+#include <boost/cstdint.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "update.hpp"
+
+namespace pyzor {
+
+   /// Keeps the updates that were not delivered yet in a journal on disk, so that they survive a
+   /// restart and an outage of the master does not grow the memory of the sender.
+   ///
+   /// Every update is appended to the last segment file, which is mapped into memory. The queue of
+   /// the sender holds the oldest updates up to the memory limit; the rest waits on disk and is
+   /// read back in large sequential batches as the queue drains. A segment is removed once all of
+   /// its updates were delivered. sync() flushes the journal to disk; it is meant to be called on
+   /// a timer so that many appends share one flush.
+
+   class update_spool : boost::noncopyable
+   {
+      public:
+
+         enum { segment_size = 4 * 1024 * 1024, header_size = 16 };
+
+      public:
+
+         /// Picks up the updates a previous run left in the directory and loads the oldest ones
+         /// into the queue
+         update_spool(boost::filesystem::path const& directory, size_t memory_limit, update_queue& queue);
+         ~update_spool();
+
+      public:
+
+         /// Journal an update; it goes into the queue too if nothing older is waiting on disk
+         void push(update const& u, update_queue& queue);
+
+         /// The first n updates of the queue were delivered
+         void delivered(size_t n, update_queue& queue);
+
+         void sync();
+
+         /// The updates that were not delivered yet, on disk and in the queue
+         boost::uint64_t size() const;
+
+      private:
+
+         struct header
+         {
+            public:
+
+               char magic[8];
+               boost::uint32_t count;
+               boost::uint32_t delivered;
+         };
+
+      private:
+
+         static boost::uint64_t capacity();
+         boost::filesystem::path segment_path(boost::uint64_t index) const;
+
+         void open_tail(boost::uint64_t index, bool create);
+         void close_tail();
+         void open_head(boost::uint64_t index);
+         void close_head();
+
+         void load(update_queue& queue);
+         void reclaim();
+
+      private:
+
+         boost::filesystem::path directory_;
+         size_t memory_limit_;
+
+         // Positions count updates from the start of the first segment there ever was
+         boost::uint64_t delivered_;
+         boost::uint64_t loaded_;
+         boost::uint64_t appended_;
+
+         boost::uint64_t head_index_;
+         int head_fd_;
+         bool head_dirty_;
+
+         boost::uint64_t tail_index_;
+         int tail_fd_;
+         char* tail_;
+   };
+
+}
+
+#endif // PYZOR_UPDATE_SPOOL_HPP
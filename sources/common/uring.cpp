@@ -0,0 +1,432 @@
+// uring.cpp
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <stdexcept>
+
+#include "uring.hpp"
+
+namespace pyzor {
+
+#if defined(PYZOR_HAVE_IO_URING)
+
+   namespace {
+
+      enum { receive_tag = 1, send_tag = 2, cancel_tag = 3 };
+
+      inline boost::uint64_t make_tag(boost::uint64_t kind, boost::uint64_t index)
+      {
+         return (kind << 32) | index;
+      }
+
+      int io_uring_setup(unsigned entries, io_uring_params* params)
+      {
+         return (int) ::syscall(__NR_io_uring_setup, entries, params);
+      }
+
+      int io_uring_enter(int ring, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t size)
+      {
+         return (int) ::syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, arg, size);
+      }
+
+      int io_uring_register(int ring, unsigned opcode, void* arg, unsigned count)
+      {
+         return (int) ::syscall(__NR_io_uring_register, ring, opcode, arg, count);
+      }
+
+      size_t round_up_power_of_two(size_t n)
+      {
+         size_t p = 1;
+         while (p < n) {
+            p <<= 1;
+         }
+         return p;
+      }
+
+      size_t ignore_request(const char*, size_t, char*, size_t, asio::ip::udp::endpoint const&)
+      {
+         return 0;
+      }
+
+   }
+
+   bool uring_listener::supported()
+   {
+      try {
+         uring_listener probe(&ignore_request, 2, 64);
+         return true;
+      } catch (std::exception const& e) {
+         return false;
+      }
+   }
+
+   uring_listener::uring_listener(request_handler handler, unsigned entries, size_t datagram_size)
+      : handler_(handler), entries_(round_up_power_of_two(entries)), datagram_size_(datagram_size),
+        buffer_size_(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + datagram_size),
+        ring_(-1), ring_memory_(MAP_FAILED), ring_memory_size_(0), sqes_((io_uring_sqe*) MAP_FAILED), sqes_size_(0),
+        sq_local_tail_(0), to_submit_(0), buffer_ring_((io_uring_buf*) MAP_FAILED), buffer_ring_size_(0),
+        buffer_tail_(0), buffers_(entries_ * buffer_size_), send_slots_(entries_), responses_(entries_ * datagram_size),
+        socket_(-1), receiving_(false), armed_(false), received_(false), failed_(false)
+   {
+      try {
+         this->setup();
+      } catch (...) {
+         this->teardown();
+         throw;
+      }
+   }
+
+   uring_listener::~uring_listener()
+   {
+      this->teardown();
+   }
+
+   void uring_listener::setup()
+   {
+      // Create the ring. Room for one receive, a cancel and a send per buffer.
+
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+
+      ring_ = io_uring_setup(entries_ * 2, &params);
+      if (ring_ < 0) {
+         throw std::runtime_error(std::string("Cannot create io_uring: ") + strerror(errno));
+      }
+
+      if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_EXT_ARG) == 0) {
+         throw std::runtime_error("The kernel's io_uring is too old");
+      }
+
+      size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      ring_memory_size_ = (sq_size > cq_size) ? sq_size : cq_size;
+
+      ring_memory_ = ::mmap(NULL, ring_memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+      if (ring_memory_ == MAP_FAILED) {
+         throw std::runtime_error(std::string("Cannot map the io_uring rings: ") + strerror(errno));
+      }
+
+      sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+      sqes_ = (io_uring_sqe*) ::mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+      if (sqes_ == MAP_FAILED) {
+         throw std::runtime_error(std::string("Cannot map the io_uring submission entries: ") + strerror(errno));
+      }
+
+      char* base = (char*) ring_memory_;
+
+      sq_head_ = (unsigned*) (base + params.sq_off.head);
+      sq_tail_ = (unsigned*) (base + params.sq_off.tail);
+      sq_mask_ = *(unsigned*) (base + params.sq_off.ring_mask);
+      sq_entries_ = params.sq_entries;
+      sq_array_ = (unsigned*) (base + params.sq_off.array);
+      sq_local_tail_ = *sq_tail_;
+
+      cq_head_ = (unsigned*) (base + params.cq_off.head);
+      cq_tail_ = (unsigned*) (base + params.cq_off.tail);
+      cq_mask_ = *(unsigned*) (base + params.cq_off.ring_mask);
+      cqes_ = (io_uring_cqe*) (base + params.cq_off.cqes);
+
+      // Register the provided buffer ring that the multishot receive picks from. The ring is used as a
+      // plain array of io_uring_buf; the kernel keeps the tail in the reserved field of the first entry.
+      // Going through io_uring_buf_ring does not work from C++, where its flexible array member moves.
+
+      buffer_ring_size_ = entries_ * sizeof(io_uring_buf);
+      buffer_ring_ = (io_uring_buf*) ::mmap(NULL, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+      if (buffer_ring_ == MAP_FAILED) {
+         throw std::runtime_error(std::string("Cannot allocate the buffer ring: ") + strerror(errno));
+      }
+
+      io_uring_buf_reg registration;
+      memset(&registration, 0, sizeof(registration));
+      registration.ring_addr = (boost::uint64_t) (uintptr_t) buffer_ring_;
+      registration.ring_entries = entries_;
+      registration.bgid = 0;
+
+      if (io_uring_register(ring_, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+         throw std::runtime_error(std::string("Cannot register the buffer ring: ") + strerror(errno));
+      }
+
+      buffer_tail_ = 0;
+      for (unsigned i = 0; i < entries_; i++) {
+         recycle_buffer(i);
+      }
+      __atomic_store_n(&buffer_ring_[0].resv, buffer_tail_, __ATOMIC_RELEASE);
+
+      // Every receive asks for room for the sender address in front of the payload
+
+      memset(&receive_message_, 0, sizeof(receive_message_));
+      receive_message_.msg_namelen = sizeof(sockaddr_storage);
+
+      free_send_slots_.reserve(entries_);
+      for (unsigned i = 0; i < entries_; i++) {
+         free_send_slots_.push_back(entries_ - i - 1);
+      }
+   }
+
+   void uring_listener::teardown()
+   {
+      if (ring_ >= 0) {
+         ::close(ring_);
+         ring_ = -1;
+      }
+
+      if (buffer_ring_ != MAP_FAILED) {
+         ::munmap(buffer_ring_, buffer_ring_size_);
+         buffer_ring_ = (io_uring_buf*) MAP_FAILED;
+      }
+
+      if (sqes_ != MAP_FAILED) {
+         ::munmap(sqes_, sqes_size_);
+         sqes_ = (io_uring_sqe*) MAP_FAILED;
+      }
+
+      if (ring_memory_ != MAP_FAILED) {
+         ::munmap(ring_memory_, ring_memory_size_);
+         ring_memory_ = MAP_FAILED;
+      }
+   }
+
+   //
+
+   void uring_listener::start(int socket)
+   {
+      socket_ = socket;
+      receiving_ = true;
+      arm_receive();
+   }
+
+   void uring_listener::stop()
+   {
+      if (receiving_) {
+         receiving_ = false;
+         if (armed_) {
+            io_uring_sqe* sqe = next_sqe();
+            if (sqe != NULL) {
+               sqe->opcode = IORING_OP_ASYNC_CANCEL;
+               sqe->addr = make_tag(receive_tag, 0);
+               sqe->user_data = make_tag(cancel_tag, 0);
+            }
+         }
+      }
+   }
+
+   bool uring_listener::failed() const
+   {
+      return failed_;
+   }
+
+   size_t uring_listener::run_once(int timeout)
+   {
+      submit(1, timeout);
+
+      size_t answered = 0;
+
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+      for (; head != tail; head++) {
+         io_uring_cqe const& cqe = cqes_[head & cq_mask_];
+         switch (cqe.user_data >> 32) {
+            case receive_tag:
+               if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                  answered++;
+               }
+               handle_receive(cqe);
+               break;
+            case send_tag:
+               free_send_slots_.push_back((unsigned) (cqe.user_data & 0xffffffff));
+               break;
+         }
+      }
+
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      __atomic_store_n(&buffer_ring_[0].resv, buffer_tail_, __ATOMIC_RELEASE);
+
+      // The kernel drops the multishot receive when it runs out of buffers; pick it up again now
+      // that they have been handed back.
+
+      if (receiving_ && !armed_ && !failed_) {
+         arm_receive();
+      }
+
+      return answered;
+   }
+
+   //
+
+   io_uring_sqe* uring_listener::next_sqe()
+   {
+      if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+         submit(0, 0);
+         if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            return NULL;
+         }
+      }
+
+      unsigned index = sq_local_tail_ & sq_mask_;
+      io_uring_sqe* sqe = &sqes_[index];
+      memset(sqe, 0, sizeof(io_uring_sqe));
+      sq_array_[index] = index;
+      sq_local_tail_++;
+      to_submit_++;
+
+      return sqe;
+   }
+
+   void uring_listener::submit(unsigned wait, int timeout)
+   {
+      __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+
+      if (to_submit_ == 0 && wait == 0) {
+         return;
+      }
+
+      unsigned flags = 0;
+      io_uring_getevents_arg arg;
+      __kernel_timespec ts;
+
+      if (wait != 0) {
+         flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+         memset(&arg, 0, sizeof(arg));
+         ts.tv_sec = timeout / 1000;
+         ts.tv_nsec = (timeout % 1000) * 1000000;
+         arg.ts = (boost::uint64_t) (uintptr_t) &ts;
+      }
+
+      int ret = io_uring_enter(ring_, to_submit_, wait, flags, (wait != 0) ? &arg : NULL, (wait != 0) ? sizeof(arg) : 0);
+      if (ret >= 0) {
+         to_submit_ -= ((unsigned) ret > to_submit_) ? to_submit_ : (unsigned) ret;
+      }
+   }
+
+   void uring_listener::arm_receive()
+   {
+      io_uring_sqe* sqe = next_sqe();
+      if (sqe != NULL) {
+         sqe->opcode = IORING_OP_RECVMSG;
+         sqe->fd = socket_;
+         sqe->addr = (boost::uint64_t) (uintptr_t) &receive_message_;
+         sqe->len = 1;
+         sqe->ioprio = IORING_RECV_MULTISHOT;
+         sqe->flags = IOSQE_BUFFER_SELECT;
+         sqe->buf_group = 0;
+         sqe->user_data = make_tag(receive_tag, 0);
+         armed_ = true;
+      }
+   }
+
+   void uring_listener::handle_receive(io_uring_cqe const& cqe)
+   {
+      if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+         armed_ = false;
+      }
+
+      if (cqe.res < 0) {
+         // A kernel without multishot recvmsg rejects the very first submission
+         if (cqe.res == -EINVAL && !received_) {
+            failed_ = true;
+         }
+         return;
+      }
+
+      if ((cqe.flags & IORING_CQE_F_BUFFER) == 0) {
+         return;
+      }
+
+      received_ = true;
+
+      unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      char* buffer = &buffers_[id * buffer_size_];
+
+      io_uring_recvmsg_out* out = (io_uring_recvmsg_out*) buffer;
+      char* name = buffer + sizeof(io_uring_recvmsg_out);
+      char* payload = name + receive_message_.msg_namelen + receive_message_.msg_controllen;
+
+      if ((out->flags & MSG_TRUNC) == 0 && out->namelen <= sizeof(sockaddr_storage) && !free_send_slots_.empty()) {
+         unsigned slot = free_send_slots_.back();
+         char* response = &responses_[slot * datagram_size_];
+
+         asio::ip::udp::endpoint sender_endpoint;
+         memcpy(sender_endpoint.data(), name, out->namelen);
+         sender_endpoint.resize(out->namelen);
+
+         size_t length = handler_(payload, out->payloadlen, response, datagram_size_, sender_endpoint);
+         if (length > datagram_size_) {
+            length = datagram_size_;
+         }
+
+         io_uring_sqe* sqe = next_sqe();
+         if (sqe != NULL) {
+            free_send_slots_.pop_back();
+
+            send_slot& s = send_slots_[slot];
+            memcpy(&s.address, name, out->namelen);
+            s.vector.iov_base = response;
+            s.vector.iov_len = length;
+            memset(&s.message, 0, sizeof(s.message));
+            s.message.msg_name = &s.address;
+            s.message.msg_namelen = out->namelen;
+            s.message.msg_iov = &s.vector;
+            s.message.msg_iovlen = 1;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = socket_;
+            sqe->addr = (boost::uint64_t) (uintptr_t) &s.message;
+            sqe->len = 1;
+            sqe->user_data = make_tag(send_tag, slot);
+         }
+      }
+
+      recycle_buffer(id);
+   }
+
+   void uring_listener::recycle_buffer(unsigned short id)
+   {
+      io_uring_buf& b = buffer_ring_[buffer_tail_ & (entries_ - 1)];
+      b.addr = (boost::uint64_t) (uintptr_t) &buffers_[id * buffer_size_];
+      b.len = buffer_size_;
+      b.bid = id;
+      buffer_tail_++;
+   }
+
+#else
+
+   bool uring_listener::supported()
+   {
+      return false;
+   }
+
+   uring_listener::uring_listener(request_handler handler, unsigned entries, size_t datagram_size)
+   {
+      throw std::runtime_error("io_uring is not supported on this platform");
+   }
+
+   uring_listener::~uring_listener()
+   {
+   }
+
+   void uring_listener::start(int socket)
+   {
+   }
+
+   void uring_listener::stop()
+   {
+   }
+
+   bool uring_listener::failed() const
+   {
+      return true;
+   }
+
+   size_t uring_listener::run_once(int timeout)
+   {
+      return 0;
+   }
+
+#endif
+
+}
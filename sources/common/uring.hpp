@@ -0,0 +1,128 @@
+// uring.hpp
+
+#ifndef PYZOR_URING_HPP
+#define PYZOR_URING_HPP
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <asio.hpp>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PYZOR_HAVE_IO_URING 1
+#endif
+#endif
+
+namespace pyzor {
+
+   /// An io_uring based UDP receive loop. A single multishot recvmsg picks buffers from a provided
+   /// buffer ring, so the kernel keeps delivering datagrams without a syscall per packet. Responses
+   /// are queued as sendmsg submissions and go to the kernel together with the next wait.
+   ///
+   /// The listener is driven from the thread that owns it by calling run_once() in a loop. It does
+   /// not own the socket. If the kernel turns out not to support multishot recvmsg, failed() becomes
+   /// true and the caller should go back to asio.
+
+   class uring_listener : boost::noncopyable
+   {
+      public:
+
+         typedef boost::function<size_t (const char* data, size_t length, char* response, size_t response_size,
+            asio::ip::udp::endpoint const& sender_endpoint)> request_handler;
+
+      public:
+
+         static bool supported();
+
+      public:
+
+         uring_listener(request_handler handler, unsigned entries = 256, size_t datagram_size = 8192);
+         ~uring_listener();
+
+      public:
+
+         void start(int socket);
+         void stop();
+         bool failed() const;
+
+         /// Submit queued work, wait up to timeout milliseconds for completions and handle them.
+         /// Returns the number of requests that were answered.
+         size_t run_once(int timeout);
+
+#if defined(PYZOR_HAVE_IO_URING)
+      private:
+
+         struct send_slot
+         {
+            public:
+
+               msghdr message;
+               iovec vector;
+               sockaddr_storage address;
+         };
+
+      private:
+
+         void setup();
+         void teardown();
+
+         io_uring_sqe* next_sqe();
+         void submit(unsigned wait, int timeout);
+
+         void arm_receive();
+         void handle_receive(io_uring_cqe const& cqe);
+         void recycle_buffer(unsigned short id);
+
+      private:
+
+         request_handler handler_;
+         unsigned entries_;
+         size_t datagram_size_;
+         size_t buffer_size_;
+
+         int ring_;
+         void* ring_memory_;
+         size_t ring_memory_size_;
+         io_uring_sqe* sqes_;
+         size_t sqes_size_;
+
+         unsigned* sq_head_;
+         unsigned* sq_tail_;
+         unsigned sq_mask_;
+         unsigned sq_entries_;
+         unsigned* sq_array_;
+         unsigned sq_local_tail_;
+         unsigned to_submit_;
+
+         unsigned* cq_head_;
+         unsigned* cq_tail_;
+         unsigned cq_mask_;
+         io_uring_cqe* cqes_;
+
+         io_uring_buf* buffer_ring_;
+         size_t buffer_ring_size_;
+         unsigned short buffer_tail_;
+         std::vector<char> buffers_;
+
+         std::vector<send_slot> send_slots_;
+         std::vector<char> responses_;
+         std::vector<unsigned> free_send_slots_;
+
+         msghdr receive_message_;
+         int socket_;
+         bool receiving_;
+         bool armed_;
+         bool received_;
+         bool failed_;
+#endif
+   };
+
+}
+
+#endif // PYZOR_URING_HPP
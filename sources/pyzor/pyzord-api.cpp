@@ -16,9 +16,9 @@
 #include "common.hpp"
 #include "daemon.hpp"
 #include "database.hpp"
+#include "hash.hpp"
 #include "httpd.hpp"
 #include "record.hpp"
-#include "packet.hpp"
 #include "syslog.hpp"
 #include "statistics.hpp"
 
@@ -97,6 +97,12 @@ class api_request_handler : public http::server::request_handler
             errors.push_back(api_error("NoSuchVersion", "An incorrect version was specified. Current API version is 2007-11-26."));
          }
 
+         // Check if the hash is a 40 digit hex digest
+
+         if (parameters.find("Hash") != parameters.end() && !pyzor::hash::valid(parameters["Hash"].data(), parameters["Hash"].length())) {
+            errors.push_back(api_error("InvalidParameter", "The 'Hash' parameter must be 40 hexadecimal digits."));
+         }
+
          if (!errors.empty()) {
             rep = error_reply(errors);
          } else {
@@ -171,13 +177,13 @@ class api_request_handler : public http::server::request_handler
 
       void handle_report(const http::server::request& req, http::server::reply& rep, std::map<std::string,std::string>& parameters)
       {
-         db_.report(parameters["Hash"]);
+         db_.report(pyzor::hash(parameters["Hash"]));
          rep = nil_reply();
       }
 
       void handle_whitelist(const http::server::request& req, http::server::reply& rep, std::map<std::string,std::string>& parameters)
       {
-         db_.whitelist(parameters["Hash"]);
+         db_.whitelist(pyzor::hash(parameters["Hash"]));
          rep = nil_reply();
       }
 
@@ -190,7 +196,7 @@ class api_request_handler : public http::server::request_handler
       void handle_get(const http::server::request& req, http::server::reply& rep, std::map<std::string,std::string>& parameters)
       {
          pyzor::record r;
-         if (db_.get(parameters["Hash"], r) == true) {
+         if (db_.get(pyzor::hash(parameters["Hash"]), r) == true) {
             // ...
          }
             
@@ -32,7 +32,7 @@ struct pyzor_master_options
       
       pyzor_master_options()
          : verbose(false), debug(false), user(NULL), cache(32), home("/var/lib/pyzor"), local("127.0.0.1"),
-           uid(0), gid(0)
+           batch(1), batch_delay(10), threads(1), partition_days(0), uid(0), gid(0)
       {
       }
       
@@ -40,13 +40,13 @@ struct pyzor_master_options
       
       void usage()
       {
-         std::cout << "usage: pyzord-master [-v] [-x] [-u user] [-c cache-size] [-d database-dir] -l local-replica-address [-r remote-replica-adress]" << std::endl;
+         std::cout << "usage: pyzord-master [-v] [-x] [-u user] [-c cache-size] [-d database-dir] -l local-replica-address [-r remote-replica-adress] [-b batch-size] [-w batch-delay-ms] [-t apply-threads] [-p partition-days]" << std::endl;
       }
       
       bool parse(int argc, char** argv)
       {
          char c;
-         while ((c = getopt(argc, argv, "hvxu:c:d:l:r:")) != EOF) {
+         while ((c = getopt(argc, argv, "hvxu:c:d:l:r:b:w:t:p:")) != EOF) {
             switch (c) {
                case 'v':
                   verbose = true;
@@ -77,6 +77,34 @@ struct pyzor_master_options
                case 'r':
                   slaves.push_back(optarg);
                   break;
+               case 'b':
+                  batch = std::atoi(optarg);
+                  if (batch < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'w':
+                  batch_delay = std::atoi(optarg);
+                  if (batch_delay < 0) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 't':
+                  threads = std::atoi(optarg);
+                  if (threads < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'p':
+                  partition_days = std::atoi(optarg);
+                  if (partition_days < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
                case 'h':
                default:
                   usage();
@@ -96,6 +124,10 @@ struct pyzor_master_options
       char* home;
       char* local;
       std::vector<std::string> slaves;
+      int batch;
+      int batch_delay;
+      int threads;
+      int partition_days;
 
       uid_t uid;
       gid_t gid;
@@ -109,6 +141,15 @@ int pyzor_master_main(pyzor_master_options& options)
    try {
       asio::io_service io_service;
       pyzor::master master(syslog, io_service, options.home, options.local, options.slaves, options.verbose);
+      if (options.batch > 1) {
+         master.enable_group_commit(options.batch, options.batch_delay);
+      }
+      if (options.threads > 1) {
+         master.enable_apply_threads(options.threads);
+      }
+      if (options.partition_days > 0) {
+         master.enable_partitions(options.partition_days);
+      }
       pyzor::run_in_thread(boost::bind(&pyzor::master::run, &master), boost::bind(&pyzor::master::stop, &master));
       syslog.notice() << "Server exited gracefully";
    } catch (std::exception& e) {
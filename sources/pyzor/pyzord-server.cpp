@@ -4,7 +4,10 @@
 #include <sys/stat.h>
 #include <pwd.h>
 
+#include <cstdlib>
+
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "common.hpp"
 #include "daemon.hpp"
@@ -13,6 +16,7 @@
 #include "record.hpp"
 #include "packet.hpp"
 #include "server.hpp"
+#include "slave.hpp"
 #include "syslog.hpp"
 #include "statistics.hpp"
 
@@ -23,7 +27,7 @@ struct pyzord_server_options
    public:
       
       pyzord_server_options()
-         : verbose(false), debug(false), local("127.0.0.1"), port("24441"), home("/var/lib/pyzor"), user(NULL), uid(0), gid(0)
+         : verbose(false), debug(false), local("127.0.0.1"), port("24441"), home("/var/lib/pyzor"), user(NULL), threads(1), batch(1), io_uring(false), cache(0), cache_ttl(60), filter(false), table(NULL), lookup_threads(0), lookup_queue(1024), stream(false), unix_socket(NULL), shm(NULL), max_queue_age(0), source_rate(0), handoff(NULL), hot_digests(NULL), master(NULL), replica("127.0.0.1"), replica_cache(32), spool(NULL), spool_memory(16), uid(0), gid(0)
       {
       }
       
@@ -31,13 +35,13 @@ struct pyzord_server_options
       
       void usage()
       {
-         std::cout << "usage: pyzord-server [-v] [-x] [-u user] [-d database-dir] [-l pyzor-address] [-p pyzor-port] [-a admin-ip-address]" << std::endl;
+         std::cout << "usage: pyzord-server [-v] [-x] [-u user] [-d database-dir] [-l pyzor-address] [-p pyzor-port] [-t threads] [-b batch-size] [-i] [-c cache-mb] [-e cache-ttl] [-f] [-m signature-table] [-w lookup-threads] [-q lookup-queue] [-T] [-s unix-socket] [-S shm-name] [-o max-queue-ms] [-r source-rate] [-H handoff-socket] [-W hot-digests] [-R master-replica-address [-L local-replica-address] [-C replica-cache-mb] [-P other-slave-address]] [-j spool-dir] [-k spool-memory-mb] [-a admin-ip-address]" << std::endl;
       }
       
       bool parse(int argc, char** argv)
       {
          char c;
-         while ((c = getopt(argc, argv, "xhvd:u:p:l:a:")) != EOF) {
+         while ((c = getopt(argc, argv, "xhvifTd:u:p:l:a:t:b:c:e:m:w:q:s:S:o:r:H:W:R:L:C:P:j:k:")) != EOF) {
             switch (c) {
                case 'x':
                   debug = true;
@@ -57,6 +61,112 @@ struct pyzord_server_options
                case 'a':
                   admin_addresses.push_back(optarg);
                   break;
+               case 't':
+                  threads = atoi(optarg);
+                  if (threads < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'b':
+                  batch = atoi(optarg);
+                  if (batch < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'i':
+                  io_uring = true;
+                  break;
+               case 'f':
+                  filter = true;
+                  break;
+               case 'T':
+                  stream = true;
+                  break;
+               case 's':
+                  unix_socket = optarg;
+                  break;
+               case 'S':
+                  shm = optarg;
+                  break;
+               case 'm':
+                  table = optarg;
+                  break;
+               case 'W':
+                  hot_digests = optarg;
+                  break;
+               case 'H':
+                  handoff = optarg;
+                  break;
+               case 'R':
+                  master = optarg;
+                  break;
+               case 'L':
+                  replica = optarg;
+                  break;
+               case 'C':
+                  replica_cache = atoi(optarg);
+                  if (replica_cache < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'P':
+                  slaves.push_back(optarg);
+                  break;
+               case 'j':
+                  spool = optarg;
+                  break;
+               case 'k':
+                  spool_memory = atoi(optarg);
+                  if (spool_memory < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'o':
+                  max_queue_age = atoi(optarg);
+                  if (max_queue_age < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'r':
+                  source_rate = atoi(optarg);
+                  if (source_rate < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'w':
+                  lookup_threads = atoi(optarg);
+                  if (lookup_threads < 0) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'q':
+                  lookup_queue = atoi(optarg);
+                  if (lookup_queue < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'c':
+                  cache = atoi(optarg);
+                  if (cache < 0) {
+                     usage();
+                     return false;
+                  }
+                  break;
+               case 'e':
+                  cache_ttl = atoi(optarg);
+                  if (cache_ttl < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
                case 'u': {
                   user = optarg;
                   struct passwd* passwd = getpwnam(user);
@@ -75,6 +185,14 @@ struct pyzord_server_options
             }
          }
 
+         // The replacement of a combined server would open the replicated environment with recovery
+         // and bind the replication site while this process still holds both
+
+         if (handoff != NULL && master != NULL) {
+            std::cout << "pyzord-server: -H cannot be combined with -R." << std::endl;
+            return false;
+         }
+
          return true;
       }
 
@@ -86,6 +204,28 @@ struct pyzord_server_options
       char* port;
       char* home;
       char* user;
+      int threads;
+      int batch;
+      bool io_uring;
+      int cache;
+      int cache_ttl;
+      bool filter;
+      char* table;
+      int lookup_threads;
+      int lookup_queue;
+      bool stream;
+      char* unix_socket;
+      char* shm;
+      int max_queue_age;
+      int source_rate;
+      char* handoff;
+      char* hot_digests;
+      char* master;
+      char* replica;
+      int replica_cache;
+      std::vector<std::string> slaves;
+      char* spool;
+      int spool_memory;
       std::vector<std::string> admin_addresses;
       uid_t uid;
       gid_t gid;
@@ -98,8 +238,64 @@ int pyzord_server_main(pyzord_server_options& options)
 
    try {
       asio::io_service io_service;      
-      pyzor::database db(syslog, io_service, options.home, options.verbose);
-      pyzor::server server(syslog, io_service, options.local, options.port, db, options.verbose);
+
+      // With a master address this process is also the slave: the server reads the replicated
+      // database directly and its reports go to the master without the loopback connection
+
+      boost::scoped_ptr<pyzor::slave> slave;
+      boost::scoped_ptr<pyzor::database> db_ptr;
+      if (options.master != NULL) {
+         syslog.notice() << "Replicating from master " << options.master << " on " << options.replica;
+         slave.reset(new pyzor::slave(syslog, io_service, options.home, options.replica_cache, options.replica, options.master,
+            options.slaves, options.verbose));
+         db_ptr.reset(new pyzor::database(syslog, io_service, options.home, slave->environment(), slave->db(),
+            boost::bind(&pyzor::slave::write_update, slave.get(), _1), boost::bind(&pyzor::slave::pending_updates, slave.get()),
+            options.verbose));
+      } else {
+         db_ptr.reset(new pyzor::database(syslog, io_service, options.home, options.verbose));
+      }
+
+      pyzor::database& db = *db_ptr;
+
+      if (options.spool != NULL) {
+         size_t memory_limit = (size_t) options.spool_memory * 1024 * 1024 / sizeof(pyzor::update);
+         if (slave) {
+            slave->enable_spool(options.spool, memory_limit);
+         } else {
+            db.enable_spool(options.spool, memory_limit);
+         }
+      }
+      if (options.cache > 0) {
+         db.enable_cache((size_t) options.cache * 1024 * 1024, options.cache_ttl);
+      }
+      if (options.filter) {
+         db.enable_filter();
+      }
+      if (options.table != NULL) {
+         db.use_table(options.table);
+      }
+      if (options.hot_digests != NULL) {
+         db.enable_warmup(options.hot_digests);
+      }
+      pyzor::server server(syslog, io_service, options.local, options.port, db, options.threads, options.batch, options.io_uring, options.verbose);
+      if (options.lookup_threads > 0) {
+         server.enable_lookup_pool(options.lookup_threads, options.lookup_queue);
+      }
+      if (options.stream) {
+         server.enable_stream();
+      }
+      if (options.unix_socket != NULL) {
+         server.enable_unix_socket(options.unix_socket);
+      }
+      if (options.shm != NULL) {
+         server.enable_shm(options.shm);
+      }
+      if (options.max_queue_age > 0 || options.source_rate > 0) {
+         server.enable_admission_control(options.max_queue_age, options.source_rate);
+      }
+      if (options.handoff != NULL) {
+         server.enable_handoff(options.handoff);
+      }
       server.add_admin_address("127.0.0.1");
       for (size_t i = 0; i < options.admin_addresses.size(); i++) {
          server.add_admin_address(options.admin_addresses[i]);
@@ -33,7 +33,7 @@ struct pyzor_slave_options
       
       pyzor_slave_options()
          : verbose(false), debug(false), cache(32), local("127.0.0.1"), master(NULL), home("/var/lib/pyzor"),
-           user(NULL), uid(0), gid(0)
+           user(NULL), spool(NULL), spool_memory(16), uid(0), gid(0)
       {
       }
       
@@ -41,13 +41,13 @@ struct pyzor_slave_options
       
       void usage()
       {
-         std::cout << "usage: pyzor-slave [-v] [-x] [-d db-home] [-c cache-size] [-l local-addres] [-u user] -m master [-s slave]" << std::endl;
+         std::cout << "usage: pyzor-slave [-v] [-x] [-d db-home] [-c cache-size] [-l local-addres] [-u user] [-j spool-dir] [-k spool-memory-mb] -m master [-s slave]" << std::endl;
       }
       
       bool parse(int argc, char** argv)
       {
          char c;
-         while ((c = getopt(argc, argv, "hxvd:u:m:l:c:")) != EOF) {
+         while ((c = getopt(argc, argv, "hxvd:u:m:l:c:j:k:")) != EOF) {
             switch (c) {
                case 'x':
                   debug = true;
@@ -81,6 +81,16 @@ struct pyzor_slave_options
                case 's':
                   slaves.push_back(optarg);
                   break;
+               case 'j':
+                  spool = optarg;
+                  break;
+               case 'k':
+                  spool_memory = atoi(optarg);
+                  if (spool_memory < 1) {
+                     usage();
+                     return false;
+                  }
+                  break;
                case 'h':
                default:
                   usage();
@@ -105,6 +115,8 @@ struct pyzor_slave_options
       char* master;
       char* home;
       char* user;
+      char* spool;
+      int spool_memory;
       uid_t uid;
       gid_t gid;
       std::vector<std::string> slaves;
@@ -121,6 +133,9 @@ int pyzor_slave_main(pyzor_slave_options& options)
       asio::io_service io_service;
       pyzor::slave slave(syslog, io_service, options.home, options.cache, options.local, options.master,
          options.slaves, options.verbose);
+      if (options.spool != NULL) {
+         slave.enable_spool(options.spool, (size_t) options.spool_memory * 1024 * 1024 / sizeof(pyzor::update));
+      }
       pyzor::run_in_thread(boost::bind(&pyzor::slave::run, &slave), boost::bind(&pyzor::slave::stop, &slave));
       syslog.notice() << "Server exited gracefully";
    } catch (std::exception& e) {
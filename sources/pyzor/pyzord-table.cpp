@@ -0,0 +1,79 @@
+// pyzord-table.cpp
+
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/timer.hpp>
+
+#include "signature_table.hpp"
+
+struct pyzord_table_options
+{
+   public:
+      
+      pyzord_table_options()
+         : input("pyzor.dump"), output("signatures.tbl")
+      {
+      }
+      
+   public:
+      
+      void usage()
+      {
+         std::cout << "usage: pyzord-table -f dump-file -o table-file" << std::endl;
+      }
+      
+      bool parse(int argc, char** argv)
+      {
+         char c;
+         while ((c = getopt(argc, argv, "f:o:")) != EOF) {
+            switch (c) {
+               case 'f':
+                  input = optarg;
+                  break;
+               case 'o':
+                  output = optarg;
+                  break;
+               default:
+                  usage();
+                  return false;
+            }
+         }
+
+         if (!boost::filesystem::exists(input)) {
+            std::cout << "pyzord-table: dump file does not exist." << std::endl;
+            return false;
+         }
+
+         return true;
+      }
+
+   public:
+      
+      boost::filesystem::path input;
+      boost::filesystem::path output;
+};
+
+int main(int argc, char** argv)
+{
+   int result = 0;
+
+   pyzord_table_options options;
+   if (options.parse(argc, argv)) {
+      try {
+         std::cout << "pyzord-table: building " << options.output << " from " << options.input << std::endl;
+         boost::timer timer;
+         size_t n = pyzor::signature_table::build(options.input, options.output);
+         double elapsed = timer.elapsed();
+         std::cout << "pyzord-table: wrote " << n << " signatures in " << elapsed << " seconds" << std::endl;
+      } catch (std::exception const& e) {
+         std::cout << "pyzord-table: could not build table: " << e.what() << std::endl;
+         result = 1;
+      }
+   } else {
+      result = 1;
+   }
+
+   return result;
+}